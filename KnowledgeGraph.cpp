@@ -1,14 +1,84 @@
 #include "KnowledgeGraph.h"
 
+// =============================================================================
+// Struct MemoryUsage Implementation
+// =============================================================================
+
+MemoryUsage::MemoryUsage() {
+    this->vertexObjects = 0;
+    this->edgeObjects = 0;
+    this->adjacencyUsed = 0;
+    this->adjacencySlack = 0;
+    this->vertexValues = 0;
+    this->duplicateValues = 0;
+    this->indexes = 0;
+}
+
+size_t MemoryUsage::total() {
+    return vertexObjects + edgeObjects + adjacencyUsed + adjacencySlack + vertexValues + duplicateValues + indexes;
+}
+
+string MemoryUsage::toString() {
+    stringstream ss;
+    ss << "(vertexObjects: " << vertexObjects
+       << ", edgeObjects: " << edgeObjects
+       << ", adjacencyUsed: " << adjacencyUsed
+       << ", adjacencySlack: " << adjacencySlack
+       << ", vertexValues: " << vertexValues
+       << ", duplicateValues: " << duplicateValues
+       << ", indexes: " << indexes
+       << ", total: " << total() << ")";
+    return ss.str();
+}
+
+// =============================================================================
+// Struct VertexHash<Point> Implementation
+// =============================================================================
+
+size_t VertexHash<Point>::operator()(const Point& vertex) const {
+    // per-axis primes as in the usual spatial hash, applied to the hashed cell coordinates
+    hash<double> cellHash;
+    return cellHash(floor(vertex.getX() / CELL)) * 73856093u
+         ^ cellHash(floor(vertex.getY() / CELL)) * 19349663u
+         ^ cellHash(floor(vertex.getZ() / CELL)) * 83492791u;
+}
+
+vector<Point> VertexHash<Point>::boundaryProbes(const Point& vertex) {
+    // twice Point's equality slack, so rounding near a boundary only adds probes
+    const double SLACK = 2e-9;
+    double coordinate[3] = {vertex.getX(), vertex.getY(), vertex.getZ()};
+    double cell[3][2];
+    int choices[3];
+    for (int axis = 0; axis < 3; axis++) {
+        double own = floor(coordinate[axis] / CELL);
+        cell[axis][0] = own;
+        choices[axis] = 1;
+        if (coordinate[axis] - own * CELL < SLACK) cell[axis][choices[axis]++] = own - 1;
+        else if ((own + 1) * CELL - coordinate[axis] < SLACK) cell[axis][choices[axis]++] = own + 1;
+    }
+
+    vector<Point> probes;
+    for (int i = 0; i < choices[0]; i++) {
+        for (int j = 0; j < choices[1]; j++) {
+            for (int k = 0; k < choices[2]; k++) {
+                if (i == 0 && j == 0 && k == 0) continue;
+                probes.push_back(Point((cell[0][i] + 0.5) * CELL, (cell[1][j] + 0.5) * CELL, (cell[2][k] + 0.5) * CELL));
+            }
+        }
+    }
+    return probes;
+}
+
 // =============================================================================
 // Class Edge Implementation
 // =============================================================================
 
 template <class T>
-Edge<T>::Edge(VertexNode<T>* from, VertexNode<T>* to, float weight) {
+Edge<T>::Edge(VertexNode<T>* from, VertexNode<T>* to, float weight, int label) {
     this->from = from;
     this->to = to;
     this->weight = weight;
+    this->label = label;
 }
 
 template <class T>
@@ -35,7 +105,7 @@ string Edge<T>::toString() {
 // TODO: Implement other methods of Edge:
 template <class T>
 bool Edge<T>::equals(Edge<T>* edge) {
-    return (this->from == edge->from && this->to == edge->to);
+    return (this->from == edge->from && this->to == edge->to && this->label == edge->label);
 }
 
 template <class T>
@@ -52,8 +122,84 @@ VertexNode<T>::VertexNode(T vertex, bool (*vertexEQ)(T&, T&), string (*vertex2st
     this->vertex = vertex;
     this->vertexEQ = vertexEQ;
     this->vertex2str = vertex2str;
+    this->id_ = -1;
     this->inDegree_ = 0;
     this->outDegree_ = 0;
+    this->outIndex = nullptr;
+    this->partitions = nullptr;
+}
+
+template <class T>
+VertexNode<T>::~VertexNode() {
+    this->dropOutIndex();
+    delete this->partitions;
+}
+
+template <class T>
+void VertexNode<T>::buildOutIndex() {
+    if (outIndex == nullptr) outIndex = new unordered_map<VertexNode<T>*, Edge<T>*>();
+    outIndex->clear();
+    outIndex->reserve(this->outDegree_);
+    // emplace keeps the first parallel edge, matching the linear scan in getEdge
+    for (Edge<T>* edging : adList) {
+        if (edging->from == this) outIndex->emplace(edging->to, edging);
+    }
+    if (partitions != nullptr) {
+        for (LabelPartition<T>& part : *partitions) indexPartition(part);
+    }
+}
+
+template <class T>
+void VertexNode<T>::dropOutIndex() {
+    delete outIndex;
+    outIndex = nullptr;
+    if (partitions != nullptr) {
+        for (LabelPartition<T>& part : *partitions) unordered_map<VertexNode<T>*, Edge<T>*>().swap(part.index);
+    }
+}
+
+template <class T>
+void VertexNode<T>::indexPartition(LabelPartition<T>& part) {
+    part.index.clear();
+    part.index.reserve(part.out.size());
+    // part.out is in insertion order, so emplace keeps the first parallel edge as outIndex does
+    for (Edge<T>* edging : part.out) part.index.emplace(edging->to, edging);
+}
+
+template <class T>
+void VertexNode<T>::ensurePartitions() {
+    if (partitions != nullptr) return;
+    partitions = new vector<LabelPartition<T>>();
+    // nothing labelled has touched this vertex yet, so adList is all label 0
+    LabelPartition<T> unlabelled;
+    unlabelled.label = 0;
+    unlabelled.out = this->outEdges();
+    for (Edge<T>* edging : adList) {
+        if (edging->to != this) continue;
+        if (edging->from == this && find(unlabelled.in.begin(), unlabelled.in.end(), edging) != unlabelled.in.end()) continue;
+        unlabelled.in.push_back(edging);
+    }
+    partitions->push_back(unlabelled);
+    if (outIndex != nullptr) indexPartition(partitions->back());
+}
+
+template <class T>
+LabelPartition<T>* VertexNode<T>::findPartition(int label) {
+    if (partitions == nullptr) return nullptr;
+    for (LabelPartition<T>& part : *partitions) {
+        if (part.label == label) return &part;
+    }
+    return nullptr;
+}
+
+template <class T>
+LabelPartition<T>& VertexNode<T>::partition(int label) {
+    LabelPartition<T>* part = findPartition(label);
+    if (part != nullptr) return *part;
+    LabelPartition<T> created;
+    created.label = label;
+    partitions->push_back(created);
+    return partitions->back();
 }
 
 template <class T>
@@ -62,18 +208,49 @@ T& VertexNode<T>::getVertex() {
 }
 
 template <class T>
-void VertexNode<T>::connect(VertexNode<T>* to, float weight) {
+void VertexNode<T>::connect(VertexNode<T>* to, float weight, int label) {
     // TODO: Connect this vertex to the 'to' vertex
-    Edge<T>* edging = new Edge<T>(this, to, weight);
+    // partitions are seeded from adList, so create them before the new edge lands there
+    if (label != 0) {
+        this->ensurePartitions();
+        to->ensurePartitions();
+    }
+    Edge<T>* edging = new Edge<T>(this, to, weight, label);
+    if (this->partitions != nullptr) {
+        LabelPartition<T>& part = this->partition(label);
+        part.out.push_back(edging);
+        if (outIndex != nullptr) part.index.emplace(to, edging);
+    }
+    if (to->partitions != nullptr) to->partition(label).in.push_back(edging);
     this->adList.push_back(edging);
     to->adList.push_back(edging);
     this->outDegree_++;
     to->inDegree_++;
+    if (outIndex != nullptr) outIndex->emplace(to, edging);
 }
 
 template <class T>
 Edge<T>* VertexNode<T>::getEdge(VertexNode<T>* to) {
+    if (outIndex != nullptr) {
+        auto found = outIndex->find(to);
+        return (found == outIndex->end()) ? nullptr : found->second;
+    }
     for (Edge<T>* edging : adList) {
+        if (edging->from == this && edging->to == to) return edging;
+    }
+    return nullptr;
+}
+
+template <class T>
+Edge<T>* VertexNode<T>::getEdge(VertexNode<T>* to, int label) {
+    if (partitions == nullptr) return (label == 0) ? getEdge(to) : nullptr;
+    LabelPartition<T>* part = findPartition(label);
+    if (part == nullptr) return nullptr;
+    if (outIndex != nullptr) {
+        auto found = part->index.find(to);
+        return (found == part->index.end()) ? nullptr : found->second;
+    }
+    for (Edge<T>* edging : part->out) {
         if (edging->to == to) return edging;
     }
     return nullptr;
@@ -87,25 +264,63 @@ bool VertexNode<T>::equals(VertexNode<T>* node) {
 
 template <class T>
 void VertexNode<T>::removeTo(VertexNode<T>* to) {
-    for (int i = 0; i < adList.size(); i++) {
-        Edge<T>* edging = adList[i];
-        if (edging->to->equals(to)) {
-            adList.erase(adList.begin() + i);
-            
-            for (int j = 0; j < to->adList.size(); j++) {
-                if (to->adList[j] == edging) {
-                    to->adList.erase(to->adList.begin() + j);
+    // adList is in insertion order, so this is the oldest edge to 'to' under any label
+    for (Edge<T>* edging : adList) {
+        if (edging->from == this && edging->to->equals(to)) {
+            removeEdge(edging);
+            return;
+        }
+    }
+}
+
+template <class T>
+bool VertexNode<T>::removeTo(VertexNode<T>* to, int label) {
+    Edge<T>* edging = getEdge(to, label);
+    if (edging == nullptr) return false;
+    removeEdge(edging);
+    return true;
+}
+
+template <class T>
+void VertexNode<T>::removeEdge(Edge<T>* edging) {
+    VertexNode<T>* to = edging->to;
+    adList.erase(find(adList.begin(), adList.end(), edging));
+    // for a self-loop this takes the second copy out of the same list
+    to->adList.erase(find(to->adList.begin(), to->adList.end(), edging));
+
+    if (partitions != nullptr) {
+        LabelPartition<T>& part = partition(edging->label);
+        part.out.erase(find(part.out.begin(), part.out.end(), edging));
+        auto indexed = part.index.find(to);
+        if (indexed != part.index.end() && indexed->second == edging) {
+            part.index.erase(indexed);
+            for (Edge<T>* other : part.out) {
+                if (other->to == to) {
+                    part.index.emplace(to, other);
                     break;
                 }
             }
+        }
+    }
+    if (to->partitions != nullptr) {
+        vector<Edge<T>*>& in = to->partition(edging->label).in;
+        in.erase(find(in.begin(), in.end(), edging));
+    }
 
-            delete edging;
-            this->outDegree_--;
-            to->inDegree_--;
-            break;
+    if (outIndex != nullptr) {
+        // promote the next parallel edge (if any) to the same target
+        outIndex->erase(to);
+        for (Edge<T>* other : adList) {
+            if (other->from == this && other->to == to) {
+                outIndex->emplace(to, other);
+                break;
+            }
         }
     }
-    return;
+
+    delete edging;
+    this->outDegree_--;
+    to->inDegree_--;
 }
 
 template <class T>
@@ -163,6 +378,17 @@ vector<T> VertexNode<T>::getInVertices() {
     return inVertices;
 }
 
+template <class T>
+vector<Edge<T>*> VertexNode<T>::outEdges() {
+    vector<Edge<T>*> edges;
+    for (Edge<T>* edging : adList) {
+        if (edging->from != this) continue;
+        if (edging->to == this && find(edges.begin(), edges.end(), edging) != edges.end()) continue;
+        edges.push_back(edging);
+    }
+    return edges;
+}
+
 // =============================================================================
 // Class DGraphModel Implementation
 // =============================================================================
@@ -171,6 +397,11 @@ template <class T>
 DGraphModel<T>::DGraphModel(bool (*vertexEQ)(T&, T&), string (*vertex2str)(T&)) {
     this->vertexEQ = vertexEQ;
     this->vertex2str = vertex2str;
+    this->edgePolicy = ParallelEdgePolicy::KEEP;
+    this->edgeIndexThreshold = DEFAULT_EDGE_INDEX_THRESHOLD;
+    this->version_ = 0;
+    this->labelNames.push_back("");
+    this->labelIds[""] = 0;
 }
 
 template <class T>
@@ -181,9 +412,14 @@ DGraphModel<T>::~DGraphModel() {
 
 template <class T>
 VertexNode<T>* DGraphModel<T>::getVertexNode(T& vertex) {
-    if (nodeList.empty()) return nullptr;
-    for (VertexNode<T>* node : nodeList) {
-        if (node->vertex == vertex) return node;
+    auto found = vertexIndex.find(vertex);
+    if (found != vertexIndex.end()) return found->second;
+    // an equal value stored under a neighbouring hash (points across a cell boundary)
+    for (T& probe : VertexHash<T>::boundaryProbes(vertex)) {
+        size_t bucket = vertexIndex.bucket(probe);
+        for (auto entry = vertexIndex.begin(bucket); entry != vertexIndex.end(bucket); ++entry) {
+            if (entry->first == vertex) return entry->second;
+        }
     }
     return nullptr;
 }
@@ -204,7 +440,11 @@ template <class T>
 void DGraphModel<T>::add(T vertex) {
     // TODO: Add a new vertex to the graph
     VertexNode<T>* newNode = new VertexNode<T>(vertex, this->vertexEQ, this->vertex2str);
+    newNode->id_ = nodeList.size();
     nodeList.push_back(newNode);
+    version_++;
+    // the first node added for a value wins, as with the old linear lookup
+    vertexIndex.emplace(newNode->vertex, newNode);
 }
 
 template <class T>
@@ -239,8 +479,36 @@ void DGraphModel<T>::connect(T from, T to, float weight) {
     if (fromNode == nullptr) throw VertexNotFoundException();
     VertexNode<T>* toNode = getVertexNode(to);
     if (toNode == nullptr) throw VertexNotFoundException();
+    connectNodes(fromNode, toNode, weight, 0);
+}
+
+template <class T>
+void DGraphModel<T>::connect(T from, T to, float weight, string label) {
+    VertexNode<T>* fromNode = getVertexNode(from);
+    if (fromNode == nullptr) throw VertexNotFoundException();
+    VertexNode<T>* toNode = getVertexNode(to);
+    if (toNode == nullptr) throw VertexNotFoundException();
+    connectNodes(fromNode, toNode, weight, internLabel(label));
+}
+
+template <class T>
+void DGraphModel<T>::connectNodes(VertexNode<T>* fromNode, VertexNode<T>* toNode, float weight, int label) {
+    // edges under different labels are never parallel to each other
+    if (edgePolicy != ParallelEdgePolicy::KEEP) {
+        Edge<T>* existing = fromNode->getEdge(toNode, label);
+        if (existing != nullptr) {
+            if (edgePolicy == ParallelEdgePolicy::REJECT) throw EdgeExistsException();
+            existing->weight = weight;
+            version_++;
+            return;
+        }
+    }
 
-    fromNode->connect(toNode, weight);
+    fromNode->connect(toNode, weight, label);
+    version_++;
+    if (fromNode->outIndex == nullptr && fromNode->outDegree_ >= edgeIndexThreshold) {
+        fromNode->buildOutIndex();
+    }
 }
 
 template <class T>
@@ -251,6 +519,19 @@ void DGraphModel<T>::disconnect(T from, T to) {
     if (toNode == nullptr) throw VertexNotFoundException();
 
     fromNode->removeTo(toNode);
+    version_++;
+}
+
+template <class T>
+void DGraphModel<T>::disconnect(T from, T to, string label) {
+    VertexNode<T>* fromNode = getVertexNode(from);
+    if (fromNode == nullptr) throw VertexNotFoundException();
+    VertexNode<T>* toNode = getVertexNode(to);
+    if (toNode == nullptr) throw VertexNotFoundException();
+
+    int id = labelId(label);
+    if (id < 0 || !fromNode->removeTo(toNode, id)) throw EdgeNotFoundException();
+    version_++;
 }
 
 template <class T>
@@ -276,17 +557,25 @@ bool DGraphModel<T>::empty() {
 
 template <class T>
 void DGraphModel<T>::clear() {
+    // collect first: deleting while scanning would leave dangling in-edges in later adLists
+    vector<Edge<T>*> edges;
     for (VertexNode<T>* node : nodeList) {
         for (Edge<T>* edging : node->adList) {
-            if (edging->from == node) delete edging;
+            if (edging->from == node) edges.push_back(edging);
         }
     }
+    // a self-loop sits in its node's adList twice
+    sort(edges.begin(), edges.end());
+    edges.erase(unique(edges.begin(), edges.end()), edges.end());
+    for (Edge<T>* edging : edges) delete edging;
 
     for (VertexNode<T>* node : nodeList) node->adList.clear();
 
     for (VertexNode<T>* node : nodeList) delete node;
 
     nodeList.clear();
+    vertexIndex.clear();
+    version_++;
 }
 
 template <class T>
@@ -312,6 +601,13 @@ vector<T> DGraphModel<T>::vertices() {
     return vertexList;
 }
 
+template <class T>
+int DGraphModel<T>::vertexId(T vertex) {
+    VertexNode<T>* node = getVertexNode(vertex);
+    if (node == nullptr) throw VertexNotFoundException();
+    return node->id_;
+}
+
 template <class T>
 string DGraphModel<T>::toString() {
     stringstream ss;
@@ -405,237 +701,4742 @@ string DGraphModel<T>::DFS(T start) {
     return ss.str();
 }
 
+template <class T>
+void DGraphModel<T>::setParallelEdgePolicy(ParallelEdgePolicy policy) {
+    this->edgePolicy = policy;
+}
 
-// TODO: Implement other methods of DGraphModel:
-
-// =============================================================================
-// Class KnowledgeGraph Implementation
-// =============================================================================
+template <class T>
+ParallelEdgePolicy DGraphModel<T>::getParallelEdgePolicy() {
+    return this->edgePolicy;
+}
 
-int KnowledgeGraph::getEntityIndex(string entity) {
-    for (int i = 0; i < entities.size(); i++) {
-        if (entities[i] == entity) return i;
+template <class T>
+TriangleCounts DGraphModel<T>::countTriangles(int threads) {
+    // undirected simple adjacency; adList already holds in- and out-edges
+    int n = nodeList.size();
+    vector<int> offsets(n + 1, 0);
+    vector<int> neighbors;
+    for (VertexNode<T>* node : nodeList) {
+        int begin = neighbors.size();
+        for (Edge<T>* edging : node->adList) {
+            VertexNode<T>* other = (edging->from == node) ? edging->to : edging->from;
+            if (other != node) neighbors.push_back(other->id_);
+        }
+        sort(neighbors.begin() + begin, neighbors.end());
+        neighbors.erase(unique(neighbors.begin() + begin, neighbors.end()), neighbors.end());
+        offsets[node->id_ + 1] = neighbors.size();
     }
-    return -1;
+    return TriangleCounter::count(offsets, neighbors, threads);
 }
 
-KnowledgeGraph::KnowledgeGraph() {
-    // TODO: Initialize the KnowledgeGraph
-    // aura farming
-    /*
-    graph = DGraphModel<string>([](string& a, string& b){ return a == b; }, 
-                                [](string& s){ return s; });
-    */
-}
+template <class T>
+MemoryUsage DGraphModel<T>::memoryUsage() {
+    MemoryUsage usage;
+    usage.vertexObjects = nodeList.capacity() * sizeof(VertexNode<T>*) + nodeList.size() * sizeof(VertexNode<T>);
+    for (VertexNode<T>* node : nodeList) {
+        usage.edgeObjects += node->outDegree_ * sizeof(Edge<T>);
+        usage.adjacencyUsed += node->adList.size() * sizeof(Edge<T>*);
+        usage.adjacencySlack += (node->adList.capacity() - node->adList.size()) * sizeof(Edge<T>*);
+        usage.vertexValues += MemoryUsage::valueBytes(node->vertex);
+        if (node->outIndex != nullptr) usage.indexes += MemoryUsage::hashTableBytes(*node->outIndex);
+        if (node->partitions != nullptr) {
+            usage.indexes += node->partitions->capacity() * sizeof(LabelPartition<T>);
+            for (LabelPartition<T>& part : *node->partitions) {
+                usage.indexes += (part.out.capacity() + part.in.capacity()) * sizeof(Edge<T>*);
+                if (node->outIndex != nullptr) usage.indexes += MemoryUsage::hashTableBytes(part.index);
+            }
+        }
+    }
 
-void KnowledgeGraph::addEntity(string entity) {
-    // TODO: Add a new entity to the Knowledge Graph
-    for (string entitit : entities) if (entitit == entity) throw EntityExistsException();
-    
-    graph.add(entity);
+    usage.indexes += MemoryUsage::hashTableBytes(vertexIndex);
+    for (auto& entry : vertexIndex) usage.duplicateValues += MemoryUsage::valueBytes(entry.first);
 
-    entities.push_back(entity);
-}
+    usage.indexes += labelNames.capacity() * sizeof(string) + MemoryUsage::hashTableBytes(labelIds);
+    // every label is held twice, in labelNames and as a labelIds key
+    for (string& label : labelNames) usage.indexes += 2 * MemoryUsage::valueBytes(label);
 
-void KnowledgeGraph::addRelation(string from, string to, float weight) {
-    // TODO: Add a directed relation
-    VertexNode<string>* fromNode = graph.getVertexNode(from);
-    VertexNode<string>* toNode = graph.getVertexNode(to);    
-    if (fromNode == nullptr || toNode == nullptr) throw EntityNotFoundException();
+    shared_ptr<Condensation> scc = atomic_load(&condensationCache);
+    if (scc != nullptr) usage.indexes += sizeof(Condensation) + scc->memoryBytes();
+    return usage;
+}
 
-    fromNode->connect(toNode, weight);
+template <class T>
+void DGraphModel<T>::shrinkToFit() {
+    nodeList.shrink_to_fit();
+    for (VertexNode<T>* node : nodeList) {
+        node->adList.shrink_to_fit();
+        if (node->partitions == nullptr) continue;
+        node->partitions->shrink_to_fit();
+        for (LabelPartition<T>& part : *node->partitions) {
+            part.out.shrink_to_fit();
+            part.in.shrink_to_fit();
+        }
+    }
+    labelNames.shrink_to_fit();
+    // the smallest bucket count that keeps the load factor in bounds
+    vertexIndex.rehash(0);
 }
 
-vector<string> KnowledgeGraph::getAllEntities() {
-    return entities;
+template <class T>
+void DGraphModel<T>::setEdgeIndexThreshold(int threshold) {
+    this->edgeIndexThreshold = threshold;
+    for (VertexNode<T>* node : nodeList) {
+        if (node->outDegree_ >= threshold) node->buildOutIndex();
+        else node->dropOutIndex();
+    }
 }
 
-vector<string> KnowledgeGraph::getNeighbors(string entity) {
-    VertexNode<string>* node = graph.getVertexNode(entity);
-    if (node == nullptr) throw EntityNotFoundException();
+template <class T>
+TraversalLayout<T> DGraphModel<T>::buildTraversalLayout(VertexOrdering ordering) {
+    int n = nodeList.size();
+    TraversalLayout<T> layout;
+    vector<int>& order = layout.order;
+    order.reserve(n);
+    for (int i = 0; i < n; i++) order.push_back(i);
+
+    // adList holds both directions, so its size is the undirected degree
+    auto byDegreeDesc = [this](int a, int b) {
+        return nodeList[a]->adList.size() > nodeList[b]->adList.size();
+    };
+    auto byDegreeAsc = [this](int a, int b) {
+        return nodeList[a]->adList.size() < nodeList[b]->adList.size();
+    };
+
+    if (ordering == VertexOrdering::DEGREE) {
+        stable_sort(order.begin(), order.end(), byDegreeDesc);
+    }
+    else if (ordering == VertexOrdering::CUTHILL_MCKEE) {
+        vector<int> seeds = order;
+        stable_sort(seeds.begin(), seeds.end(), byDegreeAsc);
+        vector<char> placed(n, 0);
+        vector<int> neighbours;
+        order.clear();
+
+        // each component starts from its lowest-degree vertex
+        for (int seed : seeds) {
+            if (placed[seed]) continue;
+            placed[seed] = 1;
+            order.push_back(seed);
+            for (int head = order.size() - 1; head < (int)order.size(); head++) {
+                VertexNode<T>* node = nodeList[order[head]];
+                neighbours.clear();
+                for (Edge<T>* edging : node->adList) {
+                    VertexNode<T>* other = (edging->from == node) ? edging->to : edging->from;
+                    if (!placed[other->id_]) {
+                        placed[other->id_] = 1;
+                        neighbours.push_back(other->id_);
+                    }
+                }
+                stable_sort(neighbours.begin(), neighbours.end(), byDegreeAsc);
+                order.insert(order.end(), neighbours.begin(), neighbours.end());
+            }
+        }
+        reverse(order.begin(), order.end());
+    }
 
-    return node->getOutVertices();
+    layout.position.assign(n, 0);
+    for (int p = 0; p < n; p++) layout.position[order[p]] = p;
+
+    layout.offsets.reserve(n + 1);
+    layout.values.reserve(n);
+    for (int p = 0; p < n; p++) {
+        VertexNode<T>* node = nodeList[order[p]];
+        layout.values.push_back(node->vertex);
+        // outEdges keeps adList order, so traversals visit neighbours exactly like BFS/DFS
+        for (Edge<T>* edging : node->outEdges()) {
+            layout.targets.push_back(layout.position[edging->to->id_]);
+            layout.weights.push_back(edging->weight);
+        }
+        layout.offsets.push_back(layout.targets.size());
+    }
+    return layout;
 }
 
-string KnowledgeGraph::bfs(string start) {
-    if (!graph.contains(start)) throw EntityNotFoundException();
-    return graph.BFS(start);
+template <class T>
+int DGraphModel<T>::internLabel(string label) {
+    auto found = labelIds.find(label);
+    if (found != labelIds.end()) return found->second;
+    int id = labelNames.size();
+    labelNames.push_back(label);
+    labelIds.emplace(label, id);
+    return id;
 }
 
-string KnowledgeGraph::dfs(string start) {
-    if (!graph.contains(start)) throw EntityNotFoundException();
-    return graph.DFS(start);
+template <class T>
+int DGraphModel<T>::labelId(string label) {
+    auto found = labelIds.find(label);
+    return (found == labelIds.end()) ? -1 : found->second;
 }
 
-bool KnowledgeGraph::isReachable(string from, string to) {
-    // implemented using bfs
-    if (!graph.contains(from) || !graph.contains(to)) throw EntityNotFoundException();
-
-    if (from == to) return true;
+template <class T>
+string DGraphModel<T>::labelName(int id) {
+    if (id < 0 || id >= (int)labelNames.size()) return "";
+    return labelNames[id];
+}
 
-    VertexNode<string>* startingNode = graph.getVertexNode(from);
-    Set<string> visited(1009, 
-                        [](string& s){ return s; }, 
-                        [](string& a, string& b){ return a == b; });
-    Queue<VertexNode<string>*> queue;
+template <class T>
+vector<string> DGraphModel<T>::labels() {
+    return labelNames;
+}
 
-    queue.push(startingNode);
-    visited.insert(startingNode->getVertex());
+template <class T>
+unsigned long DGraphModel<T>::version() {
+    return this->version_;
+}
 
-    while (!queue.empty()) {
-        VertexNode<string>* node = queue.front();
-        queue.pop();
+template <class T>
+shared_ptr<Condensation> DGraphModel<T>::currentCondensation() {
+    shared_ptr<Condensation> current = atomic_load(&condensationCache);
+    if (current != nullptr && current->version == version_) return current;
+    return nullptr;
+}
 
-        vector<string> outVertices = node->getOutVertices();
-        for (string vertex : outVertices) {
-            if (vertex == to) return true;
-            if (!visited.contains(vertex)) {
-                visited.insert(vertex);
-                queue.push(graph.getVertexNode(vertex));
-            }
+template <class T>
+shared_ptr<Condensation> DGraphModel<T>::condensation() {
+    shared_ptr<Condensation> current = currentCondensation();
+    if (current != nullptr) return current;
+    lock_guard<mutex> guard(condensationLock);
+    // another reader may have rebuilt it while this one waited
+    current = currentCondensation();
+    if (current != nullptr) return current;
+
+    shared_ptr<Condensation> fresh = make_shared<Condensation>();
+    Condensation& scc = *fresh;
+    scc.version = version_;
+
+    int n = nodeList.size();
+    vector<int> outOffsets(1, 0);
+    vector<int> outTargets;
+    outOffsets.reserve(n + 1);
+    for (VertexNode<T>* node : nodeList) {
+        for (Edge<T>* edging : node->adList) {
+            if (edging->from == node) outTargets.push_back(edging->to->id_);
         }
+        outOffsets.push_back(outTargets.size());
     }
-    return false;
-}
-
-string KnowledgeGraph::toString() {
-    return graph.toString();
-}
 
-vector<string> KnowledgeGraph::getRelatedEntities(string entity, int depth) {
-    VertexNode<string>* startingNode = graph.getVertexNode(entity);
-    if (startingNode == nullptr) throw EntityNotFoundException();
-    vector<string> related;
-    Set<string> visited(1009, 
-                        [](string& s){ return s; },
-                        [](string& a, string& b){ return a == b; });
-    Queue<VertexNode<string>*> queueNode;
-    Queue<int> queueDepth;
-
-    queueNode.push(startingNode);
-    queueDepth.push(0);
-    visited.insert(entity);
-
-    while (!queueNode.empty() && !queueDepth.empty()) {
-        VertexNode<string>* node = queueNode.front();
-        int nodeDepth = queueDepth.front();
-        queueNode.pop();
-        queueDepth.pop();
-
-        if (nodeDepth > 0) related.push_back(node->getVertex());
-        if (nodeDepth < depth) {
-            vector<string> outVertices = node->getOutVertices();
-            for (string& vertex : outVertices) {
-                VertexNode<string>* outNode = graph.getVertexNode(vertex);
-                if (!visited.contains(vertex)) {
-                    visited.insert(vertex);
-                    queueNode.push(outNode);
-                    queueDepth.push(nodeDepth + 1);
+    // Iterative Tarjan: callStack holds (vertex, next out-edge) instead of recursing
+    vector<int> index(n, -1), low(n, 0), finished(n, -1);
+    vector<char> onStack(n, 0);
+    vector<int> sccStack;
+    vector<pair<int, int>> callStack;
+    int nextIndex = 0, finishedCount = 0;
+
+    for (int root = 0; root < n; root++) {
+        if (index[root] != -1) continue;
+        callStack.push_back({root, outOffsets[root]});
+        index[root] = low[root] = nextIndex++;
+        sccStack.push_back(root);
+        onStack[root] = 1;
+
+        while (!callStack.empty()) {
+            int v = callStack.back().first;
+            int& edgePos = callStack.back().second;
+            if (edgePos < outOffsets[v + 1]) {
+                int w = outTargets[edgePos++];
+                if (index[w] == -1) {
+                    index[w] = low[w] = nextIndex++;
+                    sccStack.push_back(w);
+                    onStack[w] = 1;
+                    callStack.push_back({w, outOffsets[w]});
                 }
+                else if (onStack[w]) low[v] = min(low[v], index[w]);
+                continue;
+            }
+
+            callStack.pop_back();
+            if (!callStack.empty()) {
+                int parent = callStack.back().first;
+                low[parent] = min(low[parent], low[v]);
+            }
+            if (low[v] == index[v]) {
+                int w;
+                do {
+                    w = sccStack.back();
+                    sccStack.pop_back();
+                    onStack[w] = 0;
+                    finished[w] = finishedCount;
+                } while (w != v);
+                finishedCount++;
             }
         }
     }
-    return related;
-}
-
-vector<string> KnowledgeGraph::getAncestors(string start) {
-    VertexNode<string>* startingNode = graph.getVertexNode(start);
-    if (startingNode == nullptr) return {};
-    
-    vector<string> ancestors;
-    Set<string> visited(1009, 
-                        [](string& s){ return s; },
-                        [](string& a, string& b){ return a == b; });
-    Stack<VertexNode<string>*> stack;
-    
-    stack.push(startingNode);
-    visited.insert(start);
 
-    while (!stack.empty()) {
-        VertexNode<string>* node = stack.top();
-        stack.pop();
-        ancestors.push_back(node->getVertex());
-        
-        vector<string> parents = node->getInVertices();
-        for (string parent : parents) {
-            VertexNode<string>* parentNode = graph.getVertexNode(parent);
-            if (!visited.contains(parent)) {
-                visited.insert(parent);
-                stack.push(parentNode);
+    // Tarjan completes sinks first, so reversing the completion order is topological
+    scc.componentOf.resize(n);
+    for (int v = 0; v < n; v++) scc.componentOf[v] = finishedCount - 1 - finished[v];
+
+    scc.memberOffsets.assign(finishedCount + 1, 0);
+    for (int v = 0; v < n; v++) scc.memberOffsets[scc.componentOf[v] + 1]++;
+    for (int c = 0; c < finishedCount; c++) scc.memberOffsets[c + 1] += scc.memberOffsets[c];
+    scc.members.resize(n);
+    vector<int> fill(scc.memberOffsets.begin(), scc.memberOffsets.end() - 1);
+    for (int v = 0; v < n; v++) scc.members[fill[scc.componentOf[v]]++] = v;
+
+    scc.cyclic = false;
+    vector<int> successors;
+    scc.dagOffsets.assign(1, 0);
+    for (int c = 0; c < finishedCount; c++) {
+        int first = scc.memberOffsets[c], last = scc.memberOffsets[c + 1];
+        if (last - first > 1) scc.cyclic = true;
+        successors.clear();
+        for (int m = first; m < last; m++) {
+            int v = scc.members[m];
+            for (int e = outOffsets[v]; e < outOffsets[v + 1]; e++) {
+                int target = scc.componentOf[outTargets[e]];
+                if (target != c) successors.push_back(target);
+                else if (outTargets[e] == v) scc.cyclic = true;
             }
         }
+        sort(successors.begin(), successors.end());
+        successors.erase(unique(successors.begin(), successors.end()), successors.end());
+        scc.dagTargets.insert(scc.dagTargets.end(), successors.begin(), successors.end());
+        scc.dagOffsets.push_back(scc.dagTargets.size());
     }
-    return ancestors;
+    atomic_store(&condensationCache, fresh);
+    return fresh;
 }
 
-int KnowledgeGraph::bfsDistance(string start, string target) {
-    if (start == target) return 0;
-    
-    Set<string> visited(1009, 
-                        [](string& s){ return s; },
-                        [](string& a, string& b){ return a == b; });
-    Queue<VertexNode<string>*> queueNode;
-    Queue<int> queueDistance;
 
-    queueNode.push(graph.getVertexNode(start));
-    queueDistance.push(0);
-    visited.insert(start);
-    while (!queueNode.empty() && !queueDistance.empty()) {
-        VertexNode<string>* node = queueNode.front();
-        int distance = queueDistance.front();
-        queueNode.pop();
-        queueDistance.pop();
+// TODO: Implement other methods of DGraphModel:
 
-        if (node->getVertex() == target) return distance;
-        vector<string> outVertices = node->getOutVertices();
-        for (string outVertex : outVertices) {
-            if (!visited.contains(outVertex)) {
-                visited.insert(outVertex);
-                queueNode.push(graph.getVertexNode(outVertex));
-                queueDistance.push(distance + 1);
-            }
-        }
-    }
-    return 999999;
+// =============================================================================
+// Class KdTree Implementation
+// =============================================================================
+
+KdTree::KdTree(DGraphModel<Point>& graph) {
+    this->nodes = graph.nodeList;
+    this->axes.assign(nodes.size(), 0);
+    this->build(0, nodes.size());
 }
 
-string KnowledgeGraph::findCommonAncestors(string entity1, string entity2) {
-    VertexNode<string>* entityOne = graph.getVertexNode(entity1);
-    VertexNode<string>* entityTwo = graph.getVertexNode(entity2);
+double KdTree::coordinate(const Point& point, int axis) {
+    if (axis == 0) return point.getX();
+    if (axis == 1) return point.getY();
+    return point.getZ();
+}
 
-    if (entityOne == nullptr || entityTwo == nullptr) throw EntityNotFoundException();
+void KdTree::build(int lo, int hi) {
+    if (hi - lo <= 1) return;
 
-    vector<string> ancestorsOfOne = this->getAncestors(entity1);
-    vector<string> ancestorsOfTwo = this->getAncestors(entity2);
-    
-    vector<string> common;
-    for (string ancestorOne : ancestorsOfOne) {
-        for (string ancestorTwo : ancestorsOfTwo) {
-            if (ancestorOne == ancestorTwo) {
-                common.push_back(ancestorOne);
-                break;
-            }
+    double low[3], high[3];
+    for (int axis = 0; axis < 3; axis++) low[axis] = high[axis] = coordinate(nodes[lo]->vertex, axis);
+    for (int i = lo + 1; i < hi; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            double c = coordinate(nodes[i]->vertex, axis);
+            low[axis] = min(low[axis], c);
+            high[axis] = max(high[axis], c);
         }
     }
-    if (common.empty()) return "No common ancestor";
-    string bestAncestor;
-    int minTotalDistance = 999999;
-    for (string ancestor : common) {
-        int distanceOne = bfsDistance(ancestor, entity1);
-        int distanceTwo = bfsDistance(ancestor, entity2);
-        if (distanceOne + distanceTwo < minTotalDistance) {
-            minTotalDistance = distanceOne + distanceTwo;
-            bestAncestor = ancestor;
+    int axis = 0;
+    for (int a = 1; a < 3; a++) {
+        if (high[a] - low[a] > high[axis] - low[axis]) axis = a;
+    }
+
+    int mid = lo + (hi - lo) / 2;
+    nth_element(nodes.begin() + lo, nodes.begin() + mid, nodes.begin() + hi,
+                [axis](VertexNode<Point>* a, VertexNode<Point>* b) {
+                    return coordinate(a->vertex, axis) < coordinate(b->vertex, axis);
+                });
+    axes[mid] = axis;
+    build(lo, mid);
+    build(mid + 1, hi);
+}
+
+void KdTree::nearest(int lo, int hi, const Point& query, int k, int exclude, vector<pair<double, int>>& best) {
+    if (lo >= hi) return;
+    int mid = lo + (hi - lo) / 2;
+    const Point& point = nodes[mid]->vertex;
+
+    if (nodes[mid]->id_ != exclude) {
+        double dx = point.getX() - query.getX();
+        double dy = point.getY() - query.getY();
+        double dz = point.getZ() - query.getZ();
+        double distance2 = dx * dx + dy * dy + dz * dz;
+        // 'best' is a max-heap on squared distance holding at most k entries
+        if ((int)best.size() < k) {
+            best.push_back(make_pair(distance2, mid));
+            push_heap(best.begin(), best.end());
+        }
+        else if (distance2 < best.front().first) {
+            pop_heap(best.begin(), best.end());
+            best.back() = make_pair(distance2, mid);
+            push_heap(best.begin(), best.end());
         }
     }
-    return bestAncestor;
+
+    double diff = coordinate(query, axes[mid]) - coordinate(point, axes[mid]);
+    if (diff < 0) {
+        nearest(lo, mid, query, k, exclude, best);
+        if ((int)best.size() < k || diff * diff < best.front().first) nearest(mid + 1, hi, query, k, exclude, best);
+    }
+    else {
+        nearest(mid + 1, hi, query, k, exclude, best);
+        if ((int)best.size() < k || diff * diff < best.front().first) nearest(lo, mid, query, k, exclude, best);
+    }
 }
 
-// =============================================================================
-// QUEUE // MY IMPLEMENTATION
-// =============================================================================
+void KdTree::withinRadius(int lo, int hi, const Point& query, double radius2, vector<int>& out) {
+    if (lo >= hi) return;
+    int mid = lo + (hi - lo) / 2;
+    const Point& point = nodes[mid]->vertex;
 
-template <class T>
+    double dx = point.getX() - query.getX();
+    double dy = point.getY() - query.getY();
+    double dz = point.getZ() - query.getZ();
+    if (dx * dx + dy * dy + dz * dz <= radius2) out.push_back(mid);
+
+    double diff = coordinate(query, axes[mid]) - coordinate(point, axes[mid]);
+    if (diff <= 0 || diff * diff <= radius2) withinRadius(lo, mid, query, radius2, out);
+    if (diff >= 0 || diff * diff <= radius2) withinRadius(mid + 1, hi, query, radius2, out);
+}
+
+vector<int> KdTree::nearestPositions(const Point& query, int k, int exclude) {
+    vector<pair<double, int>> best;
+    if (k <= 0) return vector<int>();
+    best.reserve(k + 1);
+    nearest(0, nodes.size(), query, k, exclude, best);
+    sort_heap(best.begin(), best.end());
+
+    vector<int> positions;
+    for (pair<double, int>& entry : best) positions.push_back(entry.second);
+    return positions;
+}
+
+int KdTree::size() {
+    return nodes.size();
+}
+
+vector<Point> KdTree::nearest(Point query, int k) {
+    vector<Point> points;
+    for (int position : nearestPositions(query, k, -1)) points.push_back(nodes[position]->vertex);
+    return points;
+}
+
+vector<Point> KdTree::withinRadius(Point query, double radius) {
+    vector<int> positions;
+    if (radius >= 0) withinRadius(0, nodes.size(), query, radius * radius, positions);
+
+    vector<pair<double, int>> ordered;
+    for (int position : positions) ordered.push_back(make_pair(query.distanceTo(nodes[position]->vertex), position));
+    sort(ordered.begin(), ordered.end());
+
+    vector<Point> points;
+    for (pair<double, int>& entry : ordered) points.push_back(nodes[entry.second]->vertex);
+    return points;
+}
+
+void KdTree::connectKNearest(DGraphModel<Point>& graph, int k) {
+    if (k <= 0) return;
+    KdTree tree(graph);
+    // one query per vertex, O(log n) each on well-spread points
+    for (VertexNode<Point>* node : graph.nodeList) {
+        for (int position : tree.nearestPositions(node->vertex, k, node->id_)) {
+            VertexNode<Point>* other = tree.nodes[position];
+            graph.connectNodes(node, other, node->vertex.distanceTo(other->vertex), 0);
+        }
+    }
+}
+
+// =============================================================================
+// Class TraversalLayout Implementation
+// =============================================================================
+
+template <class T>
+TraversalLayout<T>::TraversalLayout() {
+    offsets.push_back(0);
+}
+
+template <class T>
+int TraversalLayout<T>::size() {
+    return this->order.size();
+}
+
+template <class T>
+int TraversalLayout<T>::edgeCount() {
+    return this->targets.size();
+}
+
+template <class T>
+int TraversalLayout<T>::positionOf(int vertexId) {
+    if (vertexId < 0 || vertexId >= this->size()) throw VertexNotFoundException();
+    return this->position[vertexId];
+}
+
+template <class T>
+int TraversalLayout<T>::vertexAt(int position) {
+    if (position < 0 || position >= this->size()) throw VertexNotFoundException();
+    return this->order[position];
+}
+
+template <class T>
+T& TraversalLayout<T>::vertex(int vertexId) {
+    return this->values[this->positionOf(vertexId)];
+}
+
+template <class T>
+vector<int> TraversalLayout<T>::neighbors(int vertexId) {
+    int p = this->positionOf(vertexId);
+    vector<int> result;
+    result.reserve(offsets[p + 1] - offsets[p]);
+    for (int e = offsets[p]; e < offsets[p + 1]; e++) result.push_back(order[targets[e]]);
+    return result;
+}
+
+template <class T>
+vector<int> TraversalLayout<T>::bfs(int startId) {
+    int start = this->positionOf(startId);
+    vector<char> visited(this->size(), 0);
+    vector<int> queue;
+    queue.reserve(this->size());
+
+    queue.push_back(start);
+    visited[start] = 1;
+    for (int head = 0; head < (int)queue.size(); head++) {
+        int p = queue[head];
+        for (int e = offsets[p]; e < offsets[p + 1]; e++) {
+            int target = targets[e];
+            if (!visited[target]) {
+                visited[target] = 1;
+                queue.push_back(target);
+            }
+        }
+    }
+
+    for (int& p : queue) p = order[p];
+    return queue;
+}
+
+template <class T>
+vector<int> TraversalLayout<T>::dfs(int startId) {
+    int start = this->positionOf(startId);
+    vector<char> visited(this->size(), 0);
+    vector<int> stack;
+    vector<int> result;
+
+    stack.push_back(start);
+    while (!stack.empty()) {
+        int p = stack.back();
+        stack.pop_back();
+        if (visited[p]) continue;
+        visited[p] = 1;
+        result.push_back(order[p]);
+
+        for (int e = offsets[p + 1] - 1; e >= offsets[p]; e--) {
+            if (!visited[targets[e]]) stack.push_back(targets[e]);
+        }
+    }
+    return result;
+}
+
+template <class T>
+double TraversalLayout<T>::averageEdgeSpan() {
+    if (targets.empty()) return 0;
+    double total = 0;
+    for (int p = 0; p < this->size(); p++) {
+        for (int e = offsets[p]; e < offsets[p + 1]; e++) total += abs(targets[e] - p);
+    }
+    return total / targets.size();
+}
+
+// =============================================================================
+// Class Condensation Implementation
+// =============================================================================
+
+Condensation::Condensation() {
+    this->memberOffsets.push_back(0);
+    this->dagOffsets.push_back(0);
+    this->cyclic = false;
+    this->version = 0;
+}
+
+int Condensation::componentCount() {
+    return this->memberOffsets.size() - 1;
+}
+
+int Condensation::component(int vertexId) {
+    if (vertexId < 0 || vertexId >= (int)componentOf.size()) throw VertexNotFoundException();
+    return this->componentOf[vertexId];
+}
+
+vector<int> Condensation::componentMembers(int component) {
+    return vector<int>(members.begin() + memberOffsets[component],
+                       members.begin() + memberOffsets[component + 1]);
+}
+
+vector<int> Condensation::successors(int component) {
+    return vector<int>(dagTargets.begin() + dagOffsets[component],
+                       dagTargets.begin() + dagOffsets[component + 1]);
+}
+
+bool Condensation::hasCycle() {
+    return this->cyclic;
+}
+
+bool Condensation::reaches(int fromComponent, int toComponent, QueryBudget* budget) {
+    if (fromComponent == toComponent) return true;
+    if (fromComponent > toComponent) return false;
+
+    // only components in (fromComponent, toComponent] can lie on a path
+    vector<char> visited(toComponent - fromComponent + 1, 0);
+    vector<int> stack(1, fromComponent);
+    visited[0] = 1;
+    while (!stack.empty()) {
+        int c = stack.back();
+        stack.pop_back();
+        if (budget != nullptr) {
+            if (!budget->visitVertex()) return false;
+            if (!budget->scanEdges(dagOffsets[c + 1] - dagOffsets[c])) return false;
+        }
+        for (int e = dagOffsets[c]; e < dagOffsets[c + 1]; e++) {
+            int next = dagTargets[e];
+            if (next == toComponent) return true;
+            // successors are sorted, everything after this one is out of range too
+            if (next > toComponent) break;
+            if (!visited[next - fromComponent]) {
+                visited[next - fromComponent] = 1;
+                stack.push_back(next);
+            }
+        }
+    }
+    return false;
+}
+
+vector<int> Condensation::topologicalOrder() {
+    return this->members;
+}
+
+size_t Condensation::memoryBytes() {
+    return (componentOf.capacity() + memberOffsets.capacity() + members.capacity()
+            + dagOffsets.capacity() + dagTargets.capacity()) * sizeof(int);
+}
+
+// =============================================================================
+// Sorted List Intersection
+// =============================================================================
+
+static int gallopIntersect(const int* small, int sizeSmall, const int* large, int sizeLarge, int* out) {
+    int found = 0;
+    int low = 0;
+    for (int i = 0; i < sizeSmall && low < sizeLarge; i++) {
+        // double the step until large[high] >= small[i], then binary search the last step
+        int step = 1, high = low;
+        while (high < sizeLarge && large[high] < small[i]) {
+            low = high + 1;
+            high += step;
+            step <<= 1;
+        }
+        low = lower_bound(large + low, large + min(high + 1, sizeLarge), small[i]) - large;
+        if (low < sizeLarge && large[low] == small[i]) out[found++] = small[i];
+    }
+    return found;
+}
+
+// Writes a ∩ b to 'out' and returns its size; both inputs sorted and duplicate-free.
+// Shared by triangle counting and the triple-pattern cursor.
+static int intersectSorted(const int* a, int sizeA, const int* b, int sizeB, int* out) {
+    if (sizeA == 0 || sizeB == 0) return 0;
+    if (sizeA * 32LL < sizeB) return gallopIntersect(a, sizeA, b, sizeB, out);
+    if (sizeB * 32LL < sizeA) return gallopIntersect(b, sizeB, a, sizeA, out);
+
+    int i = 0, j = 0, found = 0;
+#if defined(__SSE2__)
+    // compare a block of a against all four rotations of a block of b; the
+    // lists are duplicate-free, so each element of a matches at most once
+    while (i + 4 <= sizeA && j + 4 <= sizeB) {
+        __m128i blockA = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i blockB = _mm_loadu_si128((const __m128i*)(b + j));
+        __m128i equal = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(blockA, blockB),
+                         _mm_cmpeq_epi32(blockA, _mm_shuffle_epi32(blockB, _MM_SHUFFLE(0, 3, 2, 1)))),
+            _mm_or_si128(_mm_cmpeq_epi32(blockA, _mm_shuffle_epi32(blockB, _MM_SHUFFLE(1, 0, 3, 2))),
+                         _mm_cmpeq_epi32(blockA, _mm_shuffle_epi32(blockB, _MM_SHUFFLE(2, 1, 0, 3)))));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(equal));
+        for (int lane = 0; lane < 4; lane++) {
+            if (mask & (1 << lane)) out[found++] = a[i + lane];
+        }
+        int lastA = a[i + 3], lastB = b[j + 3];
+        if (lastA <= lastB) i += 4;
+        if (lastB <= lastA) j += 4;
+    }
+#endif
+    while (i < sizeA && j < sizeB) {
+        if (a[i] < b[j]) i++;
+        else if (b[j] < a[i]) j++;
+        else {
+            out[found++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return found;
+}
+
+// =============================================================================
+// Class TriangleCounter Implementation
+// =============================================================================
+
+TriangleCounts TriangleCounter::count(const vector<int>& offsets, const vector<int>& neighbors, int threads) {
+    int n = offsets.size() - 1;
+    TriangleCounts result;
+    result.total = 0;
+    result.perVertex.assign(n, 0);
+    result.clustering.assign(n, 0);
+    result.averageClustering = 0;
+    result.transitivity = 0;
+    if (n <= 0) return result;
+
+    // rank by (degree, id); the orientation and all work below use ranks
+    vector<int> order(n);
+    for (int v = 0; v < n; v++) order[v] = v;
+    sort(order.begin(), order.end(), [&offsets](int x, int y) {
+        int degreeX = offsets[x + 1] - offsets[x], degreeY = offsets[y + 1] - offsets[y];
+        return (degreeX != degreeY) ? degreeX < degreeY : x < y;
+    });
+    vector<int> rank(n);
+    for (int r = 0; r < n; r++) rank[order[r]] = r;
+
+    vector<int> outOffsets(n + 1, 0);
+    for (int r = 0; r < n; r++) {
+        int v = order[r], count = 0;
+        for (int k = offsets[v]; k < offsets[v + 1]; k++) count += (rank[neighbors[k]] > r);
+        outOffsets[r + 1] = outOffsets[r] + count;
+    }
+    vector<int> outTargets(outOffsets[n]);
+    for (int r = 0; r < n; r++) {
+        int v = order[r], slot = outOffsets[r];
+        for (int k = offsets[v]; k < offsets[v + 1]; k++) {
+            if (rank[neighbors[k]] > r) outTargets[slot++] = rank[neighbors[k]];
+        }
+        sort(outTargets.begin() + outOffsets[r], outTargets.begin() + slot);
+    }
+
+    unique_ptr<atomic<long long>[]> perRank(new atomic<long long>[n]);
+    for (int r = 0; r < n; r++) perRank[r].store(0, memory_order_relaxed);
+    atomic<long long> total(0);
+    atomic<int> nextRank(0);
+    const int CHUNK = 64;
+    threads = (threads > 0) ? threads : max(1u, thread::hardware_concurrency());
+    threads = min(threads, (n + CHUNK - 1) / CHUNK);
+
+    auto work = [&]() {
+        vector<int> common;
+        long long found = 0;
+        for (int first = nextRank.fetch_add(CHUNK); first < n; first = nextRank.fetch_add(CHUNK)) {
+            for (int u = first; u < min(first + CHUNK, n); u++) {
+                const int* outU = outTargets.data() + outOffsets[u];
+                int sizeU = outOffsets[u + 1] - outOffsets[u];
+                if (sizeU < 2) continue;
+                common.resize(sizeU);
+                long long atU = 0;
+                for (int k = 0; k < sizeU; k++) {
+                    int v = outU[k];
+                    // triangle (u, v, w) with u < v < w in rank order
+                    int matches = intersectSorted(outU + k + 1, sizeU - k - 1, outTargets.data() + outOffsets[v],
+                                                  outOffsets[v + 1] - outOffsets[v], common.data());
+                    if (matches == 0) continue;
+                    atU += matches;
+                    perRank[v].fetch_add(matches, memory_order_relaxed);
+                    for (int m = 0; m < matches; m++) perRank[common[m]].fetch_add(1, memory_order_relaxed);
+                }
+                if (atU > 0) perRank[u].fetch_add(atU, memory_order_relaxed);
+                found += atU;
+            }
+        }
+        total.fetch_add(found, memory_order_relaxed);
+    };
+
+    vector<thread> workers;
+    for (int t = 1; t < threads; t++) workers.push_back(thread(work));
+    work();
+    for (thread& worker : workers) worker.join();
+
+    result.total = total.load();
+    double triples = 0, clusteringSum = 0;
+    for (int v = 0; v < n; v++) {
+        long long degree = offsets[v + 1] - offsets[v];
+        result.perVertex[v] = perRank[rank[v]].load(memory_order_relaxed);
+        if (degree >= 2) {
+            double pairs = degree * (degree - 1) / 2.0;
+            result.clustering[v] = result.perVertex[v] / pairs;
+            triples += pairs;
+            clusteringSum += result.clustering[v];
+        }
+    }
+    result.averageClustering = clusteringSum / n;
+    result.transitivity = (triples > 0) ? 3.0 * result.total / triples : 0;
+    return result;
+}
+
+// =============================================================================
+// Class EntityPrefixIndex Implementation
+// =============================================================================
+
+EntityPrefixIndex::EntityPrefixIndex() {
+    this->baseCount = 0;
+}
+
+void EntityPrefixIndex::Cursor::seekBlock(int block) {
+    position = block * BLOCK_SIZE;
+    if (!valid()) return;
+    in = index->data.data() + index->blockOffsets[block];
+    uint64_t length = CompressedGraph::getVarint(in);
+    current.assign((const char*)in, length);
+    in += length;
+}
+
+void EntityPrefixIndex::Cursor::next() {
+    position++;
+    if (!valid()) return;
+    if (position % BLOCK_SIZE == 0) {
+        seekBlock(position / BLOCK_SIZE);
+        return;
+    }
+    uint64_t shared = CompressedGraph::getVarint(in);
+    uint64_t length = CompressedGraph::getVarint(in);
+    current.resize(shared);
+    current.append((const char*)in, length);
+    in += length;
+}
+
+string EntityPrefixIndex::blockHead(int block) {
+    const uint8_t* in = data.data() + blockOffsets[block];
+    uint64_t length = CompressedGraph::getVarint(in);
+    return string((const char*)in, length);
+}
+
+void EntityPrefixIndex::encode(const vector<string>& sorted) {
+    data.clear();
+    blockOffsets.clear();
+    for (int i = 0; i < (int)sorted.size(); i++) {
+        const string& name = sorted[i];
+        if (i % BLOCK_SIZE == 0) {
+            blockOffsets.push_back(data.size());
+            CompressedGraph::putVarint(data, name.size());
+            data.insert(data.end(), name.begin(), name.end());
+            continue;
+        }
+        const string& previous = sorted[i - 1];
+        size_t shared = 0;
+        while (shared < name.size() && shared < previous.size() && name[shared] == previous[shared]) shared++;
+        CompressedGraph::putVarint(data, shared);
+        CompressedGraph::putVarint(data, name.size() - shared);
+        data.insert(data.end(), name.begin() + shared, name.end());
+    }
+    data.shrink_to_fit();
+    blockOffsets.shrink_to_fit();
+    baseCount = sorted.size();
+}
+
+void EntityPrefixIndex::mergePending() {
+    vector<string> base;
+    base.reserve(baseCount);
+    Cursor cursor{this, baseCount, nullptr, ""};
+    for (cursor.seekBlock(0); cursor.valid(); cursor.next()) base.push_back(cursor.current);
+
+    vector<string> merged;
+    merged.reserve(base.size() + pending.size());
+    std::merge(base.begin(), base.end(), pending.begin(), pending.end(), back_inserter(merged));
+    pending.clear();
+    encode(merged);
+}
+
+vector<string> EntityPrefixIndex::scan(const string& from, const string& prefix, const string* upper, int limit) {
+    vector<string> result;
+    if (limit <= 0) return result;
+
+    Cursor cursor{this, baseCount, nullptr, ""};
+    if (baseCount > 0) {
+        // binary search for the last block whose head is <= from
+        int low = 0, high = blockOffsets.size() - 1;
+        while (low < high) {
+            int middle = (low + high + 1) / 2;
+            if (blockHead(middle) <= from) low = middle;
+            else high = middle - 1;
+        }
+        cursor.seekBlock(low);
+        while (cursor.valid() && cursor.current < from) cursor.next();
+    }
+    auto extra = pending.lower_bound(from);
+
+    // merge the two sorted sources until a name leaves the requested range
+    while ((int)result.size() < limit) {
+        bool haveBase = cursor.valid();
+        bool havePending = extra != pending.end();
+        if (!haveBase && !havePending) break;
+        bool takeBase = haveBase && (!havePending || cursor.current < *extra);
+        const string& candidate = takeBase ? cursor.current : *extra;
+        if (candidate.compare(0, prefix.size(), prefix) != 0) break;
+        if (upper != nullptr && candidate >= *upper) break;
+        result.push_back(candidate);
+        if (takeBase) cursor.next();
+        else ++extra;
+    }
+    return result;
+}
+
+void EntityPrefixIndex::insert(string name) {
+    pending.insert(name);
+    int threshold = baseCount / 16;
+    if (threshold < MIN_PENDING) threshold = MIN_PENDING;
+    if ((int)pending.size() > threshold) mergePending();
+}
+
+void EntityPrefixIndex::build(vector<string> names) {
+    sort(names.begin(), names.end());
+    names.erase(unique(names.begin(), names.end()), names.end());
+    pending.clear();
+    encode(names);
+}
+
+void EntityPrefixIndex::clear() {
+    pending.clear();
+    encode(vector<string>());
+}
+
+int EntityPrefixIndex::size() {
+    return baseCount + pending.size();
+}
+
+vector<string> EntityPrefixIndex::findByPrefix(string prefix, int limit) {
+    return scan(prefix, prefix, nullptr, limit);
+}
+
+vector<string> EntityPrefixIndex::range(string from, string to, int limit) {
+    return scan(from, "", &to, limit);
+}
+
+size_t EntityPrefixIndex::memoryBytes() {
+    size_t bytes = data.capacity() + blockOffsets.capacity() * sizeof(uint64_t);
+    for (const string& name : pending) {
+        // red-black tree node: three pointers and a colour next to the string
+        bytes += sizeof(string) + 4 * sizeof(void*) + MemoryUsage::valueBytes(name);
+    }
+    return bytes;
+}
+
+// =============================================================================
+// Class TransitionMatrix Implementation
+// =============================================================================
+
+TransitionMatrix::TransitionMatrix() {
+    this->version = 0;
+}
+
+int TransitionMatrix::personalizedRank(const vector<int>& seeds, const PageRankOptions& options,
+                                       vector<float>& rank, vector<float>& next) {
+    int n = offsets.size() - 1;
+    const float damping = options.damping;
+    const float seedShare = 1.0f / seeds.size();
+    const int* offset = offsets.data();
+    const int* source = sources.data();
+    const float* probability = probabilities.data();
+
+    rank.assign(n, 0);
+    next.assign(n, 0);
+    for (int seed : seeds) rank[seed] += seedShare;
+
+    int iteration = 0;
+    while (iteration < options.maxIterations) {
+        iteration++;
+        float danglingMass = 0;
+        for (int u : dangling) danglingMass += rank[u];
+
+        float* out = next.data();
+        const float* in = rank.data();
+        for (int v = 0; v < n; v++) {
+            // four independent partial sums, so the gather is not one serial add chain
+            float sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+            int e = offset[v], end = offset[v + 1];
+            for (; e + 4 <= end; e += 4) {
+                sum0 += probability[e] * in[source[e]];
+                sum1 += probability[e + 1] * in[source[e + 1]];
+                sum2 += probability[e + 2] * in[source[e + 2]];
+                sum3 += probability[e + 3] * in[source[e + 3]];
+            }
+            for (; e < end; e++) sum0 += probability[e] * in[source[e]];
+            out[v] = damping * ((sum0 + sum1) + (sum2 + sum3));
+        }
+
+        // restart and dangling mass both flow back to the seeds only
+        float restart = (1 - damping) + damping * danglingMass;
+        for (int seed : seeds) out[seed] += restart * seedShare;
+
+        // L1 change; a float reduction is not vectorised without -ffast-math, so
+        // it is done by hand, four lanes at a time
+        float delta = 0;
+        int v = 0;
+#if defined(__SSE2__)
+        const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+        __m128 lanes = _mm_setzero_ps();
+        for (; v + 4 <= n; v += 4) {
+            __m128 diff = _mm_sub_ps(_mm_loadu_ps(out + v), _mm_loadu_ps(in + v));
+            lanes = _mm_add_ps(lanes, _mm_and_ps(diff, absMask));
+        }
+        float partial[4];
+        _mm_storeu_ps(partial, lanes);
+        delta = (partial[0] + partial[1]) + (partial[2] + partial[3]);
+#endif
+        for (; v < n; v++) delta += fabs(out[v] - in[v]);
+
+        rank.swap(next);
+        if (delta < options.tolerance) break;
+    }
+    return iteration;
+}
+
+size_t TransitionMatrix::memoryBytes() {
+    return (offsets.capacity() + sources.capacity() + dangling.capacity()) * sizeof(int)
+           + probabilities.capacity() * sizeof(float);
+}
+
+// =============================================================================
+// Class AliasTable Implementation
+// =============================================================================
+
+AliasTable::AliasTable() {
+    this->version = 0;
+}
+
+int AliasTable::sample(int vertex, uint64_t random) {
+    // high half picks the slot, low half is the coin
+    int begin = offsets[vertex];
+    uint64_t degree = offsets[vertex + 1] - begin;
+    int slot = begin + (int)(((random >> 32) * degree) >> 32);
+    float coin = (float)(random & 0xFFFFFFFFu) * (1.0f / 4294967296.0f);
+    return targets[(coin < cutoff[slot]) ? slot : begin + alias[slot]];
+}
+
+void AliasTable::probabilities(int vertex, vector<double>& out) {
+    // each slot is picked with 1/degree, then keeps itself or hands over to its alias
+    int begin = offsets[vertex];
+    int degree = offsets[vertex + 1] - begin;
+    out.assign(degree, 0);
+    for (int i = 0; i < degree; i++) {
+        out[i] += cutoff[begin + i];
+        out[alias[begin + i]] += 1.0 - cutoff[begin + i];
+    }
+    for (double& probability : out) probability /= degree;
+}
+
+bool AliasTable::hasEdge(int from, int to) {
+    return binary_search(targets.begin() + offsets[from], targets.begin() + offsets[from + 1], to);
+}
+
+size_t AliasTable::memoryBytes() {
+    return (offsets.capacity() + targets.capacity() + alias.capacity()) * sizeof(int)
+           + cutoff.capacity() * sizeof(float);
+}
+
+// =============================================================================
+// Class TripleIndex Implementation
+// =============================================================================
+
+TripleIndex::TripleIndex() {
+    this->distinct[0] = this->distinct[1] = this->distinct[2] = 0;
+    this->version = 0;
+}
+
+void TripleIndex::build(const vector<int>& subjects, const vector<int>& predicates, const vector<int>& objects) {
+    const vector<int>* source[3] = {&subjects, &predicates, &objects};
+    int n = subjects.size();
+    vector<int> rows(n);
+
+    for (int lead = 0; lead < 3; lead++) {
+        const vector<int>& c0 = *source[lead];
+        const vector<int>& c1 = *source[(lead + 1) % 3];
+        const vector<int>& c2 = *source[(lead + 2) % 3];
+        for (int i = 0; i < n; i++) rows[i] = i;
+        sort(rows.begin(), rows.end(), [&](int x, int y) {
+            if (c0[x] != c0[y]) return c0[x] < c0[y];
+            if (c1[x] != c1[y]) return c1[x] < c1[y];
+            return c2[x] < c2[y];
+        });
+
+        Permutation& perm = permutations[lead];
+        for (vector<int>& column : perm.columns) {
+            column.clear();
+            column.reserve(n);
+        }
+        distinct[lead] = 0;
+        for (int i = 0; i < n; i++) {
+            int row = rows[i];
+            int last = perm.columns[0].size() - 1;
+            // parallel edges under one label are a single triple
+            if (last >= 0 && perm.columns[0][last] == c0[row] && perm.columns[1][last] == c1[row]
+                && perm.columns[2][last] == c2[row]) continue;
+            if (last < 0 || perm.columns[0][last] != c0[row]) distinct[lead]++;
+            perm.columns[0].push_back(c0[row]);
+            perm.columns[1].push_back(c1[row]);
+            perm.columns[2].push_back(c2[row]);
+        }
+    }
+}
+
+int TripleIndex::size() {
+    return permutations[0].columns[0].size();
+}
+
+void TripleIndex::range(int lead, int prefixLength, int a, int b, int& lo, int& hi) {
+    Permutation& perm = permutations[lead];
+    lo = 0;
+    hi = perm.columns[0].size();
+    if (prefixLength >= 1) {
+        const int* first = perm.columns[0].data();
+        lo = lower_bound(first + lo, first + hi, a) - first;
+        hi = upper_bound(first + lo, first + hi, a) - first;
+    }
+    if (prefixLength >= 2) {
+        // within one first-column value the second column is sorted
+        const int* second = perm.columns[1].data();
+        int start = lo;
+        lo = lower_bound(second + start, second + hi, b) - second;
+        hi = upper_bound(second + lo, second + hi, b) - second;
+    }
+}
+
+bool TripleIndex::contains(int subject, int predicate, int object) {
+    int lo, hi;
+    range(SUBJECT, 2, subject, predicate, lo, hi);
+    const int* third = permutations[SUBJECT].columns[2].data();
+    return binary_search(third + lo, third + hi, object);
+}
+
+size_t TripleIndex::memoryBytes() {
+    size_t bytes = 0;
+    for (Permutation& perm : permutations) {
+        for (vector<int>& column : perm.columns) bytes += column.capacity() * sizeof(int);
+    }
+    return bytes;
+}
+
+// =============================================================================
+// Class TripleCursor Implementation
+// =============================================================================
+
+TripleCursor::TripleCursor() {
+    this->index = nullptr;
+    this->entityNames = nullptr;
+    this->labelNames = nullptr;
+    this->started = false;
+    this->exhausted = false;
+}
+
+int TripleCursor::variableIndex(string name, bool predicate) {
+    for (int v = 0; v < (int)variableNames.size(); v++) {
+        if (variableNames[v] != name) continue;
+        if (predicateVariable[v] != predicate) {
+            throw InvalidQueryException("Variable " + name + " used as both entity and label!");
+        }
+        return v;
+    }
+    variableNames.push_back(name);
+    predicateVariable.push_back(predicate);
+    return variableNames.size() - 1;
+}
+
+int TripleCursor::valueAt(const Pattern& pattern, int position) {
+    return pattern.variable[position] ? binding[pattern.value[position]] : pattern.value[position];
+}
+
+double TripleCursor::estimate(const Pattern& pattern, const vector<bool>& bound) {
+    // rows matching the constants, scaled down once per position a bound variable pins
+    int constants = 0;
+    int lead = 0;
+    for (int position = 0; position < 3; position++) {
+        if (pattern.variable[position]) continue;
+        constants++;
+        // a single constant leads; of two, the one whose successor is the other leads
+        if (constants == 1 || !pattern.variable[(position + 1) % 3]) lead = position;
+    }
+    int lo = 0, hi = index->size();
+    if (constants > 0) {
+        index->range(lead, constants, pattern.value[lead], pattern.value[(lead + 1) % 3], lo, hi);
+    }
+    double rows = hi - lo;
+    for (int position = 0; position < 3; position++) {
+        if (pattern.variable[position] && bound[pattern.value[position]]) {
+            rows /= max(index->distinct[position], 1);
+        }
+    }
+    return rows;
+}
+
+void TripleCursor::plan() {
+    int n = variableNames.size();
+    binding.assign(n, -1);
+    order.clear();
+    exact.assign(n, vector<int>());
+    verify.assign(n, vector<int>());
+    levels.assign(n, Level());
+    if (exhausted) return;
+
+    // ground patterns are decided once, up front
+    for (Pattern& pattern : patterns) {
+        if (pattern.variable[0] || pattern.variable[1] || pattern.variable[2]) continue;
+        if (!index->contains(pattern.value[0], pattern.value[1], pattern.value[2])) {
+            exhausted = true;
+            return;
+        }
+    }
+
+    // greedy order: always bind the variable with the smallest estimated candidate set next
+    vector<bool> bound(n, false);
+    for (int depth = 0; depth < n; depth++) {
+        int best = -1;
+        double bestCost = 0;
+        for (int v = 0; v < n; v++) {
+            if (bound[v]) continue;
+            for (Pattern& pattern : patterns) {
+                bool uses = false;
+                for (int position = 0; position < 3; position++) {
+                    if (pattern.variable[position] && pattern.value[position] == v) uses = true;
+                }
+                if (!uses) continue;
+                double cost = estimate(pattern, bound);
+                if (best == -1 || cost < bestCost) {
+                    best = v;
+                    bestCost = cost;
+                }
+            }
+        }
+        order.push_back(best);
+        bound[best] = true;
+
+        for (int p = 0; p < (int)patterns.size(); p++) {
+            Pattern& pattern = patterns[p];
+            int occurrences = 0;
+            bool complete = true;
+            for (int position = 0; position < 3; position++) {
+                if (!pattern.variable[position]) continue;
+                if (pattern.value[position] == best) occurrences++;
+                if (!bound[pattern.value[position]]) complete = false;
+            }
+            if (occurrences == 0 || !complete) continue;
+            if (occurrences == 1) exact[depth].push_back(p);
+            else verify[depth].push_back(p);
+        }
+    }
+}
+
+void TripleCursor::open(int depth) {
+    Level& level = levels[depth];
+    int v = order[depth];
+    level.next = 0;
+    level.candidates.clear();
+
+    if (!exact[depth].empty()) {
+        // each fully bound pattern yields a sorted posting list for v; intersect smallest first
+        vector<pair<int, const int*>> lists;
+        for (int p : exact[depth]) {
+            Pattern& pattern = patterns[p];
+            int position = 0;
+            while (!pattern.variable[position] || pattern.value[position] != v) position++;
+            int lead = (position + 1) % 3;
+            int lo, hi;
+            index->range(lead, 2, valueAt(pattern, lead), valueAt(pattern, (lead + 1) % 3), lo, hi);
+            lists.push_back(make_pair(hi - lo, index->permutations[lead].columns[2].data() + lo));
+        }
+        sort(lists.begin(), lists.end());
+        level.candidates.assign(lists[0].second, lists[0].second + lists[0].first);
+        for (int i = 1; i < (int)lists.size() && !level.candidates.empty(); i++) {
+            scratch.resize(min<size_t>(level.candidates.size(), lists[i].first));
+            int found = intersectSorted(level.candidates.data(), level.candidates.size(),
+                                        lists[i].second, lists[i].first, scratch.data());
+            scratch.resize(found);
+            level.candidates.swap(scratch);
+        }
+        return;
+    }
+
+    // no pattern pins v yet: enumerate its distinct values in the narrowest pattern
+    int bestLead = 0, bestPrefix = 0, bestColumn = 0, bestLo = 0, bestHi = -1;
+    const Pattern* bestPattern = nullptr;
+    for (Pattern& pattern : patterns) {
+        int position = -1;
+        bool fixed[3];
+        int fixedCount = 0;
+        for (int p = 0; p < 3; p++) {
+            fixed[p] = (valueAt(pattern, p) != -1);
+            if (fixed[p]) fixedCount++;
+            if (pattern.variable[p] && pattern.value[p] == v) position = p;
+        }
+        if (position == -1) continue;
+
+        int lead = position;
+        if (fixedCount == 1) {
+            for (int p = 0; p < 3; p++) if (fixed[p]) lead = p;
+        }
+        else if (fixedCount == 2) {
+            for (int p = 0; p < 3; p++) if (fixed[p] && fixed[(p + 1) % 3]) lead = p;
+        }
+        int lo, hi;
+        index->range(lead, fixedCount, valueAt(pattern, lead), valueAt(pattern, (lead + 1) % 3), lo, hi);
+        if (bestPattern == nullptr || hi - lo < bestHi - bestLo) {
+            bestPattern = &pattern;
+            bestLead = lead;
+            bestPrefix = fixedCount;
+            bestColumn = (position - lead + 3) % 3;
+            bestLo = lo;
+            bestHi = hi;
+        }
+    }
+
+    const vector<int>& column = index->permutations[bestLead].columns[bestColumn];
+    level.candidates.assign(column.begin() + bestLo, column.begin() + bestHi);
+    // the first free column is already sorted within the range
+    if (bestColumn != bestPrefix) sort(level.candidates.begin(), level.candidates.end());
+    level.candidates.erase(unique(level.candidates.begin(), level.candidates.end()), level.candidates.end());
+}
+
+bool TripleCursor::check(int depth) {
+    for (int p : verify[depth]) {
+        Pattern& pattern = patterns[p];
+        if (!index->contains(valueAt(pattern, 0), valueAt(pattern, 1), valueAt(pattern, 2))) return false;
+    }
+    return true;
+}
+
+bool TripleCursor::next() {
+    if (exhausted) return false;
+    int depth;
+    if (!started) {
+        started = true;
+        if (order.empty()) {
+            // only ground patterns, all of which hold: one empty solution
+            exhausted = true;
+            return true;
+        }
+        depth = 0;
+        open(0);
+    }
+    else {
+        depth = order.size() - 1;
+    }
+
+    while (depth >= 0) {
+        Level& level = levels[depth];
+        int v = order[depth];
+        if (level.next == (int)level.candidates.size()) {
+            binding[v] = -1;
+            depth--;
+            continue;
+        }
+        binding[v] = level.candidates[level.next++];
+        if (!check(depth)) continue;
+        if (depth + 1 == (int)order.size()) return true;
+        depth++;
+        open(depth);
+    }
+    exhausted = true;
+    return false;
+}
+
+vector<string> TripleCursor::variables() {
+    return variableNames;
+}
+
+string TripleCursor::get(string variable) {
+    for (int v = 0; v < (int)variableNames.size(); v++) {
+        if (variableNames[v] != variable) continue;
+        if (binding[v] == -1) throw InvalidQueryException("No current solution!");
+        return predicateVariable[v] ? (*labelNames)[binding[v]] : (*entityNames)[binding[v]];
+    }
+    throw InvalidQueryException("Unknown variable " + variable + "!");
+}
+
+vector<string> TripleCursor::row() {
+    vector<string> values;
+    for (string& name : variableNames) values.push_back(this->get(name));
+    return values;
+}
+
+// =============================================================================
+// Class QueryOptions Implementation
+// =============================================================================
+
+CancellationToken::CancellationToken() {
+    this->flag = make_shared<atomic<bool>>(false);
+}
+
+void CancellationToken::cancel() {
+    flag->store(true, memory_order_relaxed);
+}
+
+bool CancellationToken::cancelled() const {
+    return flag->load(memory_order_relaxed);
+}
+
+QueryOptions& QueryOptions::timeout(long long milliseconds) {
+    this->deadline = chrono::steady_clock::now() + chrono::milliseconds(milliseconds);
+    return *this;
+}
+
+QueryBudget::QueryBudget(const QueryOptions& options) : options(options) {
+    this->vertices = 0;
+    this->edges = 0;
+    this->results = 0;
+    this->reason_ = TruncationReason::NONE;
+}
+
+bool QueryBudget::visitVertex() {
+    if (reason_ != TruncationReason::NONE) return false;
+    if (options.maxVertices > 0 && vertices >= options.maxVertices) {
+        reason_ = TruncationReason::VERTEX_LIMIT;
+        return false;
+    }
+    // the first visit checks too, so an expired or cancelled query does no work at all
+    if (vertices % CHECK_INTERVAL == 0) {
+        if (options.token.cancelled()) reason_ = TruncationReason::CANCELLED;
+        else if (options.deadline != chrono::steady_clock::time_point::max()
+                 && chrono::steady_clock::now() >= options.deadline) reason_ = TruncationReason::DEADLINE;
+        if (reason_ != TruncationReason::NONE) return false;
+    }
+    vertices++;
+    return true;
+}
+
+bool QueryBudget::scanEdges(int count) {
+    if (reason_ != TruncationReason::NONE) return false;
+    edges += count;
+    if (options.maxEdges > 0 && edges > options.maxEdges) {
+        reason_ = TruncationReason::EDGE_LIMIT;
+        return false;
+    }
+    return true;
+}
+
+bool QueryBudget::addResult() {
+    if (reason_ != TruncationReason::NONE) return false;
+    // reaching the limit is not yet a truncation, finding one more result is
+    if (options.maxResults > 0 && results >= options.maxResults) {
+        reason_ = TruncationReason::RESULT_LIMIT;
+        return false;
+    }
+    results++;
+    return true;
+}
+
+bool QueryBudget::exhausted() {
+    return reason_ != TruncationReason::NONE;
+}
+
+TruncationReason QueryBudget::reason() {
+    return reason_;
+}
+
+// =============================================================================
+// Class NameTable / ChangeFeed Implementation
+// =============================================================================
+
+NameTable::NameTable(int generation, unsigned long long firstSequence) {
+    for (int i = 0; i < MAX_CHUNKS; i++) chunks[i].store(nullptr, memory_order_relaxed);
+    count_.store(0, memory_order_relaxed);
+    this->generation = generation;
+    this->firstSequence = firstSequence;
+}
+
+NameTable::~NameTable() {
+    for (int i = 0; i < MAX_CHUNKS; i++) delete[] chunks[i].load(memory_order_relaxed);
+}
+
+void NameTable::locate(int index, int& chunk, int& offset) {
+    // chunk k starts at BASE * (2^k - 1)
+    unsigned scaled = index / BASE + 1;
+    chunk = 0;
+    while (scaled > 1) {
+        scaled >>= 1;
+        chunk++;
+    }
+    offset = index - BASE * ((1 << chunk) - 1);
+}
+
+int NameTable::append(const string& name) {
+    int index = count_.load(memory_order_relaxed);
+    // the last chunk ends at CAPACITY, short of INT_MAX
+    if (index >= CAPACITY) throw length_error("NameTable is full");
+    int chunk, offset;
+    locate(index, chunk, offset);
+    string* storage = chunks[chunk].load(memory_order_relaxed);
+    if (storage == nullptr) {
+        storage = new string[BASE << chunk];
+        chunks[chunk].store(storage, memory_order_release);
+    }
+    storage[offset] = name;
+    count_.store(index + 1, memory_order_release);
+    return index;
+}
+
+const string& NameTable::get(int index) {
+    int chunk, offset;
+    locate(index, chunk, offset);
+    return chunks[chunk].load(memory_order_acquire)[offset];
+}
+
+int NameTable::count() {
+    return count_.load(memory_order_acquire);
+}
+
+size_t NameTable::memoryBytes() {
+    size_t bytes = 0;
+    int n = count();
+    for (int chunk = 0; chunk < MAX_CHUNKS; chunk++) {
+        string* storage = chunks[chunk].load(memory_order_acquire);
+        if (storage == nullptr) break;
+        int first = BASE * ((1 << chunk) - 1);
+        bytes += (size_t)(BASE << chunk) * sizeof(string);
+        for (int i = first; i < n && i < first + (BASE << chunk); i++) {
+            bytes += MemoryUsage::valueBytes(storage[i - first]);
+        }
+    }
+    return bytes;
+}
+
+ChangeFeed::ChangeFeed(int capacity) {
+    unsigned long long size = 1;
+    while (size < (unsigned long long)max(capacity, 1)) size <<= 1;
+    this->slots.reset(new Slot[size]);
+    this->mask = size - 1;
+    for (unsigned long long i = 0; i < size; i++) slots[i].sequence.store(0, memory_order_relaxed);
+    this->head.store(0, memory_order_relaxed);
+    this->names = make_shared<NameTable>(0, 1);
+}
+
+int ChangeFeed::entityName(int id, const string& name) {
+    if (id >= (int)entityNames.size()) entityNames.resize(id + 1, -1);
+    if (entityNames[id] < 0) entityNames[id] = names->append(name);
+    return entityNames[id];
+}
+
+int ChangeFeed::labelName(int label, const string& name) {
+    if (label >= (int)labelNames.size()) labelNames.resize(label + 1, -1);
+    if (labelNames[label] < 0) labelNames[label] = names->append(name);
+    return labelNames[label];
+}
+
+void ChangeFeed::publish(ChangeType type, int from, int to, int label, float weight) {
+    unsigned long long sequence = head.load(memory_order_relaxed) + 1;
+    Slot& slot = slots[sequence & mask];
+    slot.sequence.store(0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot.type.store(static_cast<uint8_t>(type), memory_order_relaxed);
+    slot.from.store(from, memory_order_relaxed);
+    slot.to.store(to, memory_order_relaxed);
+    slot.label.store(label, memory_order_relaxed);
+    slot.generation.store(names->generation, memory_order_relaxed);
+    slot.weight.store(weight, memory_order_relaxed);
+    slot.sequence.store(sequence, memory_order_release);
+    head.store(sequence, memory_order_release);
+
+    // once every event in the ring is at least as new as a table, the tables
+    // it replaced can go; readers still copying from them hold their own reference
+    unsigned long long oldest = (sequence > mask) ? sequence - mask : 1;
+    for (NameTable* table = names.get(); table->older != nullptr; table = table->older.get()) {
+        if (table->firstSequence <= oldest) {
+            atomic_store(&table->older, shared_ptr<NameTable>());
+            break;
+        }
+    }
+}
+
+shared_ptr<NameTable> ChangeFeed::namesOf(int generation) {
+    shared_ptr<NameTable> table = atomic_load(&names);
+    while (table != nullptr && table->generation != generation) table = atomic_load(&table->older);
+    return table;
+}
+
+void ChangeFeed::entityAdded(int id, const string& name) {
+    publish(ChangeType::ENTITY_ADDED, entityName(id, name), -1, -1, 0);
+}
+
+void ChangeFeed::relationAdded(int from, const string& fromName, int to, const string& toName,
+                               int label, const string& labelName, float weight) {
+    publish(ChangeType::RELATION_ADDED, entityName(from, fromName), entityName(to, toName),
+            this->labelName(label, labelName), weight);
+}
+
+void ChangeFeed::relationRemoved(int from, const string& fromName, int to, const string& toName,
+                                 int label, const string& labelName, float weight) {
+    publish(ChangeType::RELATION_REMOVED, entityName(from, fromName), entityName(to, toName),
+            this->labelName(label, labelName), weight);
+}
+
+void ChangeFeed::cleared() {
+    publish(ChangeType::CLEARED, -1, -1, -1, 0);
+    // later events name entities in a fresh table; events before the clear
+    // still resolve through 'older' until the ring has moved past them
+    shared_ptr<NameTable> fresh = make_shared<NameTable>(names->generation + 1, head.load(memory_order_relaxed) + 1);
+    fresh->older = names;
+    atomic_store(&names, fresh);
+    entityNames.clear();
+    labelNames.clear();
+}
+
+int ChangeFeed::capacity() {
+    return mask + 1;
+}
+
+unsigned long long ChangeFeed::latestSequence() {
+    return head.load(memory_order_acquire);
+}
+
+bool ChangeFeed::read(unsigned long long fromSequence, int maxEvents, vector<ChangeEvent>& out) {
+    unsigned long long last = head.load(memory_order_acquire);
+    for (unsigned long long sequence = max(fromSequence, 1ULL); sequence <= last && maxEvents > 0;
+         sequence++, maxEvents--) {
+        Slot& slot = slots[sequence & mask];
+        if (slot.sequence.load(memory_order_acquire) != sequence) return false;
+        ChangeType type = static_cast<ChangeType>(slot.type.load(memory_order_relaxed));
+        int from = slot.from.load(memory_order_relaxed);
+        int to = slot.to.load(memory_order_relaxed);
+        int label = slot.label.load(memory_order_relaxed);
+        int generation = slot.generation.load(memory_order_relaxed);
+        float weight = slot.weight.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (slot.sequence.load(memory_order_relaxed) != sequence) return false;
+        // names are never rewritten, but the table goes away once the ring has passed the event
+        shared_ptr<NameTable> table = namesOf(generation);
+        if (table == nullptr) return false;
+
+        ChangeEvent event;
+        event.sequence = sequence;
+        event.type = type;
+        event.from = (from >= 0) ? table->get(from) : "";
+        event.to = (to >= 0) ? table->get(to) : "";
+        event.label = (label >= 0) ? table->get(label) : "";
+        event.weight = weight;
+        out.push_back(event);
+    }
+    return true;
+}
+
+size_t ChangeFeed::memoryBytes() {
+    size_t bytes = (mask + 1) * sizeof(Slot) + entityNames.capacity() * sizeof(int) + labelNames.capacity() * sizeof(int);
+    for (NameTable* table = names.get(); table != nullptr; table = table->older.get()) {
+        bytes += sizeof(NameTable) + table->memoryBytes();
+    }
+    return bytes;
+}
+
+ChangeSubscription::ChangeSubscription(shared_ptr<ChangeFeed> feed, unsigned long long next) {
+    this->feed = feed;
+    this->next = max(next, 1ULL);
+    this->overrun_ = false;
+}
+
+vector<ChangeEvent> ChangeSubscription::poll(int maxEvents) {
+    vector<ChangeEvent> events;
+    if (overrun_) return events;
+    if (!feed->read(next, maxEvents, events)) overrun_ = true;
+    next += events.size();
+    return events;
+}
+
+bool ChangeSubscription::overrun() {
+    return overrun_;
+}
+
+unsigned long long ChangeSubscription::position() {
+    return next;
+}
+
+// =============================================================================
+// Class KnowledgeGraph Implementation
+// =============================================================================
+
+int KnowledgeGraph::getEntityIndex(string entity) {
+    for (int i = 0; i < entities.size(); i++) {
+        if (entities[i] == entity) return i;
+    }
+    return -1;
+}
+
+// Scratch for the public traversal wrappers, one per thread: VisitMap keeps
+// its arrays between queries, so each query costs what it visits rather than
+// a fresh graph-sized allocation, and concurrent readers never share it
+static TraversalScratch& threadScratch() {
+    static thread_local TraversalScratch scratch;
+    return scratch;
+}
+
+KnowledgeGraph::KnowledgeGraph() {
+    // TODO: Initialize the KnowledgeGraph
+    this->nextPageSession = 0;
+    this->nextWatch = 0;
+    // aura farming
+    /*
+    graph = DGraphModel<string>([](string& a, string& b){ return a == b; }, 
+                                [](string& s){ return s; });
+    */
+}
+
+void KnowledgeGraph::addEntity(string entity) {
+    // TODO: Add a new entity to the Knowledge Graph
+    if (graph.contains(entity)) throw EntityExistsException();
+    
+    graph.add(entity);
+
+    entities.push_back(entity);
+    prefixIndex.insert(entity);
+    if (feed) feed->entityAdded(entities.size() - 1, entity);
+}
+
+void KnowledgeGraph::addEntities(vector<string> newEntities) {
+    // validate the whole batch first so a duplicate leaves the graph untouched
+    unordered_set<string> batch;
+    for (string& entity : newEntities) {
+        if (graph.contains(entity) || !batch.insert(entity).second) throw EntityExistsException();
+    }
+    for (string& entity : newEntities) {
+        graph.add(entity);
+        entities.push_back(entity);
+        if (feed) feed->entityAdded(entities.size() - 1, entity);
+    }
+    prefixIndex.build(entities);
+}
+
+void KnowledgeGraph::addRelation(string from, string to, float weight) {
+    // TODO: Add a directed relation
+    VertexNode<string>* fromNode = graph.getVertexNode(from);
+    VertexNode<string>* toNode = graph.getVertexNode(to);    
+    if (fromNode == nullptr || toNode == nullptr) throw EntityNotFoundException();
+
+    graph.connect(from, to, weight);
+    if (feed) feed->relationAdded(fromNode->id_, from, toNode->id_, to, 0, "", weight);
+    if (!watches.empty()) watchEdgeAdded(fromNode, toNode);
+}
+
+void KnowledgeGraph::addRelation(string from, string to, string label, float weight) {
+    VertexNode<string>* fromNode = graph.getVertexNode(from);
+    VertexNode<string>* toNode = graph.getVertexNode(to);
+    if (fromNode == nullptr || toNode == nullptr) throw EntityNotFoundException();
+
+    graph.connect(from, to, weight, label);
+    if (feed) feed->relationAdded(fromNode->id_, from, toNode->id_, to, graph.labelId(label), label, weight);
+    if (!watches.empty()) watchEdgeAdded(fromNode, toNode);
+}
+
+void KnowledgeGraph::removeRelation(string from, string to) {
+    VertexNode<string>* fromNode = graph.getVertexNode(from);
+    VertexNode<string>* toNode = graph.getVertexNode(to);
+    if (fromNode == nullptr || toNode == nullptr) throw EntityNotFoundException();
+
+    // the edge disconnect will take, i.e. the first out-edge to 'to' in adList
+    Edge<string>* removed = nullptr;
+    for (Edge<string>* edge : fromNode->adList) {
+        if (edge->from == fromNode && edge->to == toNode) {
+            removed = edge;
+            break;
+        }
+    }
+    if (removed == nullptr) throw EdgeNotFoundException();
+    int label = removed->label;
+    float weight = removed->weight;
+
+    graph.disconnect(from, to);
+    if (feed) feed->relationRemoved(fromNode->id_, from, toNode->id_, to, label, graph.labelName(label), weight);
+    if (!watches.empty()) watchEdgeRemoved(fromNode, toNode);
+}
+
+void KnowledgeGraph::removeRelation(string from, string to, string label) {
+    VertexNode<string>* fromNode = graph.getVertexNode(from);
+    VertexNode<string>* toNode = graph.getVertexNode(to);
+    if (fromNode == nullptr || toNode == nullptr) throw EntityNotFoundException();
+
+    int id = graph.labelId(label);
+    Edge<string>* removed = (id < 0) ? nullptr : fromNode->getEdge(toNode, id);
+    if (removed == nullptr) throw EdgeNotFoundException();
+    float weight = removed->weight;
+
+    graph.disconnect(from, to, label);
+    if (feed) feed->relationRemoved(fromNode->id_, from, toNode->id_, to, id, label, weight);
+    if (!watches.empty()) watchEdgeRemoved(fromNode, toNode);
+}
+
+void KnowledgeGraph::clear() {
+    // every watched entity goes away; the watches stay, empty
+    for (auto& entry : watches) {
+        KHopWatch& watch = entry.second;
+        for (auto& member : watch.distance) {
+            if (member.first != watch.start) watch.pending.push_back(WatchDelta{entities[member.first], WatchChange::LEFT, -1});
+        }
+        watch.distance.clear();
+        watch.start = -1;
+    }
+    watchers.clear();
+
+    graph.clear();
+    entities.clear();
+    prefixIndex.build(entities);
+    {
+        lock_guard<mutex> guard(pageLock);
+        pageSessions.clear();
+    }
+    if (feed) feed->cleared();
+}
+
+void KnowledgeGraph::setParallelEdgePolicy(ParallelEdgePolicy policy) {
+    graph.setParallelEdgePolicy(policy);
+}
+
+vector<string> KnowledgeGraph::getRelationLabels() {
+    vector<string> names = graph.labels();
+    names.erase(names.begin()); // the unlabelled slot
+    return names;
+}
+
+vector<int> KnowledgeGraph::labelFilter(vector<string>& labels) {
+    vector<int> ids;
+    for (string& label : labels) {
+        int id = graph.labelId(label);
+        if (id != -1) ids.push_back(id);
+    }
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    return ids;
+}
+
+void KnowledgeGraph::expand(VertexNode<string>* node, const vector<int>* labels, bool outward,
+                            vector<VertexNode<string>*>& result) {
+    result.clear();
+    // unfiltered, or a vertex no labelled edge has touched: adList holds the answer
+    if (labels == nullptr || node->partitions == nullptr) {
+        if (labels != nullptr && (labels->empty() || (*labels)[0] != 0)) return;
+        for (Edge<string>* edging : node->adList) {
+            if (outward && edging->from == node) result.push_back(edging->to);
+            else if (!outward && edging->to == node) result.push_back(edging->from);
+        }
+        return;
+    }
+    for (int label : *labels) {
+        LabelPartition<string>* part = node->findPartition(label);
+        if (part == nullptr) continue;
+        if (outward) {
+            for (Edge<string>* edging : part->out) result.push_back(edging->to);
+        }
+        else {
+            for (Edge<string>* edging : part->in) result.push_back(edging->from);
+        }
+    }
+}
+
+vector<string> KnowledgeGraph::getAllEntities() {
+    return entities;
+}
+
+vector<string> KnowledgeGraph::findByPrefix(string prefix, int limit) {
+    return prefixIndex.findByPrefix(prefix, limit);
+}
+
+vector<string> KnowledgeGraph::findInRange(string from, string to, int limit) {
+    return prefixIndex.range(from, to, limit);
+}
+
+void KnowledgeGraph::rebuildPrefixIndex() {
+    prefixIndex.build(entities);
+}
+
+vector<string> KnowledgeGraph::getNeighbors(string entity) {
+    VertexNode<string>* node = graph.getVertexNode(entity);
+    if (node == nullptr) throw EntityNotFoundException();
+
+    return node->getOutVertices();
+}
+
+string KnowledgeGraph::bfs(string start) {
+    if (!graph.contains(start)) throw EntityNotFoundException();
+    return graph.BFS(start);
+}
+
+string KnowledgeGraph::dfs(string start) {
+    if (!graph.contains(start)) throw EntityNotFoundException();
+    return graph.DFS(start);
+}
+
+bool KnowledgeGraph::isReachable(string from, string to) {
+    VertexNode<string>* fromNode = graph.getVertexNode(from);
+    VertexNode<string>* toNode = graph.getVertexNode(to);
+    if (fromNode == nullptr || toNode == nullptr) throw EntityNotFoundException();
+
+    if (fromNode == toNode) return true;
+
+    // a cycle or shared sub-DAG collapses into one component and is walked once;
+    // a stale condensation is not rebuilt here, an early-exit BFS is cheaper
+    // than a full Tarjan pass when mutations and checks interleave
+    shared_ptr<Condensation> scc = graph.currentCondensation();
+    if (scc != nullptr) return scc->reaches(scc->component(fromNode->id_), scc->component(toNode->id_));
+    return this->isReachable(from, to, threadScratch(), nullptr, nullptr);
+}
+
+string KnowledgeGraph::toString() {
+    return graph.toString();
+}
+
+vector<string> KnowledgeGraph::getNeighbors(string entity, vector<string> labels) {
+    VertexNode<string>* node = graph.getVertexNode(entity);
+    if (node == nullptr) throw EntityNotFoundException();
+
+    vector<int> filter = labelFilter(labels);
+    vector<VertexNode<string>*> outNodes;
+    this->expand(node, &filter, true, outNodes);
+    vector<string> neighbors;
+    for (VertexNode<string>* outNode : outNodes) neighbors.push_back(outNode->vertex);
+    return neighbors;
+}
+
+string KnowledgeGraph::bfs(string start, vector<string> labels) {
+    VertexNode<string>* startingNode = graph.getVertexNode(start);
+    if (startingNode == nullptr) throw EntityNotFoundException();
+
+    vector<int> filter = labelFilter(labels);
+    TraversalScratch& scratch = threadScratch();
+    scratch.visited.reset(graph.size());
+    scratch.nodes.clear();
+    scratch.nodes.push_back(startingNode);
+    scratch.visited.set(startingNode->id_);
+
+    stringstream ss;
+    ss << "[";
+    for (int head = 0; head < (int)scratch.nodes.size(); head++) {
+        VertexNode<string>* node = scratch.nodes[head];
+        if (head > 0) ss << ", ";
+        ss << graph.vertex2Str(*node);
+
+        this->expand(node, &filter, true, scratch.adjacent);
+        for (VertexNode<string>* outNode : scratch.adjacent) {
+            if (!scratch.visited.contains(outNode->id_)) {
+                scratch.visited.set(outNode->id_);
+                scratch.nodes.push_back(outNode);
+            }
+        }
+    }
+    ss << "]";
+    return ss.str();
+}
+
+bool KnowledgeGraph::isReachable(string from, string to, vector<string> labels) {
+    TraversalScratch& scratch = threadScratch();
+    vector<int> filter = labelFilter(labels);
+    return this->isReachable(from, to, scratch, &filter, nullptr);
+}
+
+bool KnowledgeGraph::isReachable(string from, string to, TraversalScratch& scratch, const vector<int>* labels,
+                                 QueryBudget* budget) {
+    VertexNode<string>* fromNode = graph.getVertexNode(from);
+    VertexNode<string>* toNode = graph.getVertexNode(to);
+    if (fromNode == nullptr || toNode == nullptr) throw EntityNotFoundException();
+
+    if (fromNode == toNode) return true;
+
+    VisitMap& visited = scratch.visited;
+    vector<VertexNode<string>*>& queue = scratch.nodes;
+    visited.reset(graph.size());
+    queue.clear();
+    queue.push_back(fromNode);
+    visited.set(fromNode->id_);
+    for (int head = 0; head < (int)queue.size(); head++) {
+        if (budget != nullptr && !budget->visitVertex()) break;
+        this->expand(queue[head], labels, true, scratch.adjacent);
+        if (budget != nullptr && !budget->scanEdges(scratch.adjacent.size())) break;
+        for (VertexNode<string>* outNode : scratch.adjacent) {
+            if (outNode == toNode) return true;
+            if (!visited.contains(outNode->id_)) {
+                visited.set(outNode->id_);
+                queue.push_back(outNode);
+            }
+        }
+    }
+    return false;
+}
+
+vector<string> KnowledgeGraph::getRelatedEntities(string entity, int depth) {
+    TraversalScratch& scratch = threadScratch();
+    return this->getRelatedEntities(entity, depth, scratch);
+}
+
+vector<string> KnowledgeGraph::getRelatedEntities(string entity, int depth, vector<string> labels) {
+    TraversalScratch& scratch = threadScratch();
+    vector<int> filter = labelFilter(labels);
+    return this->getRelatedEntities(entity, depth, scratch, &filter);
+}
+
+vector<string> KnowledgeGraph::getRelatedEntities(string entity, int depth, TraversalScratch& scratch,
+                                                  const vector<int>* labels, QueryBudget* budget) {
+    VertexNode<string>* startingNode = graph.getVertexNode(entity);
+    if (startingNode == nullptr) throw EntityNotFoundException();
+    vector<string> related;
+    VisitMap& visited = scratch.visited;
+    vector<VertexNode<string>*>& queueNode = scratch.nodes;
+    vector<int>& queueDepth = scratch.depths;
+
+    visited.reset(graph.size());
+    queueNode.clear();
+    queueDepth.clear();
+    queueNode.push_back(startingNode);
+    queueDepth.push_back(0);
+    visited.set(startingNode->id_);
+
+    for (int head = 0; head < (int)queueNode.size(); head++) {
+        VertexNode<string>* node = queueNode[head];
+        int nodeDepth = queueDepth[head];
+
+        if (budget != nullptr && !budget->visitVertex()) break;
+        if (nodeDepth > 0) {
+            if (budget != nullptr && !budget->addResult()) break;
+            related.push_back(node->vertex);
+        }
+        if (nodeDepth < depth) {
+            this->expand(node, labels, true, scratch.adjacent);
+            if (budget != nullptr && !budget->scanEdges(scratch.adjacent.size())) break;
+            for (VertexNode<string>* outNode : scratch.adjacent) {
+                if (!visited.contains(outNode->id_)) {
+                    visited.set(outNode->id_);
+                    queueNode.push_back(outNode);
+                    queueDepth.push_back(nodeDepth + 1);
+                }
+            }
+        }
+    }
+    return related;
+}
+
+void KnowledgeGraph::collectAncestors(VertexNode<string>* start, TraversalScratch& scratch,
+                                      const vector<int>* labels, bool bounded) {
+    // DFS over in-edges; scratch.nodes receives the ancestors in visiting order
+    VisitMap& visited = scratch.visited;
+    vector<VertexNode<string>*>& stack = scratch.stack;
+    vector<VertexNode<string>*>& ancestors = scratch.nodes;
+
+    visited.reset(graph.size());
+    stack.clear();
+    ancestors.clear();
+    stack.push_back(start);
+    visited.set(start->id_);
+
+    while (!stack.empty()) {
+        VertexNode<string>* node = stack.back();
+        stack.pop_back();
+        ancestors.push_back(node);
+        
+        this->expand(node, labels, false, scratch.adjacent);
+        for (VertexNode<string>* parentNode : scratch.adjacent) {
+            // under a budget, stay inside what the (possibly truncated) distance walk reached
+            if (bounded && !scratch.distanceA.contains(parentNode->id_)) continue;
+            if (!visited.contains(parentNode->id_)) {
+                visited.set(parentNode->id_);
+                stack.push_back(parentNode);
+            }
+        }
+    }
+}
+
+void KnowledgeGraph::ancestorDistances(VertexNode<string>* entityOne, VertexNode<string>* entityTwo,
+                                       TraversalScratch& scratch, const vector<int>* labels, QueryBudget* budget) {
+    // BFS over in-edges from each entity: distance of a is the forward BFS distance
+    // from a to that entity. The two walks take turns a level at a time, so a budget
+    // that runs out leaves both sides explored to about the same depth
+    VertexNode<string>* targets[2] = {entityOne, entityTwo};
+    VisitMap* distances[2] = {&scratch.distanceA, &scratch.distanceB};
+    vector<VertexNode<string>*>* queues[2] = {&scratch.stack, &scratch.nodes};
+    int heads[2] = {0, 0};
+    for (int side = 0; side < 2; side++) {
+        distances[side]->reset(graph.size());
+        queues[side]->clear();
+        queues[side]->push_back(targets[side]);
+        distances[side]->set(targets[side]->id_, 0);
+    }
+
+    while (heads[0] < (int)queues[0]->size() || heads[1] < (int)queues[1]->size()) {
+        for (int side = 0; side < 2; side++) {
+            VisitMap& distance = *distances[side];
+            vector<VertexNode<string>*>& queue = *queues[side];
+            // everything queued before this turn is one level
+            for (int levelEnd = queue.size(); heads[side] < levelEnd; heads[side]++) {
+                VertexNode<string>* node = queue[heads[side]];
+                int nodeDistance = distance.get(node->id_);
+                if (budget != nullptr && !budget->visitVertex()) return;
+                this->expand(node, labels, false, scratch.adjacent);
+                if (budget != nullptr && !budget->scanEdges(scratch.adjacent.size())) return;
+                for (VertexNode<string>* parentNode : scratch.adjacent) {
+                    if (!distance.contains(parentNode->id_)) {
+                        distance.set(parentNode->id_, nodeDistance + 1);
+                        queue.push_back(parentNode);
+                    }
+                }
+            }
+        }
+    }
+}
+
+string KnowledgeGraph::findCommonAncestors(string entity1, string entity2) {
+    TraversalScratch& scratch = threadScratch();
+    return this->findCommonAncestors(entity1, entity2, scratch);
+}
+
+string KnowledgeGraph::findCommonAncestors(string entity1, string entity2, vector<string> labels) {
+    TraversalScratch& scratch = threadScratch();
+    vector<int> filter = labelFilter(labels);
+    return this->findCommonAncestors(entity1, entity2, scratch, &filter);
+}
+
+string KnowledgeGraph::findCommonAncestors(string entity1, string entity2, TraversalScratch& scratch,
+                                           const vector<int>* labels, QueryBudget* budget) {
+    VertexNode<string>* entityOne = graph.getVertexNode(entity1);
+    VertexNode<string>* entityTwo = graph.getVertexNode(entity2);
+
+    if (entityOne == nullptr || entityTwo == nullptr) throw EntityNotFoundException();
+
+    // one reverse BFS per entity replaces a forward BFS per common ancestor
+    this->ancestorDistances(entityOne, entityTwo, scratch, labels, budget);
+    this->collectAncestors(entityOne, scratch, labels, budget != nullptr);
+
+    VertexNode<string>* bestAncestor = nullptr;
+    int minTotalDistance = 999999;
+    for (VertexNode<string>* ancestor : scratch.nodes) {
+        int distanceTwo = scratch.distanceB.get(ancestor->id_);
+        if (distanceTwo == -1) continue;
+        int totalDistance = scratch.distanceA.get(ancestor->id_) + distanceTwo;
+        if (totalDistance < minTotalDistance) {
+            minTotalDistance = totalDistance;
+            bestAncestor = ancestor;
+        }
+    }
+    if (bestAncestor == nullptr) return "No common ancestor";
+    return bestAncestor->vertex;
+}
+
+void KnowledgeGraph::prepareConcurrentReads() {
+    graph.condensation();
+}
+
+shared_ptr<TransitionMatrix> KnowledgeGraph::transitionMatrix() {
+    shared_ptr<TransitionMatrix> current = atomic_load(&transitions);
+    if (current != nullptr && current->version == graph.version()) return current;
+    lock_guard<mutex> guard(cacheLock);
+    current = atomic_load(&transitions);
+    if (current != nullptr && current->version == graph.version()) return current;
+
+    shared_ptr<TransitionMatrix> fresh = make_shared<TransitionMatrix>();
+    TransitionMatrix& matrix = *fresh;
+
+    int n = graph.size();
+    vector<float> outWeight(n, 0);
+    vector<int> outCount(n, 0);
+    vector<int> inCount(n + 1, 0);
+
+    for (VertexNode<string>* node : graph.nodeList) {
+        for (Edge<string>* edging : node->outEdges()) {
+            outWeight[node->id_] += max(edging->weight, 0.0f);
+            outCount[node->id_]++;
+            inCount[edging->to->id_ + 1]++;
+        }
+        if (outCount[node->id_] == 0) matrix.dangling.push_back(node->id_);
+    }
+
+    matrix.offsets.assign(n + 1, 0);
+    for (int v = 0; v < n; v++) matrix.offsets[v + 1] = matrix.offsets[v] + inCount[v + 1];
+    matrix.sources.resize(matrix.offsets[n]);
+    matrix.probabilities.resize(matrix.offsets[n]);
+
+    vector<int> cursor(matrix.offsets.begin(), matrix.offsets.end() - 1);
+    for (VertexNode<string>* node : graph.nodeList) {
+        int u = node->id_;
+        for (Edge<string>* edging : node->outEdges()) {
+            int slot = cursor[edging->to->id_]++;
+            matrix.sources[slot] = u;
+            matrix.probabilities[slot] = (outWeight[u] > 0) ? max(edging->weight, 0.0f) / outWeight[u]
+                                                            : 1.0f / outCount[u];
+        }
+    }
+
+    matrix.version = graph.version();
+    atomic_store(&transitions, fresh);
+    return fresh;
+}
+
+vector<int> KnowledgeGraph::seedIds(vector<string>& seeds) {
+    vector<int> ids;
+    for (string& seed : seeds) {
+        VertexNode<string>* node = graph.getVertexNode(seed);
+        if (node == nullptr) throw EntityNotFoundException();
+        ids.push_back(node->id_);
+    }
+    return ids;
+}
+
+vector<RankedEntity> KnowledgeGraph::topRanked(vector<float>& rank, const vector<int>& seeds, int k, bool includeSeeds) {
+    vector<int> candidates;
+    for (int v = 0; v < (int)rank.size(); v++) {
+        if (rank[v] <= 0) continue;
+        if (!includeSeeds && find(seeds.begin(), seeds.end(), v) != seeds.end()) continue;
+        candidates.push_back(v);
+    }
+    int count = min<int>(k, candidates.size());
+    auto higher = [&rank](int a, int b) { return (rank[a] != rank[b]) ? rank[a] > rank[b] : a < b; };
+    partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(), higher);
+
+    vector<RankedEntity> ranked;
+    for (int i = 0; i < count; i++) ranked.push_back(RankedEntity{entities[candidates[i]], rank[candidates[i]]});
+    return ranked;
+}
+
+vector<RankedEntity> KnowledgeGraph::personalizedPageRank(vector<string> seeds, int k, PageRankOptions options) {
+    if (seeds.empty() || k <= 0) return {};
+    vector<int> ids = seedIds(seeds);
+    vector<float> rank, next;
+    transitionMatrix()->personalizedRank(ids, options, rank, next);
+    return topRanked(rank, ids, k, options.includeSeeds);
+}
+
+vector<vector<RankedEntity>> KnowledgeGraph::personalizedPageRankBatch(vector<string> seeds, int k, PageRankOptions options) {
+    vector<vector<RankedEntity>> results(seeds.size());
+    if (seeds.empty() || k <= 0) return results;
+    vector<int> ids = seedIds(seeds);
+    shared_ptr<TransitionMatrix> snapshot = transitionMatrix();
+    TransitionMatrix& matrix = *snapshot;
+
+    int threads = (options.threads > 0) ? options.threads : max(1u, thread::hardware_concurrency());
+    threads = min<int>(threads, seeds.size());
+    atomic<int> nextSeed(0);
+    auto work = [&]() {
+        // rank vectors are reused across every seed this worker takes
+        vector<float> rank, next;
+        vector<int> single(1);
+        for (int i = nextSeed++; i < (int)ids.size(); i = nextSeed++) {
+            single[0] = ids[i];
+            matrix.personalizedRank(single, options, rank, next);
+            results[i] = topRanked(rank, single, k, options.includeSeeds);
+        }
+    };
+
+    vector<thread> workers;
+    for (int t = 1; t < threads; t++) workers.push_back(thread(work));
+    work();
+    for (thread& worker : workers) worker.join();
+    return results;
+}
+
+shared_ptr<AliasTable> KnowledgeGraph::aliasTable() {
+    shared_ptr<AliasTable> current = atomic_load(&walkTable);
+    if (current != nullptr && current->version == graph.version()) return current;
+    lock_guard<mutex> guard(cacheLock);
+    current = atomic_load(&walkTable);
+    if (current != nullptr && current->version == graph.version()) return current;
+
+    shared_ptr<AliasTable> fresh = make_shared<AliasTable>();
+    AliasTable& table = *fresh;
+    int n = graph.size();
+    table.offsets.assign(n + 1, 0);
+
+    vector<pair<int, float>> edges;
+    vector<double> scaled;
+    vector<int> small, large;
+    for (VertexNode<string>* node : graph.nodeList) {
+        edges.clear();
+        double total = 0;
+        for (Edge<string>* edging : node->outEdges()) {
+            edges.push_back(make_pair(edging->to->id_, max(edging->weight, 0.0f)));
+            total += max(edging->weight, 0.0f);
+        }
+        sort(edges.begin(), edges.end());
+
+        // Vose: pair every under-full slot with an over-full one that tops it up
+        int degree = edges.size();
+        scaled.assign(degree, 1.0);
+        small.clear();
+        large.clear();
+        for (int i = 0; i < degree; i++) {
+            if (total > 0) scaled[i] = edges[i].second * degree / total;
+            (scaled[i] < 1.0 ? small : large).push_back(i);
+        }
+        int begin = table.targets.size();
+        for (int i = 0; i < degree; i++) {
+            table.targets.push_back(edges[i].first);
+            table.cutoff.push_back(1.0f);
+            table.alias.push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            int under = small.back(), over = large.back();
+            small.pop_back();
+            table.cutoff[begin + under] = scaled[under];
+            table.alias[begin + under] = over;
+            scaled[over] -= 1.0 - scaled[under];
+            if (scaled[over] < 1.0) {
+                large.pop_back();
+                small.push_back(over);
+            }
+        }
+        // leftovers differ from 1 only by rounding and keep cutoff 1
+        table.offsets[node->id_ + 1] = table.targets.size();
+    }
+
+    table.version = graph.version();
+    atomic_store(&walkTable, fresh);
+    return fresh;
+}
+
+// splitmix64: a full-period 64-bit generator that passes BigCrush, small
+// enough to give every walk its own stream
+static uint64_t mixBits(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t nextRandom(uint64_t& state) {
+    state += 0x9E3779B97F4A7C15ULL;
+    return mixBits(state);
+}
+
+void KnowledgeGraph::randomWalk(AliasTable& table, int start, const RandomWalkOptions& options, uint64_t seed,
+                                vector<int>& walk) {
+    uint64_t state = seed;
+    bool biased = (options.p != 1 || options.q != 1);
+    double returnWeight = 1.0 / options.p, awayWeight = 1.0 / options.q;
+    double bound = max(max(returnWeight, 1.0), awayWeight);
+    vector<double> weights;
+
+    walk.clear();
+    walk.push_back(start);
+    while ((int)walk.size() < options.walkLength) {
+        int current = walk.back();
+        if (table.offsets[current] == table.offsets[current + 1]) break;
+        int next = table.sample(current, nextRandom(state));
+        if (biased && walk.size() > 1) {
+            // rejection sampling: propose from the first-order table, accept with
+            // bias / bound, so no per-(previous, current) table is ever built
+            int previous = walk[walk.size() - 2];
+            auto bias = [&](int target) {
+                return (target == previous) ? returnWeight : table.hasEdge(previous, target) ? 1.0 : awayWeight;
+            };
+            bool accepted = false;
+            for (int attempt = 0; attempt < MAX_WALK_REJECTIONS && !accepted; attempt++) {
+                if (attempt > 0) next = table.sample(current, nextRandom(state));
+                double coin = (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+                accepted = coin * bound < bias(next);
+            }
+            if (!accepted) {
+                // extreme p or q: draw from the exact second-order distribution instead
+                table.probabilities(current, weights);
+                double total = 0;
+                for (int i = 0; i < (int)weights.size(); i++) {
+                    weights[i] *= bias(table.targets[table.offsets[current] + i]);
+                    total += weights[i];
+                }
+                double pick = (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0) * total;
+                for (int i = 0; i < (int)weights.size(); i++) {
+                    if (weights[i] <= 0) continue;
+                    next = table.targets[table.offsets[current] + i];
+                    pick -= weights[i];
+                    if (pick < 0) break;
+                }
+            }
+        }
+        walk.push_back(next);
+    }
+}
+
+long long KnowledgeGraph::randomWalks(RandomWalkOptions options, function<void(const vector<int>&)> sink) {
+    // also rejects NaN, which every comparison fails
+    if (!(options.p > 0 && options.q > 0 && isfinite(options.p) && isfinite(options.q))) {
+        throw InvalidQueryException("node2vec p and q must be finite and positive!");
+    }
+    int n = graph.size();
+    if (n == 0 || options.walkLength <= 0 || options.walksPerVertex <= 0) return 0;
+    shared_ptr<AliasTable> snapshot = aliasTable();
+    AliasTable& table = *snapshot;
+
+    // walk i starts at vertex i % n, so every round covers each vertex once
+    long long total = (long long)n * options.walksPerVertex;
+    const long long CHUNK = 256;
+    int threads = (options.threads > 0) ? options.threads : max(1u, thread::hardware_concurrency());
+    threads = min<long long>(threads, (total + CHUNK - 1) / CHUNK);
+    atomic<long long> nextWalk(0);
+    mutex sinkLock;
+    exception_ptr failure; // the first exception, under sinkLock
+    auto work = [&]() {
+        try {
+            vector<vector<int>> batch(CHUNK);
+            for (long long first = nextWalk.fetch_add(CHUNK); first < total; first = nextWalk.fetch_add(CHUNK)) {
+                long long last = min(first + CHUNK, total);
+                for (long long i = first; i < last; i++) {
+                    uint64_t seed = mixBits(options.seed * 0x9E3779B97F4A7C15ULL ^ mixBits(i));
+                    randomWalk(table, i % n, options, seed, batch[i - first]);
+                }
+                lock_guard<mutex> guard(sinkLock);
+                if (failure) return;
+                for (long long i = first; i < last; i++) sink(batch[i - first]);
+            }
+        }
+        catch (...) {
+            lock_guard<mutex> guard(sinkLock);
+            if (!failure) failure = current_exception();
+            nextWalk.store(total);
+        }
+    };
+
+    vector<thread> workers;
+    for (int t = 1; t < threads; t++) workers.push_back(thread(work));
+    work();
+    for (thread& worker : workers) worker.join();
+    if (failure) rethrow_exception(failure);
+    return total;
+}
+
+long long KnowledgeGraph::writeRandomWalks(string path, RandomWalkOptions options) {
+    ofstream out(path, ios::trunc);
+    if (!out) throw StorageException("Cannot open " + path + " for writing");
+    string line;
+    long long count = randomWalks(options, [&](const vector<int>& walk) {
+        line.clear();
+        for (int i = 0; i < (int)walk.size(); i++) {
+            if (i > 0) line += ' ';
+            line += to_string(walk[i]);
+        }
+        line += '\n';
+        out.write(line.data(), line.size());
+    });
+    out.flush();
+    if (!out) throw StorageException("Failed writing " + path);
+    return count;
+}
+
+CompressedGraph KnowledgeGraph::compress(CompressionOptions options) {
+    CompressedGraphBuilder builder;
+    for (string& entity : entities) builder.addEntity(entity);
+    for (VertexNode<string>* node : graph.nodeList) {
+        for (Edge<string>* edging : node->outEdges()) {
+            builder.addRelation(node->vertex, edging->to->vertex, edging->weight);
+        }
+    }
+    return builder.build(options);
+}
+
+int KnowledgeGraph::getComponentId(string entity) {
+    VertexNode<string>* node = graph.getVertexNode(entity);
+    if (node == nullptr) throw EntityNotFoundException();
+    return graph.condensation()->component(node->id_);
+}
+
+bool KnowledgeGraph::hasCycle() {
+    return graph.condensation()->hasCycle();
+}
+
+vector<string> KnowledgeGraph::getTopologicalOrder() {
+    vector<string> ordered;
+    for (int id : graph.condensation()->topologicalOrder()) ordered.push_back(entities[id]);
+    return ordered;
+}
+
+TriangleCounts KnowledgeGraph::countTriangles(int threads) {
+    return graph.countTriangles(threads);
+}
+
+KHopWatch& KnowledgeGraph::findWatch(int watchId) {
+    unordered_map<int, KHopWatch>::iterator it = watches.find(watchId);
+    if (it == watches.end()) throw InvalidQueryException("Unknown watch!");
+    return it->second;
+}
+
+void KnowledgeGraph::setWatchDistance(int watchId, KHopWatch& watch, int vertex, int distance) {
+    unordered_map<int, int>::iterator it = watch.distance.find(vertex);
+    if (distance < 0) {
+        if (it == watch.distance.end()) return;
+        watch.distance.erase(it);
+        vector<int>& holders = watchers[vertex];
+        holders.erase(find(holders.begin(), holders.end(), watchId));
+        watch.pending.push_back(WatchDelta{entities[vertex], WatchChange::LEFT, -1});
+    }
+    else if (it == watch.distance.end()) {
+        watch.distance.emplace(vertex, distance);
+        if (vertex >= (int)watchers.size()) watchers.resize(vertex + 1);
+        watchers[vertex].push_back(watchId);
+        if (vertex != watch.start) watch.pending.push_back(WatchDelta{entities[vertex], WatchChange::ENTERED, distance});
+    }
+    else if (it->second != distance) {
+        it->second = distance;
+        watch.pending.push_back(WatchDelta{entities[vertex], WatchChange::DISTANCE_CHANGED, distance});
+    }
+}
+
+void KnowledgeGraph::watchEdgeAdded(VertexNode<string>* from, VertexNode<string>* to) {
+    if (from->id_ >= (int)watchers.size()) return;
+    vector<VertexNode<string>*> queue, adjacent;
+    for (int watchId : vector<int>(watchers[from->id_])) {
+        KHopWatch& watch = watches[watchId];
+        int fromDistance = watch.distance[from->id_];
+        if (fromDistance >= watch.depth) continue;
+        unordered_map<int, int>::iterator known = watch.distance.find(to->id_);
+        if (known != watch.distance.end() && known->second <= fromDistance + 1) continue;
+
+        // distances only shrink: relax outwards from 'to' until nothing improves
+        setWatchDistance(watchId, watch, to->id_, fromDistance + 1);
+        queue.assign(1, to);
+        for (int head = 0; head < (int)queue.size(); head++) {
+            VertexNode<string>* node = queue[head];
+            int nodeDistance = watch.distance[node->id_];
+            if (nodeDistance >= watch.depth) continue;
+            this->expand(node, nullptr, true, adjacent);
+            for (VertexNode<string>* outNode : adjacent) {
+                known = watch.distance.find(outNode->id_);
+                if (known == watch.distance.end() || known->second > nodeDistance + 1) {
+                    setWatchDistance(watchId, watch, outNode->id_, nodeDistance + 1);
+                    queue.push_back(outNode);
+                }
+            }
+        }
+    }
+}
+
+void KnowledgeGraph::watchEdgeRemoved(VertexNode<string>* from, VertexNode<string>* to) {
+    if (from->id_ >= (int)watchers.size()) return;
+    vector<VertexNode<string>*> level, next, affectedNodes, adjacent, parents;
+    unordered_set<int> affected;
+    unordered_map<int, int> tentative;
+    for (int watchId : vector<int>(watchers[from->id_])) {
+        KHopWatch& watch = watches[watchId];
+        unordered_map<int, int>& distance = watch.distance;
+        unordered_map<int, int>::iterator fromIt = distance.find(from->id_), toIt = distance.find(to->id_);
+        if (toIt == distance.end() || toIt->second != fromIt->second + 1) continue;
+
+        // true while 'node' keeps an in-neighbour one hop closer that is not affected
+        affected.clear();
+        auto supported = [&](VertexNode<string>* node, int nodeDistance) {
+            this->expand(node, nullptr, false, parents);
+            for (VertexNode<string>* parent : parents) {
+                unordered_map<int, int>::iterator it = distance.find(parent->id_);
+                if (it != distance.end() && it->second == nodeDistance - 1 && !affected.count(parent->id_)) return true;
+            }
+            return false;
+        };
+        if (supported(to, toIt->second)) continue;
+
+        // Vertices whose every shortest path ran through the edge, level by
+        // level: a vertex is affected once all its parents one hop closer are
+        affected.insert(to->id_);
+        affectedNodes.assign(1, to);
+        level.assign(1, to);
+        while (!level.empty()) {
+            next.clear();
+            for (VertexNode<string>* node : level) {
+                int nodeDistance = distance[node->id_];
+                this->expand(node, nullptr, true, adjacent);
+                for (VertexNode<string>* outNode : adjacent) {
+                    unordered_map<int, int>::iterator it = distance.find(outNode->id_);
+                    if (it == distance.end() || it->second != nodeDistance + 1 || affected.count(outNode->id_)) continue;
+                    if (supported(outNode, it->second)) continue;
+                    affected.insert(outNode->id_);
+                    affectedNodes.push_back(outNode);
+                    next.push_back(outNode);
+                }
+            }
+            level.swap(next);
+        }
+
+        // New distances: seeded from unaffected parents, then spread through
+        // the affected region in distance order (unit weights, so buckets)
+        tentative.clear();
+        int farthest = 0;
+        for (VertexNode<string>* node : affectedNodes) {
+            int best = INT_MAX;
+            this->expand(node, nullptr, false, parents);
+            for (VertexNode<string>* parent : parents) {
+                unordered_map<int, int>::iterator it = distance.find(parent->id_);
+                if (it != distance.end() && !affected.count(parent->id_)) best = min(best, it->second + 1);
+            }
+            // INT_MAX (no unaffected parent) would pass for a watch of depth INT_MAX
+            if (best != INT_MAX && best <= watch.depth) {
+                tentative[node->id_] = best;
+                farthest = max(farthest, best);
+            }
+        }
+        // a path through the affected region adds at most one hop per affected
+        // vertex, so the buckets never need to reach past that, whatever the depth
+        int limit = (int)min<long long>(watch.depth, (long long)farthest + affectedNodes.size());
+        vector<vector<VertexNode<string>*>> buckets(limit + 1);
+        for (VertexNode<string>* node : affectedNodes) {
+            unordered_map<int, int>::iterator it = tentative.find(node->id_);
+            if (it != tentative.end()) buckets[it->second].push_back(node);
+        }
+        for (int d = 1; d < limit; d++) {
+            for (int i = 0; i < (int)buckets[d].size(); i++) {
+                VertexNode<string>* node = buckets[d][i];
+                if (tentative[node->id_] != d) continue;
+                this->expand(node, nullptr, true, adjacent);
+                for (VertexNode<string>* outNode : adjacent) {
+                    if (!affected.count(outNode->id_)) continue;
+                    unordered_map<int, int>::iterator it = tentative.find(outNode->id_);
+                    if (it == tentative.end() || it->second > d + 1) {
+                        tentative[outNode->id_] = d + 1;
+                        buckets[d + 1].push_back(outNode);
+                    }
+                }
+            }
+        }
+        for (VertexNode<string>* node : affectedNodes) {
+            unordered_map<int, int>::iterator it = tentative.find(node->id_);
+            setWatchDistance(watchId, watch, node->id_, (it == tentative.end()) ? -1 : it->second);
+        }
+    }
+}
+
+int KnowledgeGraph::watch(string entity, int depth) {
+    VertexNode<string>* startingNode = graph.getVertexNode(entity);
+    if (startingNode == nullptr) throw EntityNotFoundException();
+
+    int watchId = nextWatch++;
+    KHopWatch& watch = watches[watchId];
+    watch.start = startingNode->id_;
+    watch.depth = max(depth, 0);
+    setWatchDistance(watchId, watch, startingNode->id_, 0);
+
+    vector<VertexNode<string>*> queue(1, startingNode), adjacent;
+    for (int head = 0; head < (int)queue.size(); head++) {
+        VertexNode<string>* node = queue[head];
+        int nodeDistance = watch.distance[node->id_];
+        if (nodeDistance >= watch.depth) continue;
+        this->expand(node, nullptr, true, adjacent);
+        for (VertexNode<string>* outNode : adjacent) {
+            if (watch.distance.count(outNode->id_)) continue;
+            setWatchDistance(watchId, watch, outNode->id_, nodeDistance + 1);
+            queue.push_back(outNode);
+        }
+    }
+    // the initial set is the baseline, not a change
+    watch.pending.clear();
+    return watchId;
+}
+
+void KnowledgeGraph::unwatch(int watchId) {
+    KHopWatch& watch = findWatch(watchId);
+    for (auto& entry : watch.distance) {
+        vector<int>& holders = watchers[entry.first];
+        holders.erase(find(holders.begin(), holders.end(), watchId));
+    }
+    watches.erase(watchId);
+}
+
+vector<string> KnowledgeGraph::watchedEntities(int watchId) {
+    KHopWatch& watch = findWatch(watchId);
+    vector<pair<int, int>> members; // (distance, vertex id)
+    for (auto& entry : watch.distance) {
+        if (entry.first != watch.start) members.push_back(make_pair(entry.second, entry.first));
+    }
+    sort(members.begin(), members.end());
+
+    vector<string> related;
+    for (pair<int, int>& member : members) related.push_back(entities[member.second]);
+    return related;
+}
+
+int KnowledgeGraph::watchDistance(int watchId, string entity) {
+    KHopWatch& watch = findWatch(watchId);
+    VertexNode<string>* node = graph.getVertexNode(entity);
+    if (node == nullptr) throw EntityNotFoundException();
+    unordered_map<int, int>::iterator it = watch.distance.find(node->id_);
+    return (it == watch.distance.end()) ? -1 : it->second;
+}
+
+vector<WatchDelta> KnowledgeGraph::pollWatch(int watchId) {
+    KHopWatch& watch = findWatch(watchId);
+    vector<WatchDelta> deltas;
+    deltas.swap(watch.pending);
+    return deltas;
+}
+
+BoundedResult<string> KnowledgeGraph::bfsBounded(string start, QueryOptions options) {
+    VertexNode<string>* startingNode = graph.getVertexNode(start);
+    if (startingNode == nullptr) throw EntityNotFoundException();
+
+    QueryBudget budget(options);
+    TraversalScratch& scratch = threadScratch();
+    scratch.visited.reset(graph.size());
+    scratch.nodes.clear();
+    scratch.nodes.push_back(startingNode);
+    scratch.visited.set(startingNode->id_);
+
+    stringstream ss;
+    ss << "[";
+    for (int head = 0; head < (int)scratch.nodes.size(); head++) {
+        VertexNode<string>* node = scratch.nodes[head];
+        if (!budget.visitVertex() || !budget.addResult()) break;
+        if (head > 0) ss << ", ";
+        ss << graph.vertex2Str(*node);
+
+        this->expand(node, nullptr, true, scratch.adjacent);
+        if (!budget.scanEdges(scratch.adjacent.size())) break;
+        for (VertexNode<string>* outNode : scratch.adjacent) {
+            if (!scratch.visited.contains(outNode->id_)) {
+                scratch.visited.set(outNode->id_);
+                scratch.nodes.push_back(outNode);
+            }
+        }
+    }
+    ss << "]";
+    return BoundedResult<string>{ss.str(), budget.exhausted(), budget.reason()};
+}
+
+BoundedResult<string> KnowledgeGraph::dfsBounded(string start, QueryOptions options) {
+    VertexNode<string>* startingNode = graph.getVertexNode(start);
+    if (startingNode == nullptr) throw EntityNotFoundException();
+
+    QueryBudget budget(options);
+    TraversalScratch& scratch = threadScratch();
+    VisitMap& visited = scratch.visited;
+    vector<VertexNode<string>*>& stack = scratch.stack;
+    visited.reset(graph.size());
+    stack.clear();
+    stack.push_back(startingNode);
+
+    stringstream ss;
+    ss << "[";
+    bool first = true;
+    while (!stack.empty()) {
+        VertexNode<string>* node = stack.back();
+        stack.pop_back();
+        if (visited.contains(node->id_)) continue;
+        if (!budget.visitVertex() || !budget.addResult()) break;
+        visited.set(node->id_);
+
+        if (!first) ss << ", ";
+        ss << graph.vertex2Str(*node);
+        first = false;
+
+        // pushed in reverse so the first out-edge is explored first, as in DGraphModel::DFS
+        this->expand(node, nullptr, true, scratch.adjacent);
+        if (!budget.scanEdges(scratch.adjacent.size())) break;
+        for (int i = scratch.adjacent.size() - 1; i >= 0; i--) {
+            if (!visited.contains(scratch.adjacent[i]->id_)) stack.push_back(scratch.adjacent[i]);
+        }
+    }
+    ss << "]";
+    return BoundedResult<string>{ss.str(), budget.exhausted(), budget.reason()};
+}
+
+BoundedResult<bool> KnowledgeGraph::isReachableBounded(string from, string to, QueryOptions options) {
+    VertexNode<string>* fromNode = graph.getVertexNode(from);
+    VertexNode<string>* toNode = graph.getVertexNode(to);
+    if (fromNode == nullptr || toNode == nullptr) throw EntityNotFoundException();
+
+    QueryBudget budget(options);
+    bool reachable;
+    // an up-to-date condensation walks the smaller DAG; building one is unbounded work
+    shared_ptr<Condensation> scc = graph.currentCondensation();
+    if (scc != nullptr) {
+        reachable = scc->reaches(scc->component(fromNode->id_), scc->component(toNode->id_), &budget);
+    } else {
+        TraversalScratch& scratch = threadScratch();
+        reachable = this->isReachable(from, to, scratch, nullptr, &budget);
+    }
+    // a positive answer is final even if the budget ran out on the way
+    if (reachable) return BoundedResult<bool>{true, false, TruncationReason::NONE};
+    return BoundedResult<bool>{false, budget.exhausted(), budget.reason()};
+}
+
+BoundedResult<vector<string>> KnowledgeGraph::getRelatedEntitiesBounded(string entity, int depth, QueryOptions options) {
+    QueryBudget budget(options);
+    TraversalScratch& scratch = threadScratch();
+    vector<string> related = this->getRelatedEntities(entity, depth, scratch, nullptr, &budget);
+    return BoundedResult<vector<string>>{related, budget.exhausted(), budget.reason()};
+}
+
+BoundedResult<string> KnowledgeGraph::findCommonAncestorsBounded(string entity1, string entity2, QueryOptions options) {
+    QueryBudget budget(options);
+    TraversalScratch& scratch = threadScratch();
+    string ancestor = this->findCommonAncestors(entity1, entity2, scratch, nullptr, &budget);
+    return BoundedResult<string>{ancestor, budget.exhausted(), budget.reason()};
+}
+
+// Shared by every limit/offset variant, so they all reject the same arguments
+static void checkWindow(int offset, int limit) {
+    if (offset < 0) throw InvalidQueryException("Offset must not be negative!");
+    if (limit < 0) throw InvalidQueryException("Limit must not be negative!");
+}
+
+vector<string> KnowledgeGraph::getAllEntities(int offset, int limit) {
+    checkWindow(offset, limit);
+    vector<string> page;
+    for (int i = offset; i < (int)entities.size() && (int)page.size() < limit; i++) page.push_back(entities[i]);
+    return page;
+}
+
+vector<string> KnowledgeGraph::getNeighbors(string entity, int offset, int limit) {
+    checkWindow(offset, limit);
+    VertexNode<string>* node = graph.getVertexNode(entity);
+    if (node == nullptr) throw EntityNotFoundException();
+
+    vector<string> page;
+    int skipped = 0;
+    for (Edge<string>* edging : node->adList) {
+        if ((int)page.size() >= limit) break;
+        if (edging->from != node) continue;
+        if (skipped++ < offset) continue;
+        page.push_back(edging->to->vertex);
+    }
+    return page;
+}
+
+vector<string> KnowledgeGraph::getRelatedEntities(string entity, int depth, int offset, int limit) {
+    checkWindow(offset, limit);
+    PageSession session;
+    startPageSession(session, 'r', entity, depth, false);
+    vector<string> page;
+    advancePageSession(session, offset, nullptr);
+    advancePageSession(session, limit, &page);
+    return page;
+}
+
+vector<string> KnowledgeGraph::bfs(string start, int offset, int limit) {
+    checkWindow(offset, limit);
+    PageSession session;
+    startPageSession(session, 'b', start, INT_MAX, true);
+    vector<string> page;
+    advancePageSession(session, offset, nullptr);
+    advancePageSession(session, limit, &page);
+    return page;
+}
+
+string KnowledgeGraph::encodeCursor(char kind, long long position, long long session, int depth, const string& entity) {
+    // the entity goes last so it may contain the separator
+    stringstream ss;
+    ss << kind << '.' << graph.version() << '.' << position << '.' << session << '.' << depth << '.' << entity;
+    return ss.str();
+}
+
+void KnowledgeGraph::startPageSession(PageSession& session, char kind, string entity, int depthLimit, bool includeStart) {
+    VertexNode<string>* startingNode = graph.getVertexNode(entity);
+    if (startingNode == nullptr) throw EntityNotFoundException();
+
+    session.kind = kind;
+    session.entity = entity;
+    session.depthLimit = depthLimit;
+    session.includeStart = includeStart;
+    session.queue.assign(1, startingNode);
+    session.depths.assign(1, 0);
+    // keyed on what the session has explored, not sized by the whole graph
+    session.visited.clear();
+    session.visited.insert(startingNode->id_);
+    session.head = 0;
+    session.emitted = 0;
+    session.version = graph.version();
+    session.lastUsed = chrono::steady_clock::now();
+}
+
+void KnowledgeGraph::advancePageSession(PageSession& session, long long count, vector<string>* out) {
+    long long target = session.emitted + max(count, 0LL);
+    while (session.emitted < target && session.head < (int)session.queue.size()) {
+        VertexNode<string>* node = session.queue[session.head];
+        int nodeDepth = session.depths[session.head];
+        session.head++;
+
+        if (nodeDepth > 0 || session.includeStart) {
+            if (out != nullptr) out->push_back(node->vertex);
+            session.emitted++;
+        }
+        if (nodeDepth < session.depthLimit) {
+            for (Edge<string>* edging : node->adList) {
+                if (edging->from != node) continue;
+                VertexNode<string>* outNode = edging->to;
+                if (session.visited.insert(outNode->id_).second) {
+                    session.queue.push_back(outNode);
+                    session.depths.push_back(nodeDepth + 1);
+                }
+            }
+        }
+    }
+}
+
+ResultPage KnowledgeGraph::traversalPage(char kind, string entity, int depth, long long offset, long long id, int pageSize) {
+    lock_guard<mutex> guard(pageLock);
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    chrono::seconds ttl(static_cast<long long>(SESSION_TTL_SECONDS));
+
+    auto found = pageSessions.find(id);
+    // a replayed cursor finds its session already further along, so it is rebuilt like an expired one
+    if (found == pageSessions.end() || found->second.emitted != offset) {
+        for (auto it = pageSessions.begin(); it != pageSessions.end();) {
+            if (now - it->second.lastUsed > ttl) it = pageSessions.erase(it);
+            else ++it;
+        }
+        if (pageSessions.size() >= MAX_PAGE_SESSIONS) {
+            auto oldest = pageSessions.begin();
+            for (auto it = pageSessions.begin(); it != pageSessions.end(); ++it) {
+                if (it->second.lastUsed < oldest->second.lastUsed) oldest = it;
+            }
+            pageSessions.erase(oldest);
+        }
+        id = nextPageSession++;
+        PageSession& session = pageSessions[id];
+        startPageSession(session, kind, entity, depth, kind == 'b');
+        advancePageSession(session, offset, nullptr);
+        found = pageSessions.find(id);
+    }
+
+    PageSession& session = found->second;
+    session.lastUsed = now;
+    ResultPage page;
+    advancePageSession(session, pageSize, &page.entities);
+    if (session.head < (int)session.queue.size()) {
+        page.cursor = encodeCursor(kind, session.emitted, id, depth, entity);
+    }
+    else {
+        pageSessions.erase(found);
+    }
+    return page;
+}
+
+ResultPage KnowledgeGraph::neighborsPage(string entity, long long position, int pageSize) {
+    VertexNode<string>* node = graph.getVertexNode(entity);
+    if (node == nullptr) throw EntityNotFoundException();
+
+    // the cursor keeps an adList position, so a page never rescans the earlier ones
+    ResultPage page;
+    long long i = position;
+    for (; i < (long long)node->adList.size() && (int)page.entities.size() < pageSize; i++) {
+        Edge<string>* edging = node->adList[i];
+        if (edging->from == node) page.entities.push_back(edging->to->vertex);
+    }
+    for (; i < (long long)node->adList.size(); i++) {
+        if (node->adList[i]->from == node) {
+            page.cursor = encodeCursor('n', i, 0, 0, entity);
+            break;
+        }
+    }
+    return page;
+}
+
+ResultPage KnowledgeGraph::allEntitiesPage(long long offset, int pageSize) {
+    ResultPage page;
+    long long end = min<long long>(offset + pageSize, entities.size());
+    for (long long i = offset; i < end; i++) page.entities.push_back(entities[i]);
+    if (end < (long long)entities.size()) page.cursor = encodeCursor('a', end, 0, 0, "");
+    return page;
+}
+
+ResultPage KnowledgeGraph::pageAllEntities(int pageSize) {
+    if (pageSize <= 0) throw InvalidQueryException("Page size must be positive!");
+    return allEntitiesPage(0, pageSize);
+}
+
+ResultPage KnowledgeGraph::pageNeighbors(string entity, int pageSize) {
+    if (pageSize <= 0) throw InvalidQueryException("Page size must be positive!");
+    return neighborsPage(entity, 0, pageSize);
+}
+
+ResultPage KnowledgeGraph::pageRelatedEntities(string entity, int depth, int pageSize) {
+    if (pageSize <= 0) throw InvalidQueryException("Page size must be positive!");
+    return traversalPage('r', entity, depth, 0, -1, pageSize);
+}
+
+ResultPage KnowledgeGraph::pageBfs(string start, int pageSize) {
+    if (pageSize <= 0) throw InvalidQueryException("Page size must be positive!");
+    return traversalPage('b', start, INT_MAX, 0, -1, pageSize);
+}
+
+ResultPage KnowledgeGraph::nextPage(string cursor, int pageSize) {
+    if (pageSize <= 0) throw InvalidQueryException("Page size must be positive!");
+
+    // kind.version.position.session.depth.entity
+    size_t fields[5];
+    size_t at = 0;
+    for (int i = 0; i < 5; i++) {
+        at = cursor.find('.', at);
+        if (at == string::npos) throw InvalidQueryException("Invalid cursor!");
+        fields[i] = at++;
+    }
+    char kind = cursor[0];
+    unsigned long version;
+    long long position, session;
+    int depth;
+    try {
+        version = stoul(cursor.substr(fields[0] + 1, fields[1] - fields[0] - 1));
+        position = stoll(cursor.substr(fields[1] + 1, fields[2] - fields[1] - 1));
+        session = stoll(cursor.substr(fields[2] + 1, fields[3] - fields[2] - 1));
+        depth = stoi(cursor.substr(fields[3] + 1, fields[4] - fields[3] - 1));
+    }
+    catch (const exception&) {
+        throw InvalidQueryException("Invalid cursor!");
+    }
+    string entity = cursor.substr(fields[4] + 1);
+
+    if (version != graph.version()) throw InvalidQueryException("Cursor is stale!");
+    if (fields[0] != 1 || position < 0) throw InvalidQueryException("Invalid cursor!");
+    switch (kind) {
+        case 'a': return allEntitiesPage(position, pageSize);
+        case 'n': return neighborsPage(entity, position, pageSize);
+        case 'r':
+        case 'b': return traversalPage(kind, entity, depth, position, session, pageSize);
+    }
+    throw InvalidQueryException("Invalid cursor!");
+}
+
+MemoryUsage KnowledgeGraph::memoryUsage() {
+    MemoryUsage usage = graph.memoryUsage();
+    usage.duplicateValues += entities.capacity() * sizeof(string);
+    for (string& entity : entities) usage.duplicateValues += MemoryUsage::valueBytes(entity);
+
+    usage.indexes += prefixIndex.memoryBytes();
+    shared_ptr<TransitionMatrix> matrix = atomic_load(&transitions);
+    if (matrix != nullptr) usage.indexes += matrix->memoryBytes();
+    shared_ptr<AliasTable> table = atomic_load(&walkTable);
+    if (table != nullptr) usage.indexes += table->memoryBytes();
+    shared_ptr<TripleIndex> index = atomic_load(&triples);
+    if (index != nullptr) usage.indexes += index->memoryBytes();
+    if (feed) usage.indexes += feed->memoryBytes();
+    lock_guard<mutex> guard(pageLock);
+    usage.indexes += MemoryUsage::hashTableBytes(pageSessions);
+    for (auto& entry : pageSessions) {
+        PageSession& session = entry.second;
+        usage.indexes += session.queue.capacity() * sizeof(VertexNode<string>*)
+                         + session.depths.capacity() * sizeof(int) + MemoryUsage::hashTableBytes(session.visited);
+    }
+
+    usage.indexes += MemoryUsage::hashTableBytes(watches) + watchers.capacity() * sizeof(vector<int>);
+    for (vector<int>& holders : watchers) usage.indexes += holders.capacity() * sizeof(int);
+    for (auto& entry : watches) {
+        KHopWatch& watch = entry.second;
+        usage.indexes += MemoryUsage::hashTableBytes(watch.distance) + watch.pending.capacity() * sizeof(WatchDelta);
+        for (WatchDelta& delta : watch.pending) usage.indexes += MemoryUsage::valueBytes(delta.entity);
+    }
+    return usage;
+}
+
+void KnowledgeGraph::shrinkToFit() {
+    graph.shrinkToFit();
+    entities.shrink_to_fit();
+}
+
+void KnowledgeGraph::enableChangeFeed(int capacity) {
+    if (!feed) feed = make_shared<ChangeFeed>(capacity);
+}
+
+ChangeSubscription KnowledgeGraph::subscribe() {
+    enableChangeFeed();
+    return ChangeSubscription(feed, feed->latestSequence() + 1);
+}
+
+ChangeSubscription KnowledgeGraph::subscribe(unsigned long long fromSequence) {
+    enableChangeFeed();
+    return ChangeSubscription(feed, fromSequence);
+}
+
+unsigned long long KnowledgeGraph::latestSequence() {
+    return feed ? feed->latestSequence() : 0;
+}
+
+shared_ptr<TripleIndex> KnowledgeGraph::tripleIndex() {
+    shared_ptr<TripleIndex> current = atomic_load(&triples);
+    if (current != nullptr && current->version == graph.version()) return current;
+    lock_guard<mutex> guard(cacheLock);
+    current = atomic_load(&triples);
+    if (current != nullptr && current->version == graph.version()) return current;
+
+    shared_ptr<TripleIndex> fresh = make_shared<TripleIndex>();
+    TripleIndex& index = *fresh;
+
+    vector<int> subjects, predicates, objects;
+    for (VertexNode<string>* node : graph.nodeList) {
+        for (Edge<string>* edging : node->outEdges()) {
+            subjects.push_back(node->id_);
+            predicates.push_back(edging->label);
+            objects.push_back(edging->to->id_);
+        }
+    }
+    index.build(subjects, predicates, objects);
+    index.version = graph.version();
+    atomic_store(&triples, fresh);
+    return fresh;
+}
+
+TripleCursor KnowledgeGraph::query(vector<TriplePattern> patterns) {
+    if (patterns.empty()) throw InvalidQueryException("Empty query!");
+
+    TripleCursor cursor;
+    cursor.index = this->tripleIndex();
+    cursor.entityNames = &this->entities;
+    cursor.labelNames = &graph.labelNames;
+    for (TriplePattern& pattern : patterns) {
+        string fields[3] = {pattern.subject, pattern.predicate, pattern.object};
+        TripleCursor::Pattern compiled;
+        for (int position = 0; position < 3; position++) {
+            string& field = fields[position];
+            bool predicate = (position == TripleIndex::PREDICATE);
+            compiled.variable[position] = (!field.empty() && field[0] == '?');
+            if (compiled.variable[position]) {
+                compiled.value[position] = cursor.variableIndex(field, predicate);
+                continue;
+            }
+            if (predicate) {
+                compiled.value[position] = graph.labelId(field);
+            }
+            else {
+                VertexNode<string>* node = graph.getVertexNode(field);
+                compiled.value[position] = (node == nullptr) ? -1 : node->id_;
+            }
+            // a constant the graph has never seen matches nothing
+            if (compiled.value[position] == -1) cursor.exhausted = true;
+        }
+        cursor.patterns.push_back(compiled);
+    }
+    cursor.plan();
+    return cursor;
+}
+
+// =============================================================================
+// Class VisitMap Implementation
+// =============================================================================
+
+VisitMap::VisitMap() {
+    this->epoch = 1;
+}
+
+void VisitMap::reset(int vertexCount) {
+    if ((int)stamp.size() < vertexCount) {
+        stamp.resize(vertexCount, 0);
+        value.resize(vertexCount, 0);
+    }
+    epoch++;
+    if (epoch == 0) {
+        // stamps wrapped around, old ones could look current again
+        fill(stamp.begin(), stamp.end(), 0);
+        epoch = 1;
+    }
+}
+
+bool VisitMap::contains(int id) {
+    return stamp[id] == epoch;
+}
+
+void VisitMap::set(int id, int v) {
+    stamp[id] = epoch;
+    value[id] = v;
+}
+
+int VisitMap::get(int id) {
+    return (stamp[id] == epoch) ? value[id] : -1;
+}
+
+size_t VisitMap::memoryBytes() {
+    return stamp.capacity() * sizeof(unsigned) + value.capacity() * sizeof(int);
+}
+
+// =============================================================================
+// Class IndexedHeap Implementation
+// =============================================================================
+
+void IndexedHeap::place(int index, pair<double, int> entry) {
+    entries[index] = entry;
+    position[entry.second] = index;
+}
+
+void IndexedHeap::siftUp(int index) {
+    pair<double, int> entry = entries[index];
+    while (index > 0) {
+        int parent = (index - 1) / ARITY;
+        if (entries[parent].first <= entry.first) break;
+        place(index, entries[parent]);
+        index = parent;
+    }
+    place(index, entry);
+}
+
+void IndexedHeap::siftDown(int index) {
+    pair<double, int> entry = entries[index];
+    int n = entries.size();
+    while (true) {
+        int first = index * ARITY + 1;
+        if (first >= n) break;
+        int smallest = first;
+        int last = min(first + ARITY, n);
+        for (int child = first + 1; child < last; child++) {
+            if (entries[child].first < entries[smallest].first) smallest = child;
+        }
+        if (entry.first <= entries[smallest].first) break;
+        place(index, entries[smallest]);
+        index = smallest;
+    }
+    place(index, entry);
+}
+
+void IndexedHeap::clear() {
+    entries.clear();
+    position.clear();
+}
+
+bool IndexedHeap::empty() {
+    return entries.empty();
+}
+
+double IndexedHeap::topKey() {
+    return entries.front().first;
+}
+
+int IndexedHeap::pop() {
+    int item = entries.front().second;
+    position[item] = -1;
+    pair<double, int> last = entries.back();
+    entries.pop_back();
+    if (!entries.empty()) {
+        entries[0] = last;
+        siftDown(0);
+    }
+    return item;
+}
+
+void IndexedHeap::push(int item, double key) {
+    if (item >= (int)position.size()) position.resize(item + 1, -1);
+    int index = position[item];
+    if (index < 0) {
+        entries.push_back(make_pair(key, item));
+        siftUp(entries.size() - 1);
+    }
+    else if (key < entries[index].first) {
+        entries[index].first = key;
+        siftUp(index);
+    }
+}
+
+size_t IndexedHeap::memoryBytes() {
+    return entries.capacity() * sizeof(pair<double, int>) + position.capacity() * sizeof(int);
+}
+
+// =============================================================================
+// Class GeometricRouter Implementation
+// =============================================================================
+
+thread_local GeometricRouter::RouteSearch GeometricRouter::forwardSearch;
+thread_local GeometricRouter::RouteSearch GeometricRouter::backwardSearch;
+
+void GeometricRouter::RouteSearch::reset(int vertexCount) {
+    local.reset(vertexCount);
+    nodes.clear();
+    cost.clear();
+    estimate.clear();
+    parent.clear();
+    closed.clear();
+    open.clear();
+}
+
+int GeometricRouter::RouteSearch::touch(VertexNode<Point>* node) {
+    int index = local.get(node->id_);
+    if (index >= 0) return index;
+    index = nodes.size();
+    local.set(node->id_, index);
+    nodes.push_back(node);
+    cost.push_back(numeric_limits<double>::infinity());
+    estimate.push_back(numeric_limits<double>::quiet_NaN());
+    parent.push_back(-1);
+    closed.push_back(0);
+    return index;
+}
+
+GeometricRouter::GeometricRouter(DGraphModel<Point>& graph) : graph(graph) {
+    this->landmarkCount_ = 0;
+    computeScale();
+    this->version_ = graph.version();
+}
+
+void GeometricRouter::refresh() {
+    lock_guard<mutex> guard(refreshLock);
+    if (version_ == graph.version()) return;
+    computeScale();
+    computeLandmarks();
+    // only once both succeeded, so a rejected graph is checked again next time
+    version_ = graph.version();
+}
+
+void GeometricRouter::computeScale() {
+    double smallest = numeric_limits<double>::infinity();
+    for (VertexNode<Point>* node : graph.nodeList) {
+        for (Edge<Point>* edge : node->adList) {
+            if (edge->from != node) continue;
+            if (edge->weight < 0) throw InvalidQueryException("GeometricRouter needs non-negative edge weights!");
+            double length = node->vertex.distanceTo(edge->to->vertex);
+            if (length > 0) smallest = min(smallest, edge->weight / length);
+        }
+    }
+    // no edge between distinct points: nothing to scale, fall back to Dijkstra
+    if (smallest == numeric_limits<double>::infinity()) smallest = 0;
+    this->scale = smallest;
+}
+
+void GeometricRouter::computeLandmarks() {
+    int n = graph.nodeList.size();
+    int count = min(landmarkCount_, n);
+    fromLandmark.assign(count, vector<double>());
+    toLandmark.assign(count, vector<double>());
+    if (count == 0) return;
+
+    // farthest-point sampling: start from the vertex farthest from vertex 0,
+    // then repeatedly take the one farthest from every landmark chosen so far
+    vector<double> nearest(n, numeric_limits<double>::infinity());
+    const Point& origin = graph.nodeList[0]->vertex;
+    int next = 0;
+    for (int i = 1; i < n; i++) {
+        if (graph.nodeList[i]->vertex.distanceTo(origin) > graph.nodeList[next]->vertex.distanceTo(origin)) next = i;
+    }
+    for (int l = 0; l < count; l++) {
+        VertexNode<Point>* landmark = graph.nodeList[next];
+        distances(landmark, true, fromLandmark[l]);
+        distances(landmark, false, toLandmark[l]);
+
+        next = 0;
+        for (int i = 0; i < n; i++) {
+            nearest[i] = min(nearest[i], graph.nodeList[i]->vertex.distanceTo(landmark->vertex));
+            if (nearest[i] > nearest[next]) next = i;
+        }
+    }
+}
+
+void GeometricRouter::distances(VertexNode<Point>* source, bool outward, vector<double>& result) {
+    result.assign(graph.nodeList.size(), numeric_limits<double>::infinity());
+    RouteSearch& search = forwardSearch;
+    search.reset(graph.nodeList.size());
+    int start = search.touch(source);
+    search.cost[start] = 0;
+    search.open.push(start, 0);
+
+    while (!search.open.empty()) {
+        int current = search.open.pop();
+        VertexNode<Point>* node = search.nodes[current];
+        search.closed[current] = 1;
+        result[node->id_] = search.cost[current];
+        for (Edge<Point>* edge : node->adList) {
+            if ((outward ? edge->from : edge->to) != node) continue;
+            int next = search.touch(outward ? edge->to : edge->from);
+            double cost = search.cost[current] + edge->weight;
+            if (!search.closed[next] && cost < search.cost[next]) {
+                search.cost[next] = cost;
+                search.open.push(next, cost);
+            }
+        }
+    }
+}
+
+double GeometricRouter::lowerBound(VertexNode<Point>* from, VertexNode<Point>* to) {
+    double bound = scale * from->vertex.distanceTo(to->vertex);
+    const double infinity = numeric_limits<double>::infinity();
+    for (int l = 0; l < (int)fromLandmark.size(); l++) {
+        // triangle inequality through the landmark; skipped when either side
+        // is unreachable, since infinity minus infinity bounds nothing
+        double landmarkTo = fromLandmark[l][to->id_], landmarkFrom = fromLandmark[l][from->id_];
+        if (landmarkTo != infinity && landmarkFrom != infinity) bound = max(bound, landmarkTo - landmarkFrom);
+        double fromLandmarkDistance = toLandmark[l][from->id_], toLandmarkDistance = toLandmark[l][to->id_];
+        if (fromLandmarkDistance != infinity && toLandmarkDistance != infinity) {
+            bound = max(bound, fromLandmarkDistance - toLandmarkDistance);
+        }
+    }
+    return bound;
+}
+
+VertexNode<Point>* GeometricRouter::node(Point& vertex) {
+    VertexNode<Point>* found = graph.getVertexNode(vertex);
+    if (found == nullptr) throw VertexNotFoundException();
+    return found;
+}
+
+Route GeometricRouter::route(Point from, Point to) {
+    VertexNode<Point>* source = node(from);
+    VertexNode<Point>* target = node(to);
+    refresh();
+
+    Route result;
+    result.distance = -1;
+    result.expanded = 0;
+    RouteSearch& search = forwardSearch;
+    search.reset(graph.nodeList.size());
+    int start = search.touch(source);
+    search.cost[start] = 0;
+    search.estimate[start] = lowerBound(source, target);
+    search.open.push(start, search.estimate[start]);
+
+    while (!search.open.empty()) {
+        int current = search.open.pop();
+        result.expanded++;
+        VertexNode<Point>* node = search.nodes[current];
+        if (node == target) {
+            result.distance = search.cost[current];
+            for (int at = current; at >= 0; at = search.parent[at]) result.path.push_back(search.nodes[at]->vertex);
+            reverse(result.path.begin(), result.path.end());
+            break;
+        }
+        for (Edge<Point>* edge : node->adList) {
+            if (edge->from != node) continue;
+            int next = search.touch(edge->to);
+            double cost = search.cost[current] + edge->weight;
+            if (cost < search.cost[next]) {
+                search.cost[next] = cost;
+                search.parent[next] = current;
+                if (isnan(search.estimate[next])) search.estimate[next] = lowerBound(edge->to, target);
+                search.open.push(next, cost + search.estimate[next]);
+            }
+        }
+    }
+    return result;
+}
+
+Route GeometricRouter::routeBidirectional(Point from, Point to) {
+    VertexNode<Point>* source = node(from);
+    VertexNode<Point>* target = node(to);
+    refresh();
+
+    Route result;
+    result.distance = -1;
+    result.expanded = 0;
+    RouteSearch& forward = forwardSearch;
+    RouteSearch& backward = backwardSearch;
+    forward.reset(graph.nodeList.size());
+    backward.reset(graph.nodeList.size());
+
+    // Average potential p(v) = (bound(v, target) - bound(source, v)) / 2: the
+    // forward search keys on cost + p and the backward one on cost - p, which
+    // keeps both consistent, so they can stop once the two smallest keys sum
+    // to at least the best meeting distance.
+    auto potential = [&](RouteSearch& search, int index) {
+        if (isnan(search.estimate[index])) {
+            VertexNode<Point>* vertex = search.nodes[index];
+            double p = (lowerBound(vertex, target) - lowerBound(source, vertex)) / 2;
+            search.estimate[index] = (&search == &forward) ? p : -p;
+        }
+        return search.estimate[index];
+    };
+
+    int start = forward.touch(source);
+    forward.cost[start] = 0;
+    forward.open.push(start, potential(forward, start));
+    int goal = backward.touch(target);
+    backward.cost[goal] = 0;
+    backward.open.push(goal, potential(backward, goal));
+
+    // meetings are only recorded through an edge, so source == target is seeded here
+    double best = (source == target) ? 0 : numeric_limits<double>::infinity();
+    VertexNode<Point>* meeting = (source == target) ? source : nullptr;
+    while (!forward.open.empty() && !backward.open.empty()) {
+        if (forward.open.topKey() + backward.open.topKey() >= best) break;
+
+        bool outward = forward.open.topKey() <= backward.open.topKey();
+        RouteSearch& search = outward ? forward : backward;
+        RouteSearch& other = outward ? backward : forward;
+        int current = search.open.pop();
+        search.closed[current] = 1;
+        result.expanded++;
+        VertexNode<Point>* node = search.nodes[current];
+        for (Edge<Point>* edge : node->adList) {
+            if ((outward ? edge->from : edge->to) != node) continue;
+            VertexNode<Point>* neighbor = outward ? edge->to : edge->from;
+            int next = search.touch(neighbor);
+            double cost = search.cost[current] + edge->weight;
+            if (search.closed[next] || cost >= search.cost[next]) continue;
+            search.cost[next] = cost;
+            search.parent[next] = current;
+            search.open.push(next, cost + potential(search, next));
+
+            int across = other.local.get(neighbor->id_);
+            if (across >= 0 && cost + other.cost[across] < best) {
+                best = cost + other.cost[across];
+                meeting = neighbor;
+            }
+        }
+    }
+    if (meeting == nullptr) return result;
+
+    result.distance = best;
+    for (int at = forward.local.get(meeting->id_); at >= 0; at = forward.parent[at]) {
+        result.path.push_back(forward.nodes[at]->vertex);
+    }
+    reverse(result.path.begin(), result.path.end());
+    for (int at = backward.parent[backward.local.get(meeting->id_)]; at >= 0; at = backward.parent[at]) {
+        result.path.push_back(backward.nodes[at]->vertex);
+    }
+    return result;
+}
+
+void GeometricRouter::buildLandmarks(int count) {
+    refresh();
+    lock_guard<mutex> guard(refreshLock);
+    this->landmarkCount_ = max(count, 0);
+    computeLandmarks();
+}
+
+int GeometricRouter::landmarkCount() {
+    return fromLandmark.size();
+}
+
+double GeometricRouter::heuristicScale() {
+    refresh();
+    return scale;
+}
+
+// =============================================================================
+// Class QueryExecutor Implementation
+// =============================================================================
+
+ReadQuery ReadQuery::neighbors(string entity) {
+    return ReadQuery{ReadQueryType::NEIGHBORS, entity, "", 0};
+}
+
+ReadQuery ReadQuery::relatedEntities(string entity, int depth) {
+    return ReadQuery{ReadQueryType::RELATED_ENTITIES, entity, "", depth};
+}
+
+ReadQuery ReadQuery::reachable(string from, string to) {
+    return ReadQuery{ReadQueryType::IS_REACHABLE, from, to, 0};
+}
+
+ReadQuery ReadQuery::commonAncestors(string entity1, string entity2) {
+    return ReadQuery{ReadQueryType::COMMON_ANCESTORS, entity1, entity2, 0};
+}
+
+QueryExecutor::QueryExecutor(KnowledgeGraph& graph, int threads) : graph(graph) {
+    if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
+    this->stopping = false;
+    this->pendingTasks = 0;
+    this->nextWorker = 0;
+    for (int i = 0; i < threads; i++) workers.push_back(new Worker());
+    for (int i = 0; i < threads; i++) {
+        workers[i]->runner = thread(&QueryExecutor::workerLoop, this, i);
+    }
+}
+
+QueryExecutor::~QueryExecutor() {
+    {
+        lock_guard<mutex> guard(sleepLock);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (Worker* worker : workers) worker->runner.join();
+    for (Worker* worker : workers) delete worker;
+}
+
+int QueryExecutor::threadCount() {
+    return this->workers.size();
+}
+
+void QueryExecutor::enqueue(Task task) {
+    // spread submissions round-robin, idle workers steal whatever is left over
+    Worker* worker = workers[nextWorker++ % workers.size()];
+    {
+        lock_guard<mutex> guard(worker->lock);
+        worker->tasks.push_back(move(task));
+    }
+    {
+        lock_guard<mutex> guard(sleepLock);
+        pendingTasks++;
+    }
+    wakeUp.notify_one();
+}
+
+bool QueryExecutor::takeTask(int self, Task& task) {
+    // own queue from the back (LIFO, still warm), victims from the front (FIFO)
+    Worker* own = workers[self];
+    {
+        lock_guard<mutex> guard(own->lock);
+        if (!own->tasks.empty()) {
+            task = move(own->tasks.back());
+            own->tasks.pop_back();
+            return true;
+        }
+    }
+    int count = workers.size();
+    for (int i = 1; i < count; i++) {
+        Worker* victim = workers[(self + i) % count];
+        unique_lock<mutex> guard(victim->lock, try_to_lock);
+        if (!guard.owns_lock() || victim->tasks.empty()) continue;
+        task = move(victim->tasks.front());
+        victim->tasks.pop_front();
+        return true;
+    }
+    return false;
+}
+
+void QueryExecutor::workerLoop(int self) {
+    TraversalScratch& scratch = workers[self]->scratch;
+    Task task;
+    while (true) {
+        if (takeTask(self, task)) {
+            pendingTasks--;
+            task(scratch);
+            task = nullptr;
+            continue;
+        }
+        unique_lock<mutex> guard(sleepLock);
+        if (stopping) return;
+        // a failed try_lock steal can miss work, so never sleep while tasks are pending
+        if (pendingTasks > 0) continue;
+        wakeUp.wait(guard, [this] { return stopping || pendingTasks > 0; });
+    }
+}
+
+ReadQueryResult QueryExecutor::execute(const ReadQuery& query, TraversalScratch& scratch) {
+    ReadQueryResult result;
+    switch (query.type) {
+        case ReadQueryType::NEIGHBORS:
+            result.entities = graph.getNeighbors(query.entity);
+            break;
+        case ReadQueryType::RELATED_ENTITIES:
+            result.entities = graph.getRelatedEntities(query.entity, query.depth, scratch);
+            break;
+        case ReadQueryType::IS_REACHABLE:
+            result.reachable = graph.isReachable(query.entity, query.other);
+            break;
+        case ReadQueryType::COMMON_ANCESTORS:
+            result.ancestor = graph.findCommonAncestors(query.entity, query.other, scratch);
+            break;
+    }
+    return result;
+}
+
+future<ReadQueryResult> QueryExecutor::submit(ReadQuery query) {
+    graph.prepareConcurrentReads();
+    shared_ptr<promise<ReadQueryResult>> done = make_shared<promise<ReadQueryResult>>();
+    future<ReadQueryResult> result = done->get_future();
+    enqueue([this, query, done](TraversalScratch& scratch) {
+        try {
+            done->set_value(this->execute(query, scratch));
+        }
+        catch (...) {
+            done->set_exception(current_exception());
+        }
+    });
+    return result;
+}
+
+vector<ReadQueryResult> QueryExecutor::runBatch(const vector<ReadQuery>& queries) {
+    graph.prepareConcurrentReads();
+    vector<ReadQueryResult> results(queries.size());
+    mutex doneLock;
+    condition_variable allDone;
+    int remaining = queries.size();
+
+    for (int i = 0; i < (int)queries.size(); i++) {
+        enqueue([this, i, &queries, &results, &doneLock, &allDone, &remaining](TraversalScratch& scratch) {
+            try {
+                results[i] = this->execute(queries[i], scratch);
+            }
+            catch (const exception& e) {
+                results[i].error = e.what();
+            }
+            catch (...) {
+                results[i].error = "Unknown error!";
+            }
+            lock_guard<mutex> guard(doneLock);
+            if (--remaining == 0) allDone.notify_one();
+        });
+    }
+
+    unique_lock<mutex> guard(doneLock);
+    allDone.wait(guard, [&remaining] { return remaining == 0; });
+    return results;
+}
+
+// =============================================================================
+// Class ShardedKnowledgeGraph Implementation
+// =============================================================================
+
+InProcessTransport::InProcessTransport(int endpoints) {
+    for (int i = 0; i < endpoints; i++) mailboxes.push_back(new Mailbox());
+}
+
+InProcessTransport::~InProcessTransport() {
+    for (Mailbox* mailbox : mailboxes) delete mailbox;
+}
+
+int InProcessTransport::endpointCount() {
+    return mailboxes.size();
+}
+
+void InProcessTransport::send(int endpoint, const vector<uint8_t>& message) {
+    Mailbox* mailbox = mailboxes[endpoint];
+    {
+        lock_guard<mutex> guard(mailbox->lock);
+        mailbox->messages.push_back(message);
+    }
+    mailbox->ready.notify_one();
+}
+
+vector<uint8_t> InProcessTransport::receive(int endpoint) {
+    Mailbox* mailbox = mailboxes[endpoint];
+    unique_lock<mutex> guard(mailbox->lock);
+    mailbox->ready.wait(guard, [mailbox] { return !mailbox->messages.empty(); });
+    vector<uint8_t> message = move(mailbox->messages.front());
+    mailbox->messages.pop_front();
+    return message;
+}
+
+ShardMessage::ShardMessage(Type type) {
+    this->data.push_back((uint8_t)type);
+    this->position = 1;
+}
+
+ShardMessage::ShardMessage(const vector<uint8_t>& bytes) : data(bytes) {
+    if (data.empty()) throw StorageException("Empty shard message!");
+    this->position = 1;
+}
+
+ShardMessage::Type ShardMessage::type() {
+    return (Type)data[0];
+}
+
+const vector<uint8_t>& ShardMessage::bytes() {
+    return data;
+}
+
+void ShardMessage::putInt(uint64_t value) {
+    CompressedGraph::putVarint(data, value);
+}
+
+void ShardMessage::putString(const string& value) {
+    putInt(value.size());
+    data.insert(data.end(), value.begin(), value.end());
+}
+
+uint64_t ShardMessage::getInt() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (position >= data.size()) throw StorageException("Truncated shard message!");
+        uint8_t byte = data[position++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    throw StorageException("Malformed shard message!");
+}
+
+string ShardMessage::getString() {
+    uint64_t length = getInt();
+    if (length > data.size() - position) throw StorageException("Truncated shard message!");
+    string value(data.begin() + position, data.begin() + position + length);
+    position += length;
+    return value;
+}
+
+ShardedKnowledgeGraph::ShardedKnowledgeGraph(int shards)
+    : ShardedKnowledgeGraph(shards, new InProcessTransport(max(shards, 1) + 1)) {
+    this->ownsTransport = true;
+}
+
+ShardedKnowledgeGraph::ShardedKnowledgeGraph(int shards, ShardTransport* transport) {
+    this->shardCount = max(shards, 1);
+    if (transport->endpointCount() < shardCount + 1) {
+        throw StorageException("Shard transport needs " + to_string(shardCount + 1) + " endpoints");
+    }
+    this->transport = transport;
+    this->ownsTransport = false;
+    this->nextQuery = 0;
+    for (int s = 0; s < shardCount; s++) this->shards.push_back(new GraphShard());
+    for (int s = 0; s < shardCount; s++) workers.emplace_back(&ShardedKnowledgeGraph::workerLoop, this, s);
+}
+
+ShardedKnowledgeGraph::~ShardedKnowledgeGraph() {
+    for (int s = 0; s < shardCount; s++) transport->send(s, ShardMessage(ShardMessage::SHUTDOWN).bytes());
+    for (thread& worker : workers) worker.join();
+    for (GraphShard* shard : shards) delete shard;
+    if (ownsTransport) delete transport;
+}
+
+int ShardedKnowledgeGraph::getShardCount() {
+    return shardCount;
+}
+
+int ShardedKnowledgeGraph::shardOf(string entity) {
+    // 64-bit FNV-1a: unlike std::hash it is the same in every process and build
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : entity) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash % shardCount;
+}
+
+void ShardedKnowledgeGraph::addEntity(string entity) {
+    GraphShard& shard = *shards[shardOf(entity)];
+    lock_guard<mutex> guard(shard.lock);
+    // the owning shard never holds a stub of its own entity, so any hit is a duplicate
+    if (shard.graph.contains(entity)) throw EntityExistsException();
+    shard.graph.add(entity);
+    shard.owner.push_back(shardOf(entity));
+    shard.remoteId.push_back(shard.graph.size() - 1);
+}
+
+void ShardedKnowledgeGraph::addRelation(string from, string to, float weight) {
+    int fromShard = shardOf(from);
+    int toShard = shardOf(to);
+    GraphShard& home = *shards[fromShard];
+
+    if (fromShard == toShard) {
+        lock_guard<mutex> guard(home.lock);
+        if (!home.graph.contains(from) || !home.graph.contains(to)) throw EntityNotFoundException();
+        home.graph.connect(from, to, weight);
+        return;
+    }
+
+    GraphShard& away = *shards[toShard];
+    scoped_lock guard(home.lock, away.lock);
+    if (!home.graph.contains(from) || !away.graph.contains(to)) throw EntityNotFoundException();
+    if (!home.graph.contains(to)) {
+        home.graph.add(to);
+        home.owner.push_back(toShard);
+        home.remoteId.push_back(away.graph.vertexId(to));
+    }
+    home.graph.connect(from, to, weight);
+}
+
+bool ShardedKnowledgeGraph::contains(string entity) {
+    GraphShard& shard = *shards[shardOf(entity)];
+    lock_guard<mutex> guard(shard.lock);
+    return shard.graph.contains(entity);
+}
+
+vector<string> ShardedKnowledgeGraph::getNeighbors(string entity) {
+    GraphShard& shard = *shards[shardOf(entity)];
+    lock_guard<mutex> guard(shard.lock);
+    VertexNode<string>* node = shard.graph.getVertexNode(entity);
+    if (node == nullptr) throw EntityNotFoundException();
+    return node->getOutVertices();
+}
+
+void ShardedKnowledgeGraph::workerLoop(int self) {
+    vector<vector<uint8_t>> stash;
+    while (true) {
+        vector<uint8_t> bytes = transport->receive(self);
+        ShardMessage message(bytes);
+        if (message.type() == ShardMessage::SHUTDOWN) return;
+        if (message.type() == ShardMessage::QUERY) runQuery(self, message, stash);
+        // peers that got the query first may already be exchanging frontiers
+        else stash.push_back(bytes);
+    }
+}
+
+ShardMessage ShardedKnowledgeGraph::awaitMessage(int self, ShardMessage::Type type, uint64_t query, uint64_t step,
+                                                 vector<vector<uint8_t>>& stash) {
+    for (int i = 0; i < (int)stash.size(); i++) {
+        ShardMessage message(stash[i]);
+        if (message.type() == type && message.getInt() == query && message.getInt() == step) {
+            stash.erase(stash.begin() + i);
+            return message;
+        }
+    }
+    while (true) {
+        vector<uint8_t> bytes = transport->receive(self);
+        ShardMessage message(bytes);
+        if (message.type() == type && message.getInt() == query && message.getInt() == step) return message;
+        // a faster peer may already be a superstep ahead
+        stash.push_back(bytes);
+    }
+}
+
+void ShardedKnowledgeGraph::runQuery(int self, ShardMessage& query, vector<vector<uint8_t>>& stash) {
+    uint64_t id = query.getInt();
+    QueryKind kind = (QueryKind)query.getInt();
+    uint64_t depthLimit = query.getInt();
+    string start = query.getString();
+    // only REACH queries carry a target; "" is an ordinary entity name
+    bool hasTarget = kind == REACH;
+    string target = hasTarget ? query.getString() : "";
+
+    GraphShard& shard = *shards[self];
+    lock_guard<mutex> guard(shard.lock);
+    VisitMap visited;
+    visited.reset(shard.graph.size());
+    vector<int> frontier, next;
+    vector<vector<int>> outgoing(shardCount);
+    vector<pair<int, string>> reached;
+    bool hit = false;
+
+    // only the owner seeds the start and recognises the target
+    VertexNode<string>* startNode = shard.graph.getVertexNode(start);
+    if (startNode != nullptr && shard.owner[startNode->id_] == self) {
+        visited.set(startNode->id_);
+        frontier.push_back(startNode->id_);
+        if (kind == TRAVERSE) reached.push_back(make_pair(0, start));
+    }
+    VertexNode<string>* targetNode = hasTarget ? shard.graph.getVertexNode(target) : nullptr;
+    int targetId = (targetNode != nullptr && shard.owner[targetNode->id_] == self) ? targetNode->id_ : -1;
+
+    for (uint64_t step = 0;; step++) {
+        next.clear();
+        for (vector<int>& out : outgoing) out.clear();
+
+        if (step < depthLimit) {
+            for (int v : frontier) {
+                VertexNode<string>* node = shard.graph.nodeList[v];
+                for (Edge<string>* edging : node->adList) {
+                    if (edging->from != node) continue;
+                    int w = edging->to->id_;
+                    // stubs are marked too, so each is handed over at most once per query
+                    if (visited.contains(w)) continue;
+                    visited.set(w);
+                    if (shard.owner[w] != self) {
+                        outgoing[shard.owner[w]].push_back(shard.remoteId[w]);
+                        continue;
+                    }
+                    next.push_back(w);
+                    if (kind == TRAVERSE) reached.push_back(make_pair(step + 1, edging->to->vertex));
+                    if (w == targetId) hit = true;
+                }
+            }
+        }
+
+        for (int peer = 0; peer < shardCount; peer++) {
+            if (peer == self) continue;
+            ShardMessage frontierMessage(ShardMessage::FRONTIER);
+            frontierMessage.putInt(id);
+            frontierMessage.putInt(step);
+            frontierMessage.putInt(outgoing[peer].size());
+            for (int w : outgoing[peer]) frontierMessage.putInt(w);
+            transport->send(peer, frontierMessage.bytes());
+        }
+        for (int i = 0; i < shardCount - 1; i++) {
+            ShardMessage frontierMessage = awaitMessage(self, ShardMessage::FRONTIER, id, step, stash);
+            uint64_t count = frontierMessage.getInt();
+            for (uint64_t j = 0; j < count; j++) {
+                int w = frontierMessage.getInt();
+                if (visited.contains(w)) continue;
+                visited.set(w);
+                next.push_back(w);
+                if (kind == TRAVERSE) reached.push_back(make_pair(step + 1, shard.graph.nodeList[w]->vertex));
+                if (w == targetId) hit = true;
+            }
+        }
+
+        // every worker sees the same votes, so all of them stop after the same superstep
+        for (int peer = 0; peer < shardCount; peer++) {
+            if (peer == self) continue;
+            ShardMessage vote(ShardMessage::VOTE);
+            vote.putInt(id);
+            vote.putInt(step);
+            vote.putInt(next.size());
+            vote.putInt(hit ? 1 : 0);
+            transport->send(peer, vote.bytes());
+        }
+        uint64_t active = next.size();
+        bool anyHit = hit;
+        for (int i = 0; i < shardCount - 1; i++) {
+            ShardMessage vote = awaitMessage(self, ShardMessage::VOTE, id, step, stash);
+            active += vote.getInt();
+            if (vote.getInt() != 0) anyHit = true;
+        }
+        if (active == 0 || anyHit) break;
+        frontier.swap(next);
+    }
+
+    ShardMessage result(ShardMessage::RESULT);
+    result.putInt(id);
+    result.putInt(self);
+    result.putInt(hit ? 1 : 0);
+    result.putInt(reached.size());
+    for (pair<int, string>& entry : reached) {
+        result.putInt(entry.first);
+        result.putString(entry.second);
+    }
+    transport->send(shardCount, result.bytes());
+}
+
+vector<pair<int, string>> ShardedKnowledgeGraph::traverse(QueryKind kind, string start, string target, int depthLimit,
+                                                         bool& found) {
+    lock_guard<mutex> guard(queryLock);
+    uint64_t id = nextQuery++;
+    for (int s = 0; s < shardCount; s++) {
+        ShardMessage query(ShardMessage::QUERY);
+        query.putInt(id);
+        query.putInt(kind);
+        query.putInt(depthLimit);
+        query.putString(start);
+        if (kind == REACH) query.putString(target);
+        transport->send(s, query.bytes());
+    }
+
+    // (depth, shard, discovery index) orders the merged levels deterministically
+    vector<pair<pair<int, pair<int, int>>, string>> entries;
+    found = false;
+    for (int i = 0; i < shardCount; i++) {
+        ShardMessage result(transport->receive(shardCount));
+        result.getInt();
+        int shard = result.getInt();
+        if (result.getInt() != 0) found = true;
+        uint64_t count = result.getInt();
+        for (uint64_t j = 0; j < count; j++) {
+            int depth = result.getInt();
+            string name = result.getString();
+            entries.push_back(make_pair(make_pair(depth, make_pair(shard, (int)j)), name));
+        }
+    }
+    sort(entries.begin(), entries.end());
+
+    vector<pair<int, string>> reached;
+    for (auto& entry : entries) reached.push_back(make_pair(entry.first.first, entry.second));
+    return reached;
+}
+
+vector<string> ShardedKnowledgeGraph::bfs(string start) {
+    if (!contains(start)) throw EntityNotFoundException();
+    bool found;
+    vector<string> order;
+    for (pair<int, string>& entry : traverse(TRAVERSE, start, "", INT_MAX, found)) order.push_back(entry.second);
+    return order;
+}
+
+bool ShardedKnowledgeGraph::isReachable(string from, string to) {
+    if (!contains(from) || !contains(to)) throw EntityNotFoundException();
+    if (from == to) return true;
+    bool found;
+    traverse(REACH, from, to, INT_MAX, found);
+    return found;
+}
+
+vector<string> ShardedKnowledgeGraph::getRelatedEntities(string entity, int depth) {
+    if (!contains(entity)) throw EntityNotFoundException();
+    bool found;
+    vector<string> related;
+    for (pair<int, string>& entry : traverse(TRAVERSE, entity, "", max(depth, 0), found)) {
+        if (entry.first > 0) related.push_back(entry.second);
+    }
+    return related;
+}
+
+// =============================================================================
+// Class CompressedGraph Implementation
+// =============================================================================
+
+uint8_t* CompressedGraph::writeVarint(uint8_t* out, uint64_t value) {
+    // LEB128: 7 payload bits per byte, high bit set on every byte but the last
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+void CompressedGraph::putVarint(vector<uint8_t>& out, uint64_t value) {
+    uint8_t buffer[10];
+    uint8_t* end = writeVarint(buffer, value);
+    out.insert(out.end(), buffer, end);
+}
+
+uint64_t CompressedGraph::getVarint(const uint8_t*& in) {
+    uint64_t value = 0;
+    int shift = 0;
+    while (*in & 0x80) {
+        value |= (uint64_t)(*in++ & 0x7f) << shift;
+        shift += 7;
+    }
+    value |= (uint64_t)(*in++) << shift;
+    return value;
+}
+
+bool CompressedGraph::getVarint(const uint8_t*& in, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    // a 64-bit value takes at most ten bytes
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        uint8_t byte = *in++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+int CompressedGraph::varintSize(uint64_t value) {
+    int bytes = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        bytes++;
+    }
+    return bytes;
+}
+
+CompressedGraph::CompressedGraph() {
+    this->outOffsets.push_back(0);
+    this->edges = 0;
+}
+
+int CompressedGraph::idOf(string entity) {
+    auto found = ids.find(entity);
+    if (found == ids.end()) throw EntityNotFoundException();
+    return found->second;
+}
+
+void CompressedGraph::decodeNeighbors(const vector<uint64_t>& offsets, const vector<uint8_t>& data,
+                                      int id, vector<int>& out) {
+    const uint8_t* in = data.data() + offsets[id];
+    int degree = getVarint(in);
+    int previous = 0;
+    out.clear();
+    for (int i = 0; i < degree; i++) {
+        previous += getVarint(in);
+        out.push_back(previous);
+    }
+}
+
+void CompressedGraph::buildInIndex() {
+    int n = this->size();
+    vector<int> neighbours;
+    vector<int> inDegree(n, 0);
+    vector<int> lastSource(n, 0);
+
+    // pass 1: exact byte length of every in-record, sources arrive in increasing order
+    vector<uint64_t> recordBytes(n, 0);
+    for (int u = 0; u < n; u++) {
+        decodeNeighbors(outOffsets, outData, u, neighbours);
+        for (int t : neighbours) {
+            recordBytes[t] += varintSize(u - lastSource[t]);
+            lastSource[t] = u;
+            inDegree[t]++;
+        }
+    }
+    inOffsets.assign(n + 1, 0);
+    for (int t = 0; t < n; t++) {
+        inOffsets[t + 1] = inOffsets[t] + varintSize(inDegree[t]) + recordBytes[t];
+    }
+
+    // pass 2: write the records in place
+    inData.assign(inOffsets[n], 0);
+    vector<uint64_t> cursor(n);
+    for (int t = 0; t < n; t++) {
+        cursor[t] = writeVarint(inData.data() + inOffsets[t], inDegree[t]) - inData.data();
+        lastSource[t] = 0;
+    }
+    for (int u = 0; u < n; u++) {
+        decodeNeighbors(outOffsets, outData, u, neighbours);
+        for (int t : neighbours) {
+            cursor[t] = writeVarint(inData.data() + cursor[t], u - lastSource[t]) - inData.data();
+            lastSource[t] = u;
+        }
+    }
+}
+
+int CompressedGraph::size() {
+    return this->names.size();
+}
+
+long long CompressedGraph::edgeCount() {
+    return this->edges;
+}
+
+vector<string> CompressedGraph::getAllEntities() {
+    return this->names;
+}
+
+int CompressedGraph::outDegree(string entity) {
+    const uint8_t* in = outData.data() + outOffsets[idOf(entity)];
+    return getVarint(in);
+}
+
+float CompressedGraph::weight(string from, string to) {
+    int source = idOf(from);
+    int target = idOf(to);
+    const uint8_t* in = outData.data() + outOffsets[source];
+    int degree = getVarint(in);
+    int previous = 0, position = -1;
+    for (int i = 0; i < degree; i++) {
+        previous += getVarint(in);
+        if (position == -1 && previous == target) position = i;
+    }
+    if (position == -1) throw EdgeNotFoundException();
+    if (weightTable.size() <= 1) return weightTable[0];
+
+    // weight codes follow the ids, skip to the one for 'position'
+    for (int i = 0; i < position; i++) getVarint(in);
+    return weightTable[getVarint(in)];
+}
+
+vector<string> CompressedGraph::getNeighbors(string entity) {
+    vector<int> neighbours;
+    decodeNeighbors(outOffsets, outData, idOf(entity), neighbours);
+    vector<string> result;
+    result.reserve(neighbours.size());
+    for (int id : neighbours) result.push_back(names[id]);
+    return result;
+}
+
+vector<string> CompressedGraph::getInNeighbors(string entity) {
+    int id = idOf(entity);
+    if (inOffsets.empty()) buildInIndex();
+    vector<int> sources;
+    decodeNeighbors(inOffsets, inData, id, sources);
+    vector<string> result;
+    result.reserve(sources.size());
+    for (int source : sources) result.push_back(names[source]);
+    return result;
+}
+
+vector<string> CompressedGraph::bfs(string start) {
+    vector<char> visited(this->size(), 0);
+    vector<int> queue(1, idOf(start));
+    vector<int> neighbours;
+    visited[queue[0]] = 1;
+    for (int head = 0; head < (int)queue.size(); head++) {
+        decodeNeighbors(outOffsets, outData, queue[head], neighbours);
+        for (int next : neighbours) {
+            if (!visited[next]) {
+                visited[next] = 1;
+                queue.push_back(next);
+            }
+        }
+    }
+    vector<string> result;
+    result.reserve(queue.size());
+    for (int id : queue) result.push_back(names[id]);
+    return result;
+}
+
+bool CompressedGraph::isReachable(string from, string to) {
+    int source = idOf(from);
+    int target = idOf(to);
+    if (source == target) return true;
+    vector<char> visited(this->size(), 0);
+    vector<int> stack(1, source);
+    vector<int> neighbours;
+    visited[source] = 1;
+    while (!stack.empty()) {
+        int id = stack.back();
+        stack.pop_back();
+        decodeNeighbors(outOffsets, outData, id, neighbours);
+        for (int next : neighbours) {
+            if (next == target) return true;
+            if (!visited[next]) {
+                visited[next] = 1;
+                stack.push_back(next);
+            }
+        }
+    }
+    return false;
+}
+
+vector<string> CompressedGraph::getRelatedEntities(string entity, int depth) {
+    vector<char> visited(this->size(), 0);
+    vector<int> queue(1, idOf(entity));
+    vector<int> queueDepth(1, 0);
+    vector<int> neighbours;
+    vector<string> related;
+    visited[queue[0]] = 1;
+    for (int head = 0; head < (int)queue.size(); head++) {
+        if (queueDepth[head] > 0) related.push_back(names[queue[head]]);
+        if (queueDepth[head] >= depth) continue;
+        decodeNeighbors(outOffsets, outData, queue[head], neighbours);
+        for (int next : neighbours) {
+            if (!visited[next]) {
+                visited[next] = 1;
+                queue.push_back(next);
+                queueDepth.push_back(queueDepth[head] + 1);
+            }
+        }
+    }
+    return related;
+}
+
+CompressedFootprint CompressedGraph::footprint() {
+    CompressedFootprint report;
+    report.adjacencyBytes = outData.capacity();
+    report.offsetBytes = outOffsets.capacity() * sizeof(uint64_t);
+    report.weightBytes = weightTable.capacity() * sizeof(float);
+    report.inIndexBytes = inData.capacity() + inOffsets.capacity() * sizeof(uint64_t);
+    report.nameBytes = names.capacity() * sizeof(string) + ids.bucket_count() * sizeof(void*);
+    for (string& name : names) {
+        // the name is stored twice, once here and once as the hash table key
+        size_t heap = MemoryUsage::valueBytes(name);
+        report.nameBytes += 2 * heap + sizeof(string) + sizeof(int) + 2 * sizeof(void*);
+    }
+    size_t graphBytes = report.adjacencyBytes + report.offsetBytes + report.weightBytes + report.inIndexBytes;
+    report.totalBytes = graphBytes + report.nameBytes;
+    report.bytesPerEdge = (edges == 0) ? 0 : (double)graphBytes / edges;
+    return report;
+}
+
+// =============================================================================
+// Class CompressedGraphBuilder Implementation
+// =============================================================================
+
+void CompressedGraphBuilder::addEntity(string entity) {
+    if (ids.count(entity)) throw EntityExistsException();
+    ids.emplace(entity, names.size());
+    names.push_back(entity);
+}
+
+void CompressedGraphBuilder::addRelation(string from, string to, float weight) {
+    auto fromId = ids.find(from);
+    auto toId = ids.find(to);
+    if (fromId == ids.end() || toId == ids.end()) throw EntityNotFoundException();
+    pending.push_back(PendingEdge{fromId->second, toId->second, weight});
+}
+
+CompressedGraph CompressedGraphBuilder::build(CompressionOptions options) {
+    CompressedGraph graph;
+    int n = names.size();
+
+    if (options.weightLevels > 0 && !pending.empty()) {
+        float low = pending[0].weight, high = pending[0].weight;
+        for (PendingEdge& edge : pending) {
+            low = min(low, edge.weight);
+            high = max(high, edge.weight);
+        }
+        float step = (options.weightLevels > 1) ? (high - low) / (options.weightLevels - 1) : 0;
+        for (PendingEdge& edge : pending) {
+            edge.weight = (step > 0) ? low + round((edge.weight - low) / step) * step : low;
+        }
+    }
+
+    // dictionary-code the weights, most frequent first
+    unordered_map<float, long long> frequency;
+    for (PendingEdge& edge : pending) frequency[edge.weight]++;
+    vector<pair<float, long long>> byFrequency(frequency.begin(), frequency.end());
+    sort(byFrequency.begin(), byFrequency.end(), [](const pair<float, long long>& a, const pair<float, long long>& b) {
+        return (a.second != b.second) ? a.second > b.second : a.first < b.first;
+    });
+    unordered_map<float, int> code;
+    for (auto& entry : byFrequency) {
+        code[entry.first] = graph.weightTable.size();
+        graph.weightTable.push_back(entry.first);
+    }
+    if (graph.weightTable.empty()) graph.weightTable.push_back(0);
+    bool uniformWeight = graph.weightTable.size() == 1;
+
+    sort(pending.begin(), pending.end(), [](const PendingEdge& a, const PendingEdge& b) {
+        if (a.from != b.from) return a.from < b.from;
+        if (a.to != b.to) return a.to < b.to;
+        return a.weight < b.weight;
+    });
+
+    graph.outOffsets.clear();
+    graph.outOffsets.reserve(n + 1);
+    size_t first = 0;
+    for (int v = 0; v < n; v++) {
+        graph.outOffsets.push_back(graph.outData.size());
+        size_t last = first;
+        while (last < pending.size() && pending[last].from == v) last++;
+
+        CompressedGraph::putVarint(graph.outData, last - first);
+        int previous = 0;
+        for (size_t e = first; e < last; e++) {
+            CompressedGraph::putVarint(graph.outData, pending[e].to - previous);
+            previous = pending[e].to;
+        }
+        if (!uniformWeight) {
+            for (size_t e = first; e < last; e++) CompressedGraph::putVarint(graph.outData, code[pending[e].weight]);
+        }
+        first = last;
+    }
+    graph.outOffsets.push_back(graph.outData.size());
+    graph.outData.shrink_to_fit();
+    graph.edges = pending.size();
+
+    graph.names = move(names);
+    graph.ids = move(ids);
+    names.clear();
+    ids.clear();
+    vector<PendingEdge>().swap(pending);
+    return graph;
+}
+
+// =============================================================================
+// Class PagedGraphWriter Implementation
+// =============================================================================
+
+static const uint32_t PAGED_GRAPH_MAGIC = 0x4B475047; // "KGPG"
+static const uint32_t PAGED_GRAPH_FORMAT = 1;
+
+PagedGraphWriter::PagedGraphWriter(string path, int pageSize) : out(path, ios::binary | ios::trunc) {
+    if (!out) throw StorageException("Cannot open " + path + " for writing");
+    if (pageSize < 64) throw StorageException("Page size must be at least 64 bytes");
+    this->pageSize = pageSize;
+    this->edges = 0;
+    this->maxTarget = -1;
+    // page 0 is reserved for the header, written by finish()
+    vector<char> zeros(pageSize, 0);
+    out.write(zeros.data(), pageSize);
+    this->position = pageSize;
+}
+
+void PagedGraphWriter::addVertex(string name, vector<int> targets) {
+    sort(targets.begin(), targets.end());
+    record.clear();
+    CompressedGraph::putVarint(record, targets.size());
+    int previous = 0;
+    for (int target : targets) {
+        if (target < 0) throw StorageException("Negative vertex id");
+        CompressedGraph::putVarint(record, target - previous);
+        previous = target;
+    }
+
+    // small records never straddle a page, large ones start on a fresh page
+    uint64_t used = position % pageSize;
+    bool fits = (int)record.size() <= pageSize;
+    if (used != 0 && (!fits || used + record.size() > (uint64_t)pageSize)) {
+        vector<char> zeros(pageSize - used, 0);
+        out.write(zeros.data(), zeros.size());
+        position += zeros.size();
+    }
+
+    directory.push_back(position);
+    out.write((const char*)record.data(), record.size());
+    position += record.size();
+    names.push_back(name);
+    edges += targets.size();
+    if (!targets.empty()) maxTarget = max(maxTarget, targets.back());
+}
+
+void PagedGraphWriter::finish() {
+    if (maxTarget >= (int)names.size()) throw StorageException("Relation to an unknown vertex id");
+    directory.push_back(position);
+
+    uint64_t used = position % pageSize;
+    if (used != 0) {
+        vector<char> zeros(pageSize - used, 0);
+        out.write(zeros.data(), zeros.size());
+        position += zeros.size();
+    }
+
+    uint64_t directoryOffset = position;
+    out.write((const char*)directory.data(), directory.size() * sizeof(uint64_t));
+    position += directory.size() * sizeof(uint64_t);
+
+    uint64_t namesOffset = position;
+    vector<uint8_t> encoded;
+    for (string& name : names) {
+        CompressedGraph::putVarint(encoded, name.size());
+        encoded.insert(encoded.end(), name.begin(), name.end());
+    }
+    out.write((const char*)encoded.data(), encoded.size());
+
+    uint32_t magic = PAGED_GRAPH_MAGIC, format = PAGED_GRAPH_FORMAT, page = pageSize;
+    uint64_t vertexCount = names.size(), edgeCount = edges;
+    out.seekp(0);
+    out.write((const char*)&magic, sizeof(magic));
+    out.write((const char*)&format, sizeof(format));
+    out.write((const char*)&page, sizeof(page));
+    out.write((const char*)&vertexCount, sizeof(vertexCount));
+    out.write((const char*)&edgeCount, sizeof(edgeCount));
+    out.write((const char*)&directoryOffset, sizeof(directoryOffset));
+    out.write((const char*)&namesOffset, sizeof(namesOffset));
+    out.close();
+    if (out.fail()) throw StorageException("Failed to write paged graph");
+}
+
+void PagedGraphWriter::write(CompressedGraph& graph, string path, int pageSize) {
+    PagedGraphWriter writer(path, pageSize);
+    vector<int> targets;
+    for (int v = 0; v < graph.size(); v++) {
+        graph.decodeNeighbors(graph.outOffsets, graph.outData, v, targets);
+        writer.addVertex(graph.names[v], targets);
+    }
+    writer.finish();
+}
+
+// =============================================================================
+// Class PageCache Implementation
+// =============================================================================
+
+PageCache::PageCache(ifstream& file, int pageSize, size_t budgetBytes) : file(file) {
+    this->pageSize = pageSize;
+    this->capacity = max<size_t>(2, budgetBytes / pageSize);
+    this->frames.assign((size_t)capacity * pageSize, 0);
+    this->framePage.assign(capacity, -1);
+    this->referenced.assign(capacity, 0);
+    this->hand = 0;
+    this->counters = PageCacheStats{0, 0, 0, 0};
+}
+
+int PageCache::load(long long pageId) {
+    // CLOCK: skip (and clear) recently referenced frames until one is found
+    while (framePage[hand] != -1 && referenced[hand]) {
+        referenced[hand] = 0;
+        hand = (hand + 1) % capacity;
+    }
+    int victim = hand;
+    hand = (hand + 1) % capacity;
+    if (framePage[victim] != -1) {
+        resident.erase(framePage[victim]);
+        counters.evictions++;
+    }
+
+    char* frame = (char*)frames.data() + (size_t)victim * pageSize;
+    file.clear();
+    file.seekg(pageId * pageSize);
+    file.read(frame, pageSize);
+    streamsize got = file.gcount();
+    if (got <= 0) {
+        framePage[victim] = -1;
+        throw StorageException("Failed to read page " + to_string(pageId));
+    }
+    if (got < pageSize) fill(frame + got, frame + pageSize, 0);
+
+    framePage[victim] = pageId;
+    referenced[victim] = 1;
+    resident[pageId] = victim;
+    return victim;
+}
+
+const uint8_t* PageCache::page(long long pageId) {
+    auto found = resident.find(pageId);
+    int frame;
+    if (found != resident.end()) {
+        counters.hits++;
+        frame = found->second;
+        referenced[frame] = 1;
+    }
+    else {
+        counters.misses++;
+        frame = load(pageId);
+    }
+    return frames.data() + (size_t)frame * pageSize;
+}
+
+void PageCache::prefetch(vector<long long> pages) {
+    sort(pages.begin(), pages.end());
+    pages.erase(unique(pages.begin(), pages.end()), pages.end());
+    // never prefetch so much that the batch evicts itself
+    int budget = max(1, capacity / 2);
+    for (long long pageId : pages) {
+        if (budget == 0) break;
+        if (resident.count(pageId)) continue;
+        load(pageId);
+        // a disk read like any other, so a cold scan cannot report a perfect hit rate
+        counters.misses++;
+        counters.prefetched++;
+        budget--;
+    }
+}
+
+PageCacheStats PageCache::stats() {
+    return this->counters;
+}
+
+size_t PageCache::budgetBytes() {
+    return (size_t)capacity * pageSize;
+}
+
+// =============================================================================
+// Class PagedKnowledgeGraph Implementation
+// =============================================================================
+
+PagedKnowledgeGraph::PagedKnowledgeGraph(string path, size_t cacheBytes) : file(path, ios::binary) {
+    if (!file) throw StorageException("Cannot open " + path);
+
+    uint32_t magic = 0, format = 0, page = 0;
+    uint64_t vertexCount = 0, edgeCount = 0, directoryOffset = 0, namesOffset = 0;
+    file.read((char*)&magic, sizeof(magic));
+    file.read((char*)&format, sizeof(format));
+    file.read((char*)&page, sizeof(page));
+    file.read((char*)&vertexCount, sizeof(vertexCount));
+    file.read((char*)&edgeCount, sizeof(edgeCount));
+    file.read((char*)&directoryOffset, sizeof(directoryOffset));
+    file.read((char*)&namesOffset, sizeof(namesOffset));
+    if (!file || magic != PAGED_GRAPH_MAGIC || format != PAGED_GRAPH_FORMAT) {
+        throw StorageException(path + " is not a paged graph file");
+    }
+    // PagedGraphWriter never writes pages under 64 bytes; 0 would divide by zero below
+    if (page < 64 || page > (uint32_t)INT_MAX) throw StorageException(path + " has an invalid page size");
+    this->pageSize = page;
+    this->edges = edgeCount;
+
+    file.seekg(0, ios::end);
+    streamoff end = file.tellg();
+    if (end < 0) throw StorageException("Cannot size " + path);
+    uint64_t fileSize = end;
+    // PagedGraphWriter lays out header page, adjacency pages, directory, names;
+    // the directory has exactly vertexCount + 1 entries
+    if (directoryOffset < (uint64_t)pageSize || directoryOffset > namesOffset || namesOffset > fileSize
+        || vertexCount > (uint64_t)INT_MAX
+        || (namesOffset - directoryOffset) / sizeof(uint64_t) != vertexCount + 1) {
+        throw StorageException(path + " is truncated or corrupt");
+    }
+
+    directory.resize(vertexCount + 1);
+    file.seekg(directoryOffset);
+    file.read((char*)directory.data(), directory.size() * sizeof(uint64_t));
+    if (!file) throw StorageException(path + " is truncated");
+    // readNeighbors pages records in by these offsets, keep them inside the adjacency pages
+    if (directory[0] < (uint64_t)pageSize || directory[vertexCount] > directoryOffset) {
+        throw StorageException(path + " has a corrupt directory");
+    }
+    for (uint64_t v = 0; v < vertexCount; v++) {
+        if (directory[v] > directory[v + 1]) throw StorageException(path + " has a corrupt directory");
+    }
+
+    vector<uint8_t> encoded(fileSize - namesOffset);
+    file.seekg(namesOffset);
+    file.read((char*)encoded.data(), encoded.size());
+    if (!file) throw StorageException(path + " is truncated");
+
+    const uint8_t* in = encoded.data();
+    const uint8_t* namesEnd = in + encoded.size();
+    names.reserve(vertexCount);
+    for (uint64_t v = 0; v < vertexCount; v++) {
+        uint64_t length;
+        if (!CompressedGraph::getVarint(in, namesEnd, length) || length > (uint64_t)(namesEnd - in)) {
+            throw StorageException(path + " is truncated");
+        }
+        names.push_back(string((const char*)in, length));
+        in += length;
+        ids.emplace(names.back(), v);
+    }
+
+    this->cache = new PageCache(file, pageSize, cacheBytes);
+}
+
+PagedKnowledgeGraph::~PagedKnowledgeGraph() {
+    delete this->cache;
+}
+
+int PagedKnowledgeGraph::idOf(string entity) {
+    auto found = ids.find(entity);
+    if (found == ids.end()) throw EntityNotFoundException();
+    return found->second;
+}
+
+void PagedKnowledgeGraph::readNeighbors(int id, vector<int>& out) {
+    uint64_t start = directory[id];
+    uint64_t length = directory[id + 1] - start;
+    uint64_t inPage = start % pageSize;
+    long long pageId = start / pageSize;
+
+    const uint8_t* in;
+    if (inPage + length <= (uint64_t)pageSize) {
+        in = cache->page(pageId) + inPage;
+    }
+    else {
+        // a record larger than a page, stitch its pages together
+        spill.resize(length);
+        uint64_t copied = 0;
+        while (copied < length) {
+            const uint8_t* data = cache->page(pageId++);
+            uint64_t chunk = min<uint64_t>(length - copied, pageSize - inPage);
+            copy(data + inPage, data + inPage + chunk, spill.begin() + copied);
+            copied += chunk;
+            inPage = 0;
+        }
+        in = spill.data();
+    }
+
+    // decode before touching the cache again, the page may be evicted afterwards
+    int degree = CompressedGraph::getVarint(in);
+    int previous = 0;
+    out.clear();
+    for (int i = 0; i < degree; i++) {
+        previous += CompressedGraph::getVarint(in);
+        out.push_back(previous);
+    }
+}
+
+void PagedKnowledgeGraph::prefetchFrontier(const vector<int>& frontier, int first) {
+    vector<long long> pages;
+    for (int i = first; i < (int)frontier.size(); i++) {
+        int id = frontier[i];
+        long long firstPage = directory[id] / pageSize;
+        long long lastPage = (directory[id + 1] - 1) / pageSize;
+        for (long long p = firstPage; p <= lastPage; p++) pages.push_back(p);
+    }
+    cache->prefetch(pages);
+}
+
+int PagedKnowledgeGraph::size() {
+    return this->names.size();
+}
+
+long long PagedKnowledgeGraph::edgeCount() {
+    return this->edges;
+}
+
+vector<string> PagedKnowledgeGraph::getAllEntities() {
+    return this->names;
+}
+
+vector<string> PagedKnowledgeGraph::getNeighbors(string entity) {
+    vector<int> neighbours;
+    readNeighbors(idOf(entity), neighbours);
+    vector<string> result;
+    result.reserve(neighbours.size());
+    for (int id : neighbours) result.push_back(names[id]);
+    return result;
+}
+
+vector<string> PagedKnowledgeGraph::bfs(string start) {
+    vector<char> visited(this->size(), 0);
+    vector<int> queue(1, idOf(start));
+    vector<int> neighbours;
+    visited[queue[0]] = 1;
+    int levelEnd = 1;
+    for (int head = 0; head < (int)queue.size(); head++) {
+        if (head == levelEnd) {
+            prefetchFrontier(queue, head);
+            levelEnd = queue.size();
+        }
+        readNeighbors(queue[head], neighbours);
+        for (int next : neighbours) {
+            if (!visited[next]) {
+                visited[next] = 1;
+                queue.push_back(next);
+            }
+        }
+    }
+    vector<string> result;
+    result.reserve(queue.size());
+    for (int id : queue) result.push_back(names[id]);
+    return result;
+}
+
+bool PagedKnowledgeGraph::isReachable(string from, string to) {
+    int source = idOf(from);
+    int target = idOf(to);
+    if (source == target) return true;
+    vector<char> visited(this->size(), 0);
+    vector<int> queue(1, source);
+    vector<int> neighbours;
+    visited[source] = 1;
+    int levelEnd = 1;
+    for (int head = 0; head < (int)queue.size(); head++) {
+        if (head == levelEnd) {
+            prefetchFrontier(queue, head);
+            levelEnd = queue.size();
+        }
+        readNeighbors(queue[head], neighbours);
+        for (int next : neighbours) {
+            if (next == target) return true;
+            if (!visited[next]) {
+                visited[next] = 1;
+                queue.push_back(next);
+            }
+        }
+    }
+    return false;
+}
+
+vector<string> PagedKnowledgeGraph::getRelatedEntities(string entity, int depth) {
+    vector<char> visited(this->size(), 0);
+    vector<int> queue(1, idOf(entity));
+    vector<int> neighbours;
+    vector<string> related;
+    visited[queue[0]] = 1;
+    int levelEnd = 1, level = 0;
+    for (int head = 0; head < (int)queue.size(); head++) {
+        if (head == levelEnd) {
+            level++;
+            levelEnd = queue.size();
+            // the last level is only reported, its adjacency is never read
+            if (level < depth) prefetchFrontier(queue, head);
+        }
+        if (level > 0) related.push_back(names[queue[head]]);
+        if (level >= depth) continue;
+        readNeighbors(queue[head], neighbours);
+        for (int next : neighbours) {
+            if (!visited[next]) {
+                visited[next] = 1;
+                queue.push_back(next);
+            }
+        }
+    }
+    return related;
+}
+
+PageCacheStats PagedKnowledgeGraph::cacheStats() {
+    return cache->stats();
+}
+
+// =============================================================================
+// QUEUE // MY IMPLEMENTATION
+// =============================================================================
+
+template <class T>
 Queue<T>::Queue() {
     // aura farming
 }
@@ -735,31 +5536,21 @@ Set<T>::Set(int capacity, string (*item2Str)(T&),bool (*itemEQ)(T&, T&)) :  capa
     this->buckets.resize(capacity);
 }
 
+template <class T>
+unsigned long Set<T>::bucketOf(T& item) {
+    if (this->item2Str) return hashFunction(item2Str(item));
+    return VertexHash<T>()(item) % capacity;
+}
+
 template <class T>
 void Set<T>::insert(T item) {
     if (this->contains(item)) return;
-    string str;
-    if (this->item2Str) str = item2Str(item);
-    else {
-        stringstream ss;
-        ss << item;
-        str = ss.str();
-    }
-
-    int index = hashFunction(str);
+    int index = bucketOf(item);
     buckets[index].push_back(item);
 }
 
 template <class T>
-bool Set<T>::contains(T item) {
-    string str;
-    if (this->item2Str) str = this->item2Str(item);
-    else {
-        stringstream ss;
-        ss << item;
-        str = ss.str();
-    }
-    int index = hashFunction(str);
+bool Set<T>::bucketContains(unsigned long index, T& item) {
     for (T& exists : buckets[index]) {
         if (this->itemEQ) {
             if (itemEQ(exists, item)) return true;
@@ -771,6 +5562,17 @@ bool Set<T>::contains(T item) {
     return false;
 }
 
+template <class T>
+bool Set<T>::contains(T item) {
+    if (bucketContains(bucketOf(item), item)) return true;
+    // item2Str hashes exactly; VertexHash may put an equal item in a neighbouring bucket
+    if (this->item2Str) return false;
+    for (T& probe : VertexHash<T>::boundaryProbes(item)) {
+        if (bucketContains(bucketOf(probe), item)) return true;
+    }
+    return false;
+}
+
 // =============================================================================
 // Explicit Template Instantiation
 // =============================================================================
@@ -790,6 +5592,16 @@ template class DGraphModel<int>;
 template class DGraphModel<float>;
 template class DGraphModel<char>;
 
+template class TraversalLayout<string>;
+template class TraversalLayout<int>;
+template class TraversalLayout<float>;
+template class TraversalLayout<char>;
+
+template class Edge<Point>;
+template class VertexNode<Point>;
+template class DGraphModel<Point>;
+template class TraversalLayout<Point>;
+
 template class Stack<VertexNode<string>*>; 
 template class Queue<VertexNode<string>*>; 
 template class Set<string>;
@@ -806,4 +5618,8 @@ template class Stack<VertexNode<char>*>;
 template class Queue<VertexNode<char>*>;
 template class Set<char>;
 
+template class Stack<VertexNode<Point>*>;
+template class Queue<VertexNode<Point>*>;
+template class Set<Point>;
+
 template class Queue<int>;
\ No newline at end of file
@@ -6,6 +6,90 @@
 // Forward declaration
 template <class T> class VertexNode;
 template <class T> class DGraphModel;
+template <class T> class TraversalLayout;
+class Condensation;
+class QueryBudget;
+class KnowledgeGraph;
+class QueryExecutor;
+class ShardedKnowledgeGraph;
+class ShardMessage;
+class KdTree;
+class GeometricRouter;
+
+// What DGraphModel::connect does when an edge from -> to already exists
+enum class ParallelEdgePolicy {
+    KEEP,   // add another parallel edge (default)
+    REJECT, // throw EdgeExistsException
+    MERGE   // overwrite the weight of the existing edge
+};
+
+// Vertex numbering used when building a TraversalLayout
+enum class VertexOrdering {
+    INSERTION,     // nodeList order, i.e. no reordering
+    DEGREE,        // highest total degree first, so hubs share cache lines
+    CUTHILL_MCKEE  // reverse Cuthill-McKee over the undirected graph
+};
+
+// Hash used by the vertex lookup index, specialise for vertex types without std::hash.
+// boundaryProbes lists values hashing to every other bucket an equal value may
+// hash to; lookups that miss search those buckets too.
+template <class T>
+struct VertexHash {
+    size_t operator()(const T& vertex) const { return std::hash<T>()(vertex); }
+    static vector<T> boundaryProbes(const T&) { return vector<T>(); }
+};
+
+// Spatial hash: the grid cell of side CELL a point falls in. Point::operator==
+// allows 1e-9 of slack, so a point equal to one near a cell boundary can lie in
+// the neighbouring cell; boundaryProbes returns the centres of those cells.
+template <>
+struct VertexHash<Point> {
+    static constexpr double CELL = 1e-6;
+    size_t operator()(const Point& vertex) const;
+    static vector<Point> boundaryProbes(const Point& vertex);
+};
+
+// Bytes held by a graph, by category. Hash tables are estimated from their
+// bucket and node counts; everything else is counted exactly from sizes and
+// capacities.
+struct MemoryUsage {
+    size_t vertexObjects;   // VertexNode objects and the nodeList array
+    size_t edgeObjects;     // Edge objects
+    size_t adjacencyUsed;   // adList slots holding an edge
+    size_t adjacencySlack;  // adList capacity beyond size, reclaimed by shrinkToFit
+    size_t vertexValues;    // heap storage owned by the vertex values (entity names)
+    size_t duplicateValues; // further copies of the values: vertexIndex keys, KnowledgeGraph::entities
+    size_t indexes;         // lookup tables, per-vertex edge indexes and cached derived structures
+
+    MemoryUsage();
+    size_t total();
+    string toString();
+
+    // libstdc++ layout: the bucket array plus one node (next pointer, cached hash, entry) per element
+    template <class Map>
+    static size_t hashTableBytes(const Map& map) {
+        return map.bucket_count() * sizeof(void*) + map.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void*));
+    }
+    // Heap bytes owned by a value beyond sizeof the value itself
+    template <class V>
+    static size_t valueBytes(const V&) {
+        return 0;
+    }
+    static size_t valueBytes(const string& value) {
+        // short strings live inside the string object itself
+        return (value.capacity() > 15) ? value.capacity() + 1 : 0;
+    }
+};
+
+// Triangles of the undirected simple graph underneath a DGraphModel: edge
+// direction, parallel edges and self-loops are ignored
+struct TriangleCounts {
+    long long total;
+    vector<long long> perVertex;  // by vertex id
+    vector<double> clustering;    // local clustering coefficient by vertex id, 0 below degree 2
+    double averageClustering;     // mean of 'clustering' over every vertex
+    double transitivity;          // 3 * total / connected triples
+};
 
 // =====================================
 // Class Edge
@@ -19,9 +103,10 @@ private:
     VertexNode<T>* from;
     VertexNode<T>* to;
     float weight;
+    int label; // interned relation label, 0 = unlabelled
 
 public:
-    Edge(VertexNode<T>* from = nullptr, VertexNode<T>* to = nullptr, float weight = 0);
+    Edge(VertexNode<T>* from = nullptr, VertexNode<T>* to = nullptr, float weight = 0, int label = 0);
     
     bool equals(Edge<T>* edge);
     static bool edgeEQ(Edge<T>*& edge1, Edge<T>*& edge2);
@@ -29,11 +114,25 @@ public:
 
     friend class VertexNode<T>;
     friend class DGraphModel<T>;
+    friend class KnowledgeGraph;
+    friend class ShardedKnowledgeGraph;
+    friend class KdTree;
+    friend class GeometricRouter;
 };
 
 // =====================================
 // Class VertexNode
 // =====================================
+// The edges of one label touching a vertex, split by direction
+template <class T>
+struct LabelPartition {
+    int label;
+    vector<Edge<T>*> out;
+    vector<Edge<T>*> in;
+    // 'out' keyed by target (first parallel edge), kept while the vertex has an outIndex
+    unordered_map<VertexNode<T>*, Edge<T>*> index;
+};
+
 template <class T>
 class VertexNode {
     #ifdef TESTING
@@ -41,6 +140,7 @@ class VertexNode {
     #endif
 private:
     T vertex;
+    int id_; // position in DGraphModel::nodeList, stable since vertices are never removed
     int inDegree_;
     int outDegree_;
     vector<Edge<T>*> adList; 
@@ -49,14 +149,33 @@ private:
     bool (*vertexEQ)(T&, T&);
     string (*vertex2str)(T&);
 
+    // Out-edges keyed by target, only built for high out-degree vertices
+    unordered_map<VertexNode<T>*, Edge<T>*>* outIndex;
+    // Edges grouped by label; created when the first labelled edge touches
+    // this vertex, until then every edge in adList is unlabelled
+    vector<LabelPartition<T>>* partitions;
+
+    void buildOutIndex();
+    void dropOutIndex();
+    void ensurePartitions();
+    LabelPartition<T>* findPartition(int label);
+    LabelPartition<T>& partition(int label);
+    void indexPartition(LabelPartition<T>& part);
+    void removeEdge(Edge<T>* edging);
+
 public:
     VertexNode(T vertex, bool (*vertexEQ)(T&, T&) = nullptr, string (*vertex2str)(T&) = nullptr);
+    ~VertexNode();
     
     T& getVertex();
-    void connect(VertexNode<T>* to, float weight = 0);
+    void connect(VertexNode<T>* to, float weight = 0, int label = 0);
     Edge<T>* getEdge(VertexNode<T>* to);
+    Edge<T>* getEdge(VertexNode<T>* to, int label);
     bool equals(VertexNode<T>* node);
+    // Removes the earliest added out-edge to 'to' that is still present, whatever its label
     void removeTo(VertexNode<T>* to);
+    // Removes the earliest added out-edge to 'to' under 'label'; false if there is none
+    bool removeTo(VertexNode<T>* to, int label);
     int inDegree();
     int outDegree();
     string toString();
@@ -64,9 +183,15 @@ public:
     // MANUALLY ADDED FUNCTIONS
     vector<T> getOutVertices();
     vector<T> getInVertices();
+    // Every out-edge exactly once (adList holds a self-loop twice)
+    vector<Edge<T>*> outEdges();
 
     friend class Edge<T>;
     friend class DGraphModel<T>;
+    friend class KnowledgeGraph;
+    friend class ShardedKnowledgeGraph;
+    friend class KdTree;
+    friend class GeometricRouter;
 };
 
 // =====================================
@@ -79,11 +204,28 @@ class DGraphModel {
     #endif
 private:
     vector<VertexNode<T>*> nodeList;
+    unordered_map<T, VertexNode<T>*, VertexHash<T>> vertexIndex;
     
     // Function pointers
     bool (*vertexEQ)(T&, T&);
     string (*vertex2str)(T&);
 
+    ParallelEdgePolicy edgePolicy;
+    int edgeIndexThreshold;
+
+    // Relation labels interned to small ids, id 0 is the empty (unlabelled) label
+    vector<string> labelNames;
+    unordered_map<string, int> labelIds;
+
+    // Bumped by every mutation so derived structures know when they are stale
+    unsigned long version_;
+    // Latest condensation (atomic_load / atomic_store only); readers keep the
+    // snapshot they loaded, so a rebuild never frees one still in use
+    shared_ptr<Condensation> condensationCache;
+    mutex condensationLock; // held while a stale condensation is rebuilt
+
+    void connectNodes(VertexNode<T>* fromNode, VertexNode<T>* toNode, float weight, int label);
+
 public:
     DGraphModel(bool (*vertexEQ)(T&, T&) = nullptr, string (*vertex2str)(T&) = nullptr);
     ~DGraphModel();
@@ -98,7 +240,9 @@ public:
     vector<Edge<T>*> getOutwardEdges(T from);
     
     void connect(T from, T to, float weight = 0);
+    void connect(T from, T to, float weight, string label);
     void disconnect(T from, T to);
+    void disconnect(T from, T to, string label);
     bool connected(T from, T to);
 
     int size();
@@ -108,10 +252,964 @@ public:
     int inDegree(T vertex);
     int outDegree(T vertex);
     vector<T> vertices();
+    int vertexId(T vertex);
     
     string toString();
     string BFS(T start);
     string DFS(T start);
+
+    // Vertices reaching this out-degree get a hash index over their out-edges
+    static const int DEFAULT_EDGE_INDEX_THRESHOLD = 32;
+
+    void setParallelEdgePolicy(ParallelEdgePolicy policy);
+    ParallelEdgePolicy getParallelEdgePolicy();
+    void setEdgeIndexThreshold(int threshold);
+
+    TraversalLayout<T> buildTraversalLayout(VertexOrdering ordering = VertexOrdering::CUTHILL_MCKEE);
+
+    int internLabel(string label);
+    int labelId(string label); // -1 for a label never used
+    string labelName(int id);
+    vector<string> labels();
+
+    unsigned long version();
+    // Strongly connected components, recomputed only after the graph has changed
+    shared_ptr<Condensation> condensation();
+    // The cached condensation if it matches the current graph, else null; never builds
+    shared_ptr<Condensation> currentCondensation();
+    // Triangle counts and clustering coefficients, spread over 'threads'
+    // workers (<= 0: one per hardware thread)
+    TriangleCounts countTriangles(int threads = 0);
+
+    MemoryUsage memoryUsage();
+    // Drops the spare capacity vector growth leaves behind, e.g. after a bulk load
+    void shrinkToFit();
+
+    friend class KnowledgeGraph;
+    friend class ShardedKnowledgeGraph;
+    friend class KdTree;
+    friend class GeometricRouter;
+};
+
+// =====================================
+// Class KdTree
+// =====================================
+// Static 3-d tree over the vertices of a DGraphModel<Point>, stored implicitly:
+// the median of every index range is its node, split on the axis along which
+// that range is widest. Build is O(n log n); the tree does not follow later
+// changes to the graph.
+class KdTree {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    vector<VertexNode<Point>*> nodes; // in tree order
+    vector<uint8_t> axes;             // split axis of the node at each position
+
+    static double coordinate(const Point& point, int axis);
+    void build(int lo, int hi);
+    void nearest(int lo, int hi, const Point& query, int k, int exclude, vector<pair<double, int>>& best);
+    void withinRadius(int lo, int hi, const Point& query, double radius2, vector<int>& out);
+    // Positions of the k nearest nodes, nearest first; 'exclude' is a vertex id to skip
+    vector<int> nearestPositions(const Point& query, int k, int exclude);
+
+public:
+    KdTree(DGraphModel<Point>& graph);
+
+    int size();
+    // The k vertices closest to 'query', nearest first
+    vector<Point> nearest(Point query, int k);
+    // Every vertex within 'radius' of 'query', nearest first
+    vector<Point> withinRadius(Point query, double radius);
+
+    // Connects every vertex to its k nearest other vertices, weighted by distanceTo
+    static void connectKNearest(DGraphModel<Point>& graph, int k);
+};
+
+// =====================================
+// Class TraversalLayout
+// =====================================
+// Immutable CSR snapshot of a DGraphModel with vertices renumbered for locality.
+// Callers always talk in vertex ids (nodeList positions); the permutation to
+// layout positions stays internal, so traversal results match DGraphModel's.
+template <class T>
+class TraversalLayout {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    vector<int> offsets;   // out-edges of position p are [offsets[p], offsets[p + 1])
+    vector<int> targets;   // layout positions, in the same order as adList
+    vector<float> weights;
+    vector<T> values;      // vertex values by layout position
+    vector<int> order;     // layout position -> vertex id
+    vector<int> position;  // vertex id -> layout position
+
+public:
+    TraversalLayout();
+
+    int size();
+    int edgeCount();
+    int positionOf(int vertexId);
+    int vertexAt(int position);
+    T& vertex(int vertexId);
+    vector<int> neighbors(int vertexId);
+
+    vector<int> bfs(int startId);
+    vector<int> dfs(int startId);
+
+    // Mean |position(from) - position(to)| over all edges, a cheap locality proxy
+    double averageEdgeSpan();
+
+    friend class DGraphModel<T>;
+};
+
+// =====================================
+// Class Condensation
+// =====================================
+// Strongly connected components of a DGraphModel and the DAG between them.
+// Components are numbered in topological order: every DAG edge goes from a
+// lower to a higher component id, so c1 > c2 already proves c1 cannot reach c2.
+class Condensation {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    vector<int> componentOf;    // vertex id -> component id
+    vector<int> memberOffsets;  // members of c are members[memberOffsets[c] .. memberOffsets[c + 1])
+    vector<int> members;
+    vector<int> dagOffsets;     // successors of c are dagTargets[dagOffsets[c] .. dagOffsets[c + 1])
+    vector<int> dagTargets;
+    bool cyclic;
+    unsigned long version; // graph version it was built from
+
+public:
+    Condensation();
+
+    int componentCount();
+    int component(int vertexId);
+    vector<int> componentMembers(int component);
+    vector<int> successors(int component);
+    bool hasCycle();
+
+    // Walks the DAG from 'fromComponent', never entering components past 'toComponent'.
+    // Under a budget each component counts as one vertex and each DAG edge as one edge;
+    // false once the budget runs out.
+    bool reaches(int fromComponent, int toComponent, QueryBudget* budget = nullptr);
+    // Vertex ids ordered so that every edge between components points forward
+    vector<int> topologicalOrder();
+    size_t memoryBytes();
+
+    template <class T> friend class DGraphModel;
+};
+
+// =====================================
+// Class TriangleCounter
+// =====================================
+// Triangle listing over a degree-ordered orientation: each undirected edge
+// points from the endpoint of lower (degree, id) rank to the higher one, so
+// every triangle is found exactly once, at its lowest-ranked vertex, and no
+// out-list is longer than sqrt(2m). The out-lists are intersected pairwise,
+// four-by-four with SSE2 where available, galloping when one list is much
+// shorter than the other.
+class TriangleCounter {
+public:
+    // 'neighbors' of vertex v are [offsets[v], offsets[v + 1]), sorted, without v itself
+    static TriangleCounts count(const vector<int>& offsets, const vector<int>& neighbors, int threads);
+};
+
+// =====================================
+// Class VisitMap / TraversalScratch
+// =====================================
+// Vertex id -> int map that is cleared in O(1) by bumping an epoch, so one
+// instance can serve any number of traversals without reallocating.
+class VisitMap {
+private:
+    vector<unsigned> stamp;
+    vector<int> value;
+    unsigned epoch;
+
+public:
+    VisitMap();
+
+    void reset(int vertexCount);
+    bool contains(int id);
+    void set(int id, int v = 0);
+    int get(int id); // -1 when absent
+    size_t memoryBytes();
+};
+
+// Reusable buffers for one thread's KnowledgeGraph traversals
+class TraversalScratch {
+public:
+    VisitMap visited;
+    VisitMap distanceA;
+    VisitMap distanceB;
+    vector<VertexNode<string>*> nodes;
+    vector<VertexNode<string>*> stack;
+    vector<VertexNode<string>*> adjacent;
+    vector<int> depths;
+};
+
+// =====================================
+// Class GeometricRouter
+// =====================================
+// Shortest path found by GeometricRouter
+struct Route {
+    vector<Point> path; // from .. to, empty when 'to' is unreachable
+    double distance;    // sum of the edge weights along path, -1 when unreachable
+    int expanded;       // vertices taken off the open set, for benchmarking
+};
+
+// d-ary min-heap of small dense ints with decrease-key
+class IndexedHeap {
+private:
+    static const int ARITY = 4;
+    vector<pair<double, int>> entries; // (key, item)
+    vector<int> position;              // item -> index in entries, -1 when not queued
+
+    void place(int index, pair<double, int> entry);
+    void siftUp(int index);
+    void siftDown(int index);
+
+public:
+    void clear(); // keeps capacity
+    bool empty();
+    double topKey();
+    int pop();
+    // Queues 'item' or lowers its key; a higher key than the queued one is ignored
+    void push(int item, double key);
+    size_t memoryBytes();
+};
+
+// A* over a DGraphModel<Point> whose edge weights are non-negative (a negative
+// weight throws InvalidQueryException). The heuristic is s * distanceTo, with s
+// the largest factor keeping it below every edge's weight (1 when weights are
+// plain lengths), tightened by ALT landmark bounds once buildLandmarks has run.
+// Searches use per-thread scratch, so one router may serve several threads
+// while the graph is left unchanged.
+class GeometricRouter {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    // State of one search direction, kept only for the vertices it reaches so
+    // a short route on a large graph costs what it touches
+    class RouteSearch {
+    public:
+        VisitMap local; // vertex id -> index into the vectors below
+        vector<VertexNode<Point>*> nodes;
+        vector<double> cost;     // best known distance from the search origin
+        vector<double> estimate; // heuristic term, NaN until first needed
+        vector<int> parent;      // index of the predecessor, -1 at the origin
+        vector<char> closed;
+        IndexedHeap open;
+
+        void reset(int vertexCount);
+        int touch(VertexNode<Point>* node); // index of node, added at infinite cost when new
+    };
+
+    // Per-thread, so concurrent routes never share buffers
+    static thread_local RouteSearch forwardSearch;
+    static thread_local RouteSearch backwardSearch;
+
+    DGraphModel<Point>& graph;
+    mutex refreshLock; // held while the scale and landmarks are recomputed
+    unsigned long version_;
+    double scale;
+    int landmarkCount_;
+    vector<vector<double>> fromLandmark; // [landmark][id] = distance landmark -> id, infinity if unreachable
+    vector<vector<double>> toLandmark;   // [landmark][id] = distance id -> landmark
+
+    void computeScale();
+    void computeLandmarks();
+    // Single-source distances over out-edges, or in-edges when !outward
+    void distances(VertexNode<Point>* source, bool outward, vector<double>& result);
+    // Admissible and consistent lower bound on the distance from -> to
+    double lowerBound(VertexNode<Point>* from, VertexNode<Point>* to);
+    VertexNode<Point>* node(Point& vertex);
+
+public:
+    GeometricRouter(DGraphModel<Point>& graph);
+
+    // Recomputes the scale and landmarks if the graph has changed. Queries call
+    // it too, so calling it after a change only moves that cost out of the first
+    // query; concurrent first queries rebuild once and the rest wait for it.
+    void refresh();
+
+    Route route(Point from, Point to);
+    // Searches from both ends with averaged potentials; the same distance as
+    // route, usually with fewer expansions on long routes
+    Route routeBidirectional(Point from, Point to);
+
+    // Picks 'count' landmarks by farthest-point sampling and stores distances
+    // to and from each: 16 bytes per vertex per landmark, two Dijkstra runs each.
+    // Not to be called while other threads are routing.
+    void buildLandmarks(int count);
+    int landmarkCount();
+    double heuristicScale();
+};
+
+// =====================================
+// Class CompressedGraph
+// =====================================
+struct CompressionOptions {
+    // 0 keeps every distinct weight exactly; otherwise weights are snapped to
+    // this many evenly spaced levels between the smallest and largest weight
+    int weightLevels;
+
+    CompressionOptions() : weightLevels(0) {}
+};
+
+struct CompressedFootprint {
+    size_t adjacencyBytes;  // encoded out-edge records
+    size_t offsetBytes;     // per-vertex record offsets
+    size_t weightBytes;     // weight dictionary
+    size_t inIndexBytes;    // in-edge records and offsets, 0 until first needed
+    size_t nameBytes;       // entity names and the name -> id table
+    size_t totalBytes;
+    double bytesPerEdge;    // everything except names, divided by the edge count
+};
+
+// Immutable graph whose adjacency is stored as one byte stream per direction.
+// The record of vertex v is: varint out-degree, the sorted neighbour ids as
+// varint deltas (the first one absolute), then one varint weight-dictionary
+// code per edge unless all weights are equal. Neighbours therefore come back
+// in id order (entity insertion order), not in relation insertion order.
+class CompressedGraph {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    vector<string> names;
+    unordered_map<string, int> ids;
+    vector<uint64_t> outOffsets;
+    vector<uint8_t> outData;
+    vector<uint64_t> inOffsets;   // built on the first in-edge query
+    vector<uint8_t> inData;
+    vector<float> weightTable;    // most frequent weight first, so it gets the 1-byte code
+    long long edges;
+
+    static uint8_t* writeVarint(uint8_t* out, uint64_t value);
+    static void putVarint(vector<uint8_t>& out, uint64_t value);
+    static uint64_t getVarint(const uint8_t*& in);
+    // Decodes one varint that must end before 'end'; false if it does not
+    static bool getVarint(const uint8_t*& in, const uint8_t* end, uint64_t& value);
+    static int varintSize(uint64_t value);
+
+    int idOf(string entity);
+    void buildInIndex();
+    void decodeNeighbors(const vector<uint64_t>& offsets, const vector<uint8_t>& data,
+                         int id, vector<int>& out);
+
+public:
+    CompressedGraph();
+
+    int size();
+    long long edgeCount();
+    vector<string> getAllEntities();
+    int outDegree(string entity);
+    float weight(string from, string to);
+
+    vector<string> getNeighbors(string entity);
+    vector<string> getInNeighbors(string entity);
+    vector<string> bfs(string start);
+    bool isReachable(string from, string to);
+    vector<string> getRelatedEntities(string entity, int depth = 2);
+
+    CompressedFootprint footprint();
+
+    friend class CompressedGraphBuilder;
+    friend class PagedGraphWriter;
+    friend class PagedKnowledgeGraph;
+    friend class EntityPrefixIndex;
+    friend class ShardMessage;
+};
+
+// Collects entities and relations as flat triples and encodes them in one
+// pass, so large graphs can be compressed without building a DGraphModel
+class CompressedGraphBuilder {
+private:
+    struct PendingEdge {
+        int from;
+        int to;
+        float weight;
+    };
+
+    vector<string> names;
+    unordered_map<string, int> ids;
+    vector<PendingEdge> pending;
+
+public:
+    void addEntity(string entity);
+    void addRelation(string from, string to, float weight = 1.0f);
+    CompressedGraph build(CompressionOptions options = CompressionOptions());
+};
+
+// =====================================
+// Class PagedKnowledgeGraph
+// =====================================
+// On-disk layout written by PagedGraphWriter:
+//   page 0             header (magic, page size, counts, section offsets)
+//   pages 1 .. k       adjacency records (varint degree + varint id deltas);
+//                      a record never straddles a page boundary unless it is
+//                      larger than a page, in which case it spans whole pages
+//   after the pages    directory (n + 1 uint64 record offsets) and the names
+// Only the directory and the names are loaded into memory; adjacency pages
+// go through a bounded PageCache.
+class PagedGraphWriter {
+private:
+    ofstream out;
+    int pageSize;
+    uint64_t position;
+    vector<uint64_t> directory;
+    vector<string> names;
+    long long edges;
+    int maxTarget;
+    vector<uint8_t> record;
+
+public:
+    static const int DEFAULT_PAGE_SIZE = 4096;
+
+    PagedGraphWriter(string path, int pageSize = DEFAULT_PAGE_SIZE);
+
+    // Vertices must be appended in id order; targets may refer to later ids
+    void addVertex(string name, vector<int> targets);
+    void finish();
+
+    static void write(CompressedGraph& graph, string path, int pageSize = DEFAULT_PAGE_SIZE);
+};
+
+struct PageCacheStats {
+    long long hits;        // page() calls served from memory
+    long long misses;      // pages read from the file, by page() or prefetch()
+    long long evictions;
+    long long prefetched;  // the part of 'misses' loaded ahead of use by prefetch()
+
+    double hitRate() const { return (hits + misses == 0) ? 0 : (double)hits / (hits + misses); }
+};
+
+// Fixed pool of page frames with CLOCK (second chance) replacement
+class PageCache {
+private:
+    ifstream& file;
+    int pageSize;
+    int capacity;
+    vector<uint8_t> frames;
+    vector<long long> framePage;  // page held by each frame, -1 when free
+    vector<char> referenced;
+    unordered_map<long long, int> resident;
+    int hand;
+    PageCacheStats counters;
+
+    int load(long long pageId);
+
+public:
+    PageCache(ifstream& file, int pageSize, size_t budgetBytes);
+
+    // Valid until the next call into the cache
+    const uint8_t* page(long long pageId);
+    // Loads the given pages in file order, at most half the cache worth
+    void prefetch(vector<long long> pages);
+    PageCacheStats stats();
+    size_t budgetBytes();
+};
+
+// Read-only KnowledgeGraph query surface over a paged file. BFS-style
+// queries prefetch the pages of each next frontier, sorted by file position.
+class PagedKnowledgeGraph {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    ifstream file;
+    int pageSize;
+    long long edges;
+    vector<uint64_t> directory;
+    vector<string> names;
+    unordered_map<string, int> ids;
+    PageCache* cache;
+    vector<uint8_t> spill;  // reassembly buffer for records spanning pages
+
+    int idOf(string entity);
+    void readNeighbors(int id, vector<int>& out);
+    void prefetchFrontier(const vector<int>& frontier, int first);
+
+public:
+    static const size_t DEFAULT_CACHE_BYTES = 64 << 20;
+
+    PagedKnowledgeGraph(string path, size_t cacheBytes = DEFAULT_CACHE_BYTES);
+    ~PagedKnowledgeGraph();
+
+    int size();
+    long long edgeCount();
+    vector<string> getAllEntities();
+    vector<string> getNeighbors(string entity);
+    vector<string> bfs(string start);
+    bool isReachable(string from, string to);
+    vector<string> getRelatedEntities(string entity, int depth = 2);
+
+    PageCacheStats cacheStats();
+};
+
+// =====================================
+// Class EntityPrefixIndex
+// =====================================
+// Sorted entity names, front coded in blocks of BLOCK_SIZE: each block starts
+// with a full name (varint length + bytes) followed by entries stored as
+// (varint shared-prefix length, varint suffix length, suffix bytes). Single
+// inserts land in a small sorted buffer that is merged into the blocks once
+// it outgrows a fraction of them, so addEntity stays cheap and lookups only
+// decode the blocks they touch.
+class EntityPrefixIndex {
+private:
+    static const int BLOCK_SIZE = 16;
+    static const int MIN_PENDING = 256;
+
+    vector<uint8_t> data;
+    vector<uint64_t> blockOffsets;
+    int baseCount;
+    set<string> pending;
+
+    // Walks the front-coded entries in order, one decoded name at a time
+    struct Cursor {
+        EntityPrefixIndex* index;
+        int position;     // entry number, baseCount when exhausted
+        const uint8_t* in;
+        string current;
+
+        bool valid() const { return position < index->baseCount; }
+        void seekBlock(int block);
+        void next();
+    };
+
+    string blockHead(int block);
+    void encode(const vector<string>& sorted);
+    void mergePending();
+    vector<string> scan(const string& from, const string& prefix, const string* upper, int limit);
+
+public:
+    EntityPrefixIndex();
+
+    void insert(string name);
+    // Replaces the contents in one sort + encode pass
+    void build(vector<string> names);
+    void clear();
+    int size();
+
+    // Names starting with 'prefix', in lexicographic order, at most 'limit' of them
+    vector<string> findByPrefix(string prefix, int limit);
+    // Names in [from, to), in lexicographic order, at most 'limit' of them
+    vector<string> range(string from, string to, int limit);
+    size_t memoryBytes();
+};
+
+// =====================================
+// Class TransitionMatrix
+// =====================================
+struct PageRankOptions {
+    float damping;       // probability of following an edge rather than restarting
+    float tolerance;     // stop once the L1 change of an iteration drops below this
+    int maxIterations;
+    int threads;         // batch workers, <= 0 uses one per hardware thread
+    bool includeSeeds;   // seeds usually dominate their own ranking, so they are left out
+
+    PageRankOptions() : damping(0.85f), tolerance(1e-6f), maxIterations(100), threads(0), includeSeeds(false) {}
+};
+
+struct RankedEntity {
+    string entity;
+    float score;
+};
+
+// Random-walk transition probabilities stored by target (pull layout): row v
+// holds every u -> v with P(u -> v) = weight / total out-weight of u, so one
+// iteration is a single streaming pass over contiguous arrays. Vertices with
+// edges but no positive weight fall back to uniform probabilities; vertices
+// without out-edges are 'dangling' and hand their mass back to the seeds.
+class TransitionMatrix {
+public:
+    vector<int> offsets;
+    vector<int> sources;
+    vector<float> probabilities;
+    vector<int> dangling;
+    unsigned long version; // graph version it was built from
+
+    TransitionMatrix();
+
+    // Power iteration with restart to 'seeds'; returns the iterations used
+    int personalizedRank(const vector<int>& seeds, const PageRankOptions& options,
+                         vector<float>& rank, vector<float>& next);
+    size_t memoryBytes();
+};
+
+// =====================================
+// Class AliasTable
+// =====================================
+struct RandomWalkOptions {
+    int walkLength;     // vertices per walk including the start; shorter if a walk reaches a vertex without out-edges
+    int walksPerVertex;
+    float p;            // node2vec return parameter: stepping back to the previous vertex weighs 1/p, finite and > 0
+    float q;            // node2vec in-out parameter: leaving the previous vertex's out-neighbourhood weighs 1/q, finite and > 0
+    int threads;        // <= 0 uses one per hardware thread
+    unsigned long long seed;
+
+    RandomWalkOptions() : walkLength(80), walksPerVertex(10), p(1), q(1), threads(0), seed(1) {}
+};
+
+// Per-vertex alias tables over the out-edges (Vose's method), so a weighted
+// neighbour draw costs one random number whatever the degree. Edge weights
+// are clamped at 0 and vertices without positive weight fall back to uniform
+// draws, as in TransitionMatrix. Targets are sorted within each vertex, which
+// lets node2vec test "is x an out-neighbour of t" by binary search.
+class AliasTable {
+public:
+    vector<int> offsets;   // out-edges of vertex v are [offsets[v], offsets[v + 1])
+    vector<int> targets;
+    vector<float> cutoff;  // keep slot i with this probability, else take alias[i]
+    vector<int> alias;     // slot within the same vertex
+    unsigned long version; // graph version it was built from
+
+    AliasTable();
+
+    // Weighted out-neighbour of a vertex with out-edges; 'random' is 64 uniform bits
+    int sample(int vertex, uint64_t random);
+    // Probability of each of the vertex's out-edges under sample, in target order
+    void probabilities(int vertex, vector<double>& out);
+    bool hasEdge(int from, int to);
+    size_t memoryBytes();
+};
+
+// =====================================
+// Class TripleIndex
+// =====================================
+// A position starting with '?' is a variable; otherwise it names an entity
+// (subject, object) or a relation label (predicate, "" for unlabelled relations)
+struct TriplePattern {
+    string subject;
+    string predicate;
+    string object;
+
+    TriplePattern(string subject, string predicate, string object)
+        : subject(subject), predicate(predicate), object(object) {}
+};
+
+// Every distinct (subject, label, object) relation sorted three ways: SPO, POS
+// and OSP. Permutation 'lead' orders by positions lead, lead+1, lead+2 (mod 3)
+// and is stored column-wise, so the last column under a fixed two-column prefix
+// is one contiguous sorted posting list.
+class TripleIndex {
+public:
+    enum { SUBJECT = 0, PREDICATE = 1, OBJECT = 2 };
+
+    struct Permutation {
+        vector<int> columns[3];
+    };
+
+    Permutation permutations[3];
+    int distinct[3]; // distinct values per position, for cardinality estimates
+    unsigned long version; // graph version it was built from
+
+    TripleIndex();
+
+    void build(const vector<int>& subjects, const vector<int>& predicates, const vector<int>& objects);
+    int size();
+    // Rows of permutation 'lead' whose first 'prefixLength' columns equal (a, b)
+    void range(int lead, int prefixLength, int a, int b, int& lo, int& hi);
+    bool contains(int subject, int predicate, int object);
+    size_t memoryBytes();
+};
+
+// Streams the solutions of a conjunctive query one binding at a time. Variables
+// are bound in a cost-based order; a variable whose patterns are otherwise
+// fully bound draws its candidates from the intersection of their posting
+// lists, the same SSE2 / galloping kernel TriangleCounter uses. Like an
+// iterator, a cursor is invalidated by changes to the graph.
+class TripleCursor {
+    friend class KnowledgeGraph;
+private:
+    struct Pattern {
+        bool variable[3];
+        int value[3]; // variable index, or entity / label id of a constant
+    };
+    struct Level {
+        vector<int> candidates;
+        int next;
+    };
+
+    shared_ptr<TripleIndex> index; // the snapshot the query was planned against
+    const vector<string>* entityNames;
+    const vector<string>* labelNames;
+    vector<string> variableNames;
+    vector<bool> predicateVariable;
+    vector<Pattern> patterns;
+    vector<int> binding;        // -1 while unbound
+    vector<int> order;          // variables in binding order
+    vector<vector<int>> exact;  // per level: patterns fully bound by it, variable once
+    vector<vector<int>> verify; // per level: other patterns fully bound by it
+    vector<Level> levels;
+    vector<int> scratch;
+    bool started;
+    bool exhausted;
+
+    int variableIndex(string name, bool predicate);
+    int valueAt(const Pattern& pattern, int position);
+    double estimate(const Pattern& pattern, const vector<bool>& bound);
+    void plan();
+    void open(int depth);
+    bool check(int depth);
+
+public:
+    TripleCursor();
+
+    // Advances to the next solution; false once every solution has been returned
+    bool next();
+    vector<string> variables();
+    string get(string variable);
+    // The current binding of every variable, in the order of variables()
+    vector<string> row();
+};
+
+// =====================================
+// Class QueryOptions
+// =====================================
+// Shared flag: cancel() stops every running query holding a copy of the token
+class CancellationToken {
+private:
+    shared_ptr<atomic<bool>> flag;
+
+public:
+    CancellationToken();
+    void cancel();
+    bool cancelled() const;
+};
+
+// Limits on a single traversal, all off by default
+struct QueryOptions {
+    chrono::steady_clock::time_point deadline; // time_point::max() for none
+    long long maxVertices; // vertices visited, <= 0 for no limit
+    long long maxEdges;    // edges scanned, <= 0 for no limit
+    int maxResults;        // entities returned, <= 0 for no limit
+    CancellationToken token;
+
+    QueryOptions() : deadline(chrono::steady_clock::time_point::max()), maxVertices(0), maxEdges(0), maxResults(0) {}
+    // Sets the deadline 'milliseconds' from now
+    QueryOptions& timeout(long long milliseconds);
+};
+
+enum class TruncationReason {
+    NONE,
+    DEADLINE,
+    CANCELLED,
+    VERTEX_LIMIT,
+    EDGE_LIMIT,
+    RESULT_LIMIT
+};
+
+// When truncated, value holds what the traversal had found when it stopped
+template <class R>
+struct BoundedResult {
+    R value;
+    bool truncated;
+    TruncationReason reason;
+};
+
+// Tracks one traversal against its QueryOptions. The counters are compared on
+// every step, the clock and the token only once per CHECK_INTERVAL vertices.
+class QueryBudget {
+private:
+    const QueryOptions& options;
+    long long vertices;
+    long long edges;
+    int results;
+    TruncationReason reason_;
+
+public:
+    static const int CHECK_INTERVAL = 256;
+
+    QueryBudget(const QueryOptions& options);
+
+    // Each returns false once the traversal has to stop
+    bool visitVertex();
+    bool scanEdges(int count);
+    bool addResult();
+
+    bool exhausted();
+    TruncationReason reason();
+};
+
+// =====================================
+// Class ResultPage
+// =====================================
+struct ResultPage {
+    vector<string> entities;
+    string cursor; // opaque, pass to nextPage for the following page; "" after the last page
+};
+
+// Server-side state of a paged traversal: the BFS queue doubles as the frontier,
+// so resuming costs only the page being produced
+struct PageSession {
+    char kind;
+    string entity;
+    int depthLimit;
+    bool includeStart;
+    vector<VertexNode<string>*> queue;
+    vector<int> depths;
+    unordered_set<int> visited; // vertex ids queued so far
+    int head;
+    long long emitted;
+    unsigned long version;
+    chrono::steady_clock::time_point lastUsed;
+};
+
+// =====================================
+// Class ChangeFeed
+// =====================================
+enum class ChangeType : uint8_t {
+    ENTITY_ADDED,
+    RELATION_ADDED, // also sent when ParallelEdgePolicy::MERGE overwrote a weight
+    RELATION_REMOVED,
+    CLEARED
+};
+
+struct ChangeEvent {
+    unsigned long long sequence;
+    ChangeType type;
+    string from;  // the new entity for ENTITY_ADDED
+    string to;
+    string label; // "" for unlabelled relations
+    float weight;
+};
+
+// Append-only string table that readers index without locks while one writer
+// appends. Chunk k holds BASE << k strings, so published strings never move.
+class NameTable {
+private:
+    static const int BASE = 64;
+    static const int MAX_CHUNKS = 25;
+    atomic<string*> chunks[MAX_CHUNKS];
+    atomic<int> count_;
+    // ChangeFeed starts a new table on every clear; the one it replaced stays
+    // reachable here (atomic_load / atomic_store only) while events naming it
+    // may still be in the ring
+    int generation;
+    unsigned long long firstSequence; // first event that may name this table
+    shared_ptr<NameTable> older;
+
+    static void locate(int index, int& chunk, int& offset);
+
+public:
+    static const int CAPACITY = BASE * ((1 << MAX_CHUNKS) - 1); // ~2^31 strings
+
+    NameTable(int generation = 0, unsigned long long firstSequence = 1);
+    ~NameTable();
+
+    int append(const string& name); // writer only
+    const string& get(int index);   // any thread, for an index published to it
+    int count();
+    size_t memoryBytes();
+
+    friend class ChangeFeed;
+};
+
+// Bounded ring of graph mutations. One writer (the KnowledgeGraph, under the
+// same external locking its mutations already need) publishes events with
+// increasing sequence numbers from 1; any number of readers copy them out
+// without locks. Each slot is a seqlock: its sequence is zeroed while it is
+// rewritten, so a reader that lost a race against the writer sees a sequence
+// other than the one it asked for and reports an overrun instead of a torn event.
+class ChangeFeed {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    struct Slot {
+        atomic<unsigned long long> sequence; // 0 while being written
+        atomic<uint8_t> type;
+        atomic<int> from, to, label;         // NameTable indices, -1 when unused
+        atomic<int> generation;              // of the NameTable those indices refer to
+        atomic<float> weight;
+    };
+
+    unique_ptr<Slot[]> slots;
+    unsigned long long mask;
+    atomic<unsigned long long> head; // last published sequence
+    // Current name table (atomic_load / atomic_store only), replaced on CLEARED
+    // so a clear/reload cycle does not keep every earlier name
+    shared_ptr<NameTable> names;
+    // Writer-side maps into 'names', so each entity and label name is stored once
+    vector<int> entityNames; // vertex id -> name index, -1 until first used, reset by CLEARED
+    vector<int> labelNames;  // label id -> name index, -1 until first used, reset by CLEARED
+
+    int entityName(int id, const string& name);
+    int labelName(int label, const string& name);
+    void publish(ChangeType type, int from, int to, int label, float weight);
+    // The table of 'generation', null once the ring has moved past all its events
+    shared_ptr<NameTable> namesOf(int generation);
+
+public:
+    static const int DEFAULT_CAPACITY = 4096;
+
+    // Capacity is rounded up to a power of two
+    ChangeFeed(int capacity = DEFAULT_CAPACITY);
+
+    void entityAdded(int id, const string& name);
+    // Endpoints and label are given by id and name, so entities added before
+    // the feed existed get their names recorded on first use
+    void relationAdded(int from, const string& fromName, int to, const string& toName,
+                       int label, const string& labelName, float weight);
+    void relationRemoved(int from, const string& fromName, int to, const string& toName,
+                         int label, const string& labelName, float weight);
+    void cleared();
+
+    int capacity();
+    unsigned long long latestSequence(); // 0 before the first event
+    // Appends up to maxEvents events starting at fromSequence to 'out'; returns
+    // false if an event in that range was overwritten before it could be read
+    bool read(unsigned long long fromSequence, int maxEvents, vector<ChangeEvent>& out);
+    size_t memoryBytes();
+};
+
+// A reader's position in a ChangeFeed. After an overrun the events in between
+// are gone: rebuild from a snapshot taken after latestSequence() and subscribe
+// again from the sequence following it.
+class ChangeSubscription {
+private:
+    shared_ptr<ChangeFeed> feed;
+    unsigned long long next;
+    bool overrun_;
+
+public:
+    ChangeSubscription(shared_ptr<ChangeFeed> feed, unsigned long long next);
+
+    // Up to maxEvents new events, oldest first; empty when caught up
+    vector<ChangeEvent> poll(int maxEvents = 256);
+    bool overrun();
+    unsigned long long position(); // sequence of the next event to read
+};
+
+// =====================================
+// Struct KHopWatch
+// =====================================
+enum class WatchChange {
+    ENTERED,
+    LEFT,
+    DISTANCE_CHANGED
+};
+
+struct WatchDelta {
+    string entity;
+    WatchChange change;
+    int distance; // hops from the watched entity after the change, -1 for LEFT
+};
+
+// getRelatedEntities(entity, depth) kept current by KnowledgeGraph. Holds the
+// BFS distance of every vertex within 'depth' hops, the start included at 0.
+struct KHopWatch {
+    int start; // vertex id, -1 once clear() removed the entity
+    int depth;
+    unordered_map<int, int> distance;
+    vector<WatchDelta> pending; // until pollWatch
 };
 
 // =====================================
@@ -124,20 +1222,102 @@ class KnowledgeGraph {
 private:
     DGraphModel<string> graph;
     vector<string> entities;
+    EntityPrefixIndex prefixIndex;
+    // Lazily built snapshots (atomic_load / atomic_store only), replaced rather
+    // than rebuilt in place so concurrent readers keep the one they loaded
+    shared_ptr<TransitionMatrix> transitions;
+    shared_ptr<AliasTable> walkTable;
+    shared_ptr<TripleIndex> triples;
+    mutex cacheLock; // held while a stale snapshot is rebuilt
+
+    // Paged traversals survive between calls for SESSION_TTL_SECONDS; one that
+    // expired or was evicted is rebuilt by walking past the results already served
+    unordered_map<long long, PageSession> pageSessions;
+    long long nextPageSession;
+    mutex pageLock;
+    static const int SESSION_TTL_SECONDS = 60;
+    static const int MAX_PAGE_SESSIONS = 64;
+
+    // Null until the first subscribe or enableChangeFeed; shared with subscriptions
+    shared_ptr<ChangeFeed> feed;
+
+    unordered_map<int, KHopWatch> watches;
+    int nextWatch;
+    vector<vector<int>> watchers; // vertex id -> watches whose set holds it, grown on demand
 
     int getEntityIndex(string entity);
+    shared_ptr<TransitionMatrix> transitionMatrix();
+    shared_ptr<AliasTable> aliasTable();
+    // node2vec proposals rejected in a row before a step is drawn exactly instead
+    static const int MAX_WALK_REJECTIONS = 64;
+    // One walk from 'start' into 'walk'; the previous vertex biases each step unless p = q = 1
+    void randomWalk(AliasTable& table, int start, const RandomWalkOptions& options, uint64_t seed,
+                    vector<int>& walk);
+    shared_ptr<TripleIndex> tripleIndex();
+    vector<int> seedIds(vector<string>& seeds);
+    vector<RankedEntity> topRanked(vector<float>& rank, const vector<int>& seeds, int k, bool includeSeeds);
 
     // MANUALLY ADDED FUNCTION
-    vector<string> getAncestors(string start);
-    int bfsDistance(string start, string target);
+    // Label names -> sorted ids; labels never used are dropped
+    vector<int> labelFilter(vector<string>& labels);
+    // Neighbours of node through out- (or in-) edges, restricted to 'labels' unless null
+    void expand(VertexNode<string>* node, const vector<int>* labels, bool outward,
+                vector<VertexNode<string>*>& result);
+
+    // Scratch-based query bodies, shared by the public methods and QueryExecutor;
+    // a null 'budget' means unbounded.
+    // 'bounded' keeps the walk inside the vertices scratch.distanceA has reached
+    void collectAncestors(VertexNode<string>* start, TraversalScratch& scratch, const vector<int>* labels,
+                          bool bounded);
+    // Reverse BFS distances to entityOne into scratch.distanceA and to entityTwo into distanceB
+    void ancestorDistances(VertexNode<string>* entityOne, VertexNode<string>* entityTwo, TraversalScratch& scratch,
+                           const vector<int>* labels, QueryBudget* budget);
+    vector<string> getRelatedEntities(string entity, int depth, TraversalScratch& scratch,
+                                      const vector<int>* labels = nullptr, QueryBudget* budget = nullptr);
+    string findCommonAncestors(string entity1, string entity2, TraversalScratch& scratch,
+                               const vector<int>* labels = nullptr, QueryBudget* budget = nullptr);
+    // Plain BFS, used where the condensation does not apply or is stale
+    bool isReachable(string from, string to, TraversalScratch& scratch, const vector<int>* labels,
+                     QueryBudget* budget);
+    KHopWatch& findWatch(int watchId);
+    // Moves 'vertex' to 'distance' in the watch (entering it if new) or, with
+    // distance -1, drops it; queues the delta and keeps 'watchers' in step
+    void setWatchDistance(int watchId, KHopWatch& watch, int vertex, int distance);
+    // Incremental updates after the edge from -> to was added or removed
+    void watchEdgeAdded(VertexNode<string>* from, VertexNode<string>* to);
+    void watchEdgeRemoved(VertexNode<string>* from, VertexNode<string>* to);
+    // Builds the condensation up front so a batch of reachability queries walks
+    // it instead of falling back to BFS
+    void prepareConcurrentReads();
+
+    string encodeCursor(char kind, long long position, long long session, int depth, const string& entity);
+    void startPageSession(PageSession& session, char kind, string entity, int depthLimit, bool includeStart);
+    // Moves the session forward by up to 'count' results, appending them to 'out' if given
+    void advancePageSession(PageSession& session, long long count, vector<string>* out);
+    ResultPage traversalPage(char kind, string entity, int depth, long long offset, long long id, int pageSize);
+    ResultPage neighborsPage(string entity, long long position, int pageSize);
+    ResultPage allEntitiesPage(long long offset, int pageSize);
 public:
     KnowledgeGraph();
     
     void addEntity(string entity);
+    // Bulk load: the prefix index is rebuilt once instead of per entity
+    void addEntities(vector<string> newEntities);
     void addRelation(string from, string to, float weight = 1.0f);
+    void addRelation(string from, string to, string label, float weight = 1.0f);
+    // Removes one relation from -> to, the first added if there are parallel ones
+    void removeRelation(string from, string to);
+    // Removes one relation from -> to carrying 'label', the first added of those
+    void removeRelation(string from, string to, string label);
+    void clear();
+    void setParallelEdgePolicy(ParallelEdgePolicy policy);
+    vector<string> getRelationLabels();
     
     vector<string> getAllEntities();
     vector<string> getNeighbors(string entity);
+    vector<string> findByPrefix(string prefix, int limit = 10);
+    vector<string> findInRange(string from, string to, int limit = 10);
+    void rebuildPrefixIndex();
     
     string bfs(string start);
     string dfs(string start);
@@ -147,6 +1327,282 @@ public:
     
     vector<string> getRelatedEntities(string entity, int depth = 2);
     string findCommonAncestors(string entity1, string entity2);
+
+    int getComponentId(string entity);
+    bool hasCycle();
+    vector<string> getTopologicalOrder();
+    // Per-vertex entries are by position in getAllEntities()
+    TriangleCounts countTriangles(int threads = 0);
+
+    // Watches keep getRelatedEntities(entity, depth) current: each relation
+    // added or removed updates only the vertices whose distance it changes,
+    // and queues deltas until pollWatch. A watch outlives clear() with an
+    // empty set. Unknown watch ids throw InvalidQueryException. A negative depth
+    // counts as 0; any other depth, INT_MAX included, costs only what the
+    // watched set holds.
+    int watch(string entity, int depth);
+    void unwatch(int watchId);
+    vector<string> watchedEntities(int watchId); // nearest first
+    int watchDistance(int watchId, string entity); // -1 outside the set
+    vector<WatchDelta> pollWatch(int watchId);
+
+    // Label-restricted traversals: only edges whose label is listed are followed,
+    // "" stands for unlabelled relations
+    vector<string> getNeighbors(string entity, vector<string> labels);
+    string bfs(string start, vector<string> labels);
+    bool isReachable(string from, string to, vector<string> labels);
+    vector<string> getRelatedEntities(string entity, int depth, vector<string> labels);
+    string findCommonAncestors(string entity1, string entity2, vector<string> labels);
+
+    // Bounded traversals: stop at the deadline, a visit limit, the result limit
+    // or cancellation, and report whether the answer is partial. Named apart from
+    // the label overloads, which a braced {} argument could not be told from.
+    BoundedResult<string> bfsBounded(string start, QueryOptions options);
+    BoundedResult<string> dfsBounded(string start, QueryOptions options);
+    BoundedResult<bool> isReachableBounded(string from, string to, QueryOptions options);
+    BoundedResult<vector<string>> getRelatedEntitiesBounded(string entity, int depth, QueryOptions options);
+    BoundedResult<string> findCommonAncestorsBounded(string entity1, string entity2, QueryOptions options);
+
+    // Limit/offset variants; traversals still walk past the first 'offset' results.
+    // A negative offset or limit throws InvalidQueryException.
+    vector<string> getAllEntities(int offset, int limit);
+    vector<string> getNeighbors(string entity, int offset, int limit);
+    vector<string> getRelatedEntities(string entity, int depth, int offset, int limit);
+    vector<string> bfs(string start, int offset, int limit); // entity names in BFS order
+
+    // Cursor variants: the first page of each result, then nextPage until the
+    // cursor comes back empty. A cursor goes stale (InvalidQueryException) once
+    // the graph changes.
+    ResultPage pageAllEntities(int pageSize);
+    ResultPage pageNeighbors(string entity, int pageSize);
+    ResultPage pageRelatedEntities(string entity, int depth, int pageSize);
+    ResultPage pageBfs(string start, int pageSize);
+    ResultPage nextPage(string cursor, int pageSize);
+
+    // Conjunctive triple-pattern query, e.g. {("?x", "", "A"), ("?x", "", "B")}
+    // streams every ?x with relations to both A and B
+    TripleCursor query(vector<TriplePattern> patterns);
+
+    // Change feed: mutations are recorded from the first subscribe (or
+    // enableChangeFeed) on, so take any snapshot after subscribing. The
+    // capacity is fixed by whichever of the two comes first.
+    void enableChangeFeed(int capacity = ChangeFeed::DEFAULT_CAPACITY);
+    ChangeSubscription subscribe(); // from the next mutation
+    ChangeSubscription subscribe(unsigned long long fromSequence);
+    unsigned long long latestSequence();
+
+    // Bytes by category, including the entity list and every cached index
+    MemoryUsage memoryUsage();
+    void shrinkToFit();
+
+    // Read-only compressed copy of the current graph
+    CompressedGraph compress(CompressionOptions options = CompressionOptions());
+
+    // Top-k entities by random walk with restart to the given seed set
+    vector<RankedEntity> personalizedPageRank(vector<string> seeds, int k = 10,
+                                              PageRankOptions options = PageRankOptions());
+    // One independent ranking per seed, computed in parallel
+    vector<vector<RankedEntity>> personalizedPageRankBatch(vector<string> seeds, int k = 10,
+                                                           PageRankOptions options = PageRankOptions());
+
+    // DeepWalk/node2vec corpus: walksPerVertex walks from every entity, as
+    // entity ids (positions in getAllEntities()). Walks are generated in
+    // parallel and handed to 'sink' one call at a time, in no fixed order; each
+    // walk depends only on the seed and its index, not on the thread count.
+    // Returns the number of walks. If 'sink' throws, no further walks are
+    // handed to it and the exception is rethrown once every worker has stopped.
+    long long randomWalks(RandomWalkOptions options, function<void(const vector<int>&)> sink);
+    // The same walks, one per line as space-separated ids
+    long long writeRandomWalks(string path, RandomWalkOptions options = RandomWalkOptions());
+
+    friend class QueryExecutor;
+};
+
+// =====================================
+// Class QueryExecutor
+// =====================================
+enum class ReadQueryType {
+    NEIGHBORS,
+    RELATED_ENTITIES,
+    IS_REACHABLE,
+    COMMON_ANCESTORS
+};
+
+// One independent read request against a KnowledgeGraph
+struct ReadQuery {
+    ReadQueryType type;
+    string entity;
+    string other;   // target / second entity for IS_REACHABLE and COMMON_ANCESTORS
+    int depth;
+
+    static ReadQuery neighbors(string entity);
+    static ReadQuery relatedEntities(string entity, int depth = 2);
+    static ReadQuery reachable(string from, string to);
+    static ReadQuery commonAncestors(string entity1, string entity2);
+};
+
+struct ReadQueryResult {
+    vector<string> entities; // NEIGHBORS, RELATED_ENTITIES
+    bool reachable;          // IS_REACHABLE
+    string ancestor;         // COMMON_ANCESTORS
+    string error;            // what() of the exception when the query failed (runBatch only)
+
+    ReadQueryResult() : reachable(false) {}
+    bool ok() const { return error.empty(); }
+};
+
+// Work-stealing thread pool running read-only KnowledgeGraph queries in
+// parallel. Every worker owns a TraversalScratch that is reused across
+// queries. The graph must not be mutated while queries are in flight.
+class QueryExecutor {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    typedef function<void(TraversalScratch&)> Task;
+
+    struct Worker {
+        deque<Task> tasks;
+        mutex lock;
+        TraversalScratch scratch;
+        thread runner;
+    };
+
+    KnowledgeGraph& graph;
+    vector<Worker*> workers;
+    atomic<bool> stopping;
+    atomic<int> pendingTasks;
+    atomic<unsigned> nextWorker;
+    mutex sleepLock;
+    condition_variable wakeUp;
+
+    void enqueue(Task task);
+    bool takeTask(int self, Task& task);
+    void workerLoop(int self);
+    ReadQueryResult execute(const ReadQuery& query, TraversalScratch& scratch);
+
+public:
+    // threads <= 0 uses one worker per hardware thread
+    QueryExecutor(KnowledgeGraph& graph, int threads = 0);
+    ~QueryExecutor();
+
+    int threadCount();
+    future<ReadQueryResult> submit(ReadQuery query);
+    // Runs every query and returns the results in input order; failures are reported in error
+    vector<ReadQueryResult> runBatch(const vector<ReadQuery>& queries);
+};
+
+// =====================================
+// Class ShardedKnowledgeGraph
+// =====================================
+// Moves serialized messages between endpoints 0 .. endpointCount() - 1. Only
+// bytes cross it, so a transport over local sockets can replace the in-process one.
+class ShardTransport {
+public:
+    virtual ~ShardTransport() {}
+    virtual int endpointCount() = 0;
+    virtual void send(int endpoint, const vector<uint8_t>& message) = 0;
+    // Blocks until a message for 'endpoint' arrives
+    virtual vector<uint8_t> receive(int endpoint) = 0;
+};
+
+class InProcessTransport : public ShardTransport {
+private:
+    struct Mailbox {
+        mutex lock;
+        condition_variable ready;
+        deque<vector<uint8_t>> messages;
+    };
+    vector<Mailbox*> mailboxes;
+
+public:
+    InProcessTransport(int endpoints);
+    ~InProcessTransport();
+
+    int endpointCount();
+    void send(int endpoint, const vector<uint8_t>& message);
+    vector<uint8_t> receive(int endpoint);
+};
+
+// Wire format between shard workers: a type byte followed by varint integers
+// and length-prefixed strings. Reads are bounds-checked, a short message
+// throws StorageException.
+class ShardMessage {
+private:
+    vector<uint8_t> data;
+    size_t position;
+
+public:
+    enum Type { QUERY = 1, FRONTIER, VOTE, RESULT, SHUTDOWN };
+
+    ShardMessage(Type type);
+    ShardMessage(const vector<uint8_t>& bytes);
+
+    Type type();
+    const vector<uint8_t>& bytes();
+    void putInt(uint64_t value);
+    void putString(const string& value);
+    uint64_t getInt();
+    string getString();
+};
+
+// One partition: the entities hashed to it plus stub vertices standing in for
+// the targets of its cross-shard edges. A stub is never expanded locally; the
+// traversal hands it to the owning shard instead.
+struct GraphShard {
+    DGraphModel<string> graph;
+    vector<int> owner;    // per local vertex id: owning shard
+    vector<int> remoteId; // per local vertex id: vertex id on the owning shard
+    mutex lock;
+};
+
+// Entities hash-partitioned over shards, each with its own DGraphModel, lock
+// and worker thread. Traversals run bulk-synchronously: in every superstep each
+// worker expands its part of the frontier, sends the stubs it reached to their
+// owners, then all workers exchange how much frontier they have left. Results
+// come back level by level, within a level by shard and then discovery order.
+class ShardedKnowledgeGraph {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    enum QueryKind { TRAVERSE = 0, REACH = 1 };
+
+    int shardCount;
+    vector<GraphShard*> shards;
+    ShardTransport* transport; // endpoints 0 .. shardCount - 1 are shards, shardCount the coordinator
+    bool ownsTransport;
+    vector<thread> workers;
+    mutex queryLock;
+    uint64_t nextQuery;
+
+    void workerLoop(int self);
+    void runQuery(int self, ShardMessage& query, vector<vector<uint8_t>>& stash);
+    // Next message of 'type' for (query, step), stashing anything that arrives early
+    ShardMessage awaitMessage(int self, ShardMessage::Type type, uint64_t query, uint64_t step,
+                              vector<vector<uint8_t>>& stash);
+    // 'target' is only sent, and only matched, for REACH queries
+    vector<pair<int, string>> traverse(QueryKind kind, string start, string target, int depthLimit, bool& found);
+
+public:
+    static const int DEFAULT_SHARDS = 4;
+
+    ShardedKnowledgeGraph(int shards = DEFAULT_SHARDS);
+    // 'transport' needs shards + 1 endpoints (StorageException otherwise) and is not owned
+    ShardedKnowledgeGraph(int shards, ShardTransport* transport);
+    ~ShardedKnowledgeGraph();
+
+    int getShardCount();
+    int shardOf(string entity);
+
+    void addEntity(string entity);
+    void addRelation(string from, string to, float weight = 1.0f);
+    bool contains(string entity);
+    vector<string> getNeighbors(string entity);
+
+    vector<string> bfs(string start);
+    bool isReachable(string from, string to);
+    vector<string> getRelatedEntities(string entity, int depth = 2);
 };
 
 template <class T>
@@ -186,6 +1642,9 @@ class Set {
         string (*item2Str)(T&);
         bool (*itemEQ)(T&, T&);
         unsigned long hashFunction(string str);
+        // item2Str when given, so hashing agrees with a custom itemEQ; VertexHash otherwise
+        unsigned long bucketOf(T& item);
+        bool bucketContains(unsigned long index, T& item);
     public:
         Set(int capacity, string (*item2Str)(T&),bool (*itemEQ)(T&, T&));
         void insert(T item);
@@ -3,10 +3,29 @@
 
 #include <iostream>
 #include <sstream>
+#include <fstream>
 #include <string>
 #include <stdexcept>
 #include <cmath>
+#include <climits>
 #include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <algorithm>
+#include <deque>
+#include <set>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <memory>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "utils.h"
 
 using namespace std;
@@ -27,6 +46,12 @@ public:
     explicit EdgeNotFoundException(const std::string& what_arg) : std::logic_error(what_arg) {}
 };
 
+class EdgeExistsException : public std::logic_error {
+public:
+    EdgeExistsException() : std::logic_error("Edge already exists!") {}
+    explicit EdgeExistsException(const std::string& what_arg) : std::logic_error(what_arg) {}
+};
+
 // =============================================================================
 // KNOWLEDGE GRAPH EXCEPTIONS
 // =============================================================================
@@ -43,5 +68,21 @@ public:
     explicit EntityNotFoundException(const std::string& what_arg) : std::logic_error(what_arg) {}
 };
 
+class InvalidQueryException : public std::logic_error {
+public:
+    InvalidQueryException() : std::logic_error("Invalid query!") {}
+    explicit InvalidQueryException(const std::string& what_arg) : std::logic_error(what_arg) {}
+};
+
+// =============================================================================
+// STORAGE EXCEPTIONS
+// =============================================================================
+
+class StorageException : public std::runtime_error {
+public:
+    StorageException() : std::runtime_error("Storage error!") {}
+    explicit StorageException(const std::string& what_arg) : std::runtime_error(what_arg) {}
+};
+
 
 #endif // __MAIN_H__
@@ -0,0 +1,1283 @@
+#include "KnowledgeGraph.h"
+#include <map>
+#include <random>
+
+// Randomized cross-checks: every component is run against a brute-force or
+// otherwise independent oracle on many small random graphs. Build next to
+// main.cpp, once with ASan/UBSan and once with TSan for the concurrent checks:
+//   g++ -std=c++17 -g -O1 -fsanitize=address,undefined tests.cpp KnowledgeGraph.cpp -o tests -lpthread
+//   g++ -std=c++17 -g -O1 -fsanitize=thread tests.cpp KnowledgeGraph.cpp -o tests-tsan -lpthread
+// ./tests runs every check, ./tests <name>... only the named ones.
+
+class CheckFailure : public std::runtime_error {
+public:
+    CheckFailure(const string& condition, int line)
+        : std::runtime_error("line " + to_string(line) + ": " + condition) {}
+};
+
+#define CHECK(condition) \
+    do { if (!(condition)) throw CheckFailure(#condition, __LINE__); } while (0)
+
+#define CHECK_THROWS(statement, exception) \
+    do { \
+        bool thrown = false; \
+        try { statement; } catch (exception&) { thrown = true; } \
+        if (!thrown) throw CheckFailure(#statement " throws " #exception, __LINE__); \
+    } while (0)
+
+// =============================================================================
+// Oracle
+// =============================================================================
+
+static string entityName(int id) {
+    return "e" + to_string(id);
+}
+
+// Plain adjacency lists kept next to the graph under test. Out-edges keep
+// insertion order and each self-loop appears once.
+struct Mirror {
+    struct Arc {
+        int to;
+        string label;
+    };
+    vector<vector<Arc>> out;
+
+    Mirror(int n = 0) : out(n) {}
+
+    int size() { return out.size(); }
+    int edgeCount() {
+        int count = 0;
+        for (vector<Arc>& arcs : out) count += arcs.size();
+        return count;
+    }
+    void add(int from, int to, string label = "") { out[from].push_back(Arc{to, label}); }
+    // Drops the first from -> to, restricted to 'label' unless null; false if none
+    bool remove(int from, int to, const string* label = nullptr) {
+        for (size_t i = 0; i < out[from].size(); i++) {
+            Arc& arc = out[from][i];
+            if (arc.to != to || (label != nullptr && arc.label != *label)) continue;
+            out[from].erase(out[from].begin() + i);
+            return true;
+        }
+        return false;
+    }
+    // BFS hop counts from 'start' (-1 unreached), over out-edges or reversed ones,
+    // following only 'labels' unless null
+    vector<int> distances(int start, int depth = INT_MAX, bool reverse = false,
+                          const set<string>* labels = nullptr) {
+        vector<vector<int>> adjacent(size());
+        for (int v = 0; v < size(); v++) {
+            for (Arc& arc : out[v]) {
+                if (labels != nullptr && !labels->count(arc.label)) continue;
+                if (reverse) adjacent[arc.to].push_back(v);
+                else adjacent[v].push_back(arc.to);
+            }
+        }
+        vector<int> distance(size(), -1);
+        vector<int> queue(1, start);
+        distance[start] = 0;
+        for (size_t head = 0; head < queue.size(); head++) {
+            int v = queue[head];
+            if (distance[v] >= depth) continue;
+            for (int w : adjacent[v]) {
+                if (distance[w] != -1) continue;
+                distance[w] = distance[v] + 1;
+                queue.push_back(w);
+            }
+        }
+        return distance;
+    }
+    bool reaches(int from, int to) { return distances(from)[to] != -1; }
+    // Visit order of a BFS that expands out-edges in insertion order
+    vector<string> bfsOrder(int start) {
+        vector<bool> seen(size(), false);
+        vector<int> queue(1, start);
+        seen[start] = true;
+        for (size_t head = 0; head < queue.size(); head++) {
+            for (Arc& arc : out[queue[head]]) {
+                if (seen[arc.to]) continue;
+                seen[arc.to] = true;
+                queue.push_back(arc.to);
+            }
+        }
+        vector<string> names;
+        for (int v : queue) names.push_back(entityName(v));
+        return names;
+    }
+    // Names within 1 .. depth hops, as a set
+    set<string> related(int start, int depth) {
+        vector<int> distance = distances(start, depth);
+        set<string> names;
+        for (int v = 0; v < size(); v++) {
+            if (v != start && distance[v] != -1) names.insert(entityName(v));
+        }
+        return names;
+    }
+    multiset<string> neighbors(int v) {
+        multiset<string> names;
+        for (Arc& arc : out[v]) names.insert(entityName(arc.to));
+        return names;
+    }
+};
+
+// n entities e0 .. e(n-1) and m random relations, mirrored; labels drawn from 'labels' if given
+static void randomGraph(KnowledgeGraph& graph, Mirror& mirror, int n, int m, mt19937& rng,
+                        const vector<string>& labels = vector<string>()) {
+    mirror = Mirror(n);
+    for (int v = 0; v < n; v++) graph.addEntity(entityName(v));
+    for (int i = 0; i < m; i++) {
+        int from = rng() % n, to = rng() % n;
+        string label = labels.empty() ? "" : labels[rng() % labels.size()];
+        graph.addRelation(entityName(from), entityName(to), label, 1.0f + rng() % 3);
+        mirror.add(from, to, label);
+    }
+}
+
+template <class C>
+static set<string> asSet(const C& names) {
+    return set<string>(names.begin(), names.end());
+}
+
+template <class C>
+static multiset<string> asMultiset(const C& names) {
+    return multiset<string>(names.begin(), names.end());
+}
+
+// "[a, b, c]" as printed by DGraphModel::BFS / DFS
+static vector<string> splitPrinted(string printed) {
+    vector<string> names;
+    printed = printed.substr(1, printed.size() - 2);
+    size_t start = 0;
+    while (start < printed.size()) {
+        size_t comma = printed.find(", ", start);
+        if (comma == string::npos) comma = printed.size();
+        names.push_back(printed.substr(start, comma - start));
+        start = comma + 2;
+    }
+    return names;
+}
+
+// =============================================================================
+// Checks
+// =============================================================================
+
+static void checkEdgeIndex() {
+    mt19937 rng(26);
+    for (int trial = 0; trial < 20; trial++) {
+        DGraphModel<int> graph;
+        graph.setEdgeIndexThreshold(1 + trial % 4);
+        int n = 2 + rng() % 12;
+        for (int v = 0; v < n; v++) graph.add(v);
+        vector<vector<pair<int, float>>> out(n);
+        for (int op = 0; op < 200; op++) {
+            int from = rng() % n, to = rng() % n;
+            if (rng() % 3 != 0) {
+                float weight = rng() % 10;
+                graph.connect(from, to, weight);
+                out[from].push_back(make_pair(to, weight));
+                continue;
+            }
+            auto first = find_if(out[from].begin(), out[from].end(),
+                                 [to](const pair<int, float>& arc) { return arc.first == to; });
+            if (first == out[from].end()) {
+                // removing a missing edge leaves the vertex untouched
+                graph.disconnect(from, to);
+                CHECK(graph.outDegree(from) == (int)out[from].size());
+                continue;
+            }
+            graph.disconnect(from, to);
+            out[from].erase(first);
+        }
+        for (int from = 0; from < n; from++) {
+            CHECK(graph.outDegree(from) == (int)out[from].size());
+            for (int to = 0; to < n; to++) {
+                auto first = find_if(out[from].begin(), out[from].end(),
+                                     [to](const pair<int, float>& arc) { return arc.first == to; });
+                CHECK(graph.connected(from, to) == (first != out[from].end()));
+                if (first != out[from].end()) CHECK(graph.weight(from, to) == first->second);
+            }
+        }
+    }
+
+    DGraphModel<int> graph;
+    graph.add(0);
+    graph.add(1);
+    graph.setParallelEdgePolicy(ParallelEdgePolicy::MERGE);
+    graph.connect(0, 1, 1);
+    graph.connect(0, 1, 5);
+    CHECK(graph.outDegree(0) == 1 && graph.weight(0, 1) == 5);
+    graph.setParallelEdgePolicy(ParallelEdgePolicy::REJECT);
+    CHECK_THROWS(graph.connect(0, 1, 2), EdgeExistsException);
+}
+
+static void checkTraversalLayout() {
+    mt19937 rng(27);
+    for (int trial = 0; trial < 20; trial++) {
+        DGraphModel<string> graph(nullptr, [](string& vertex) { return vertex; });
+        int n = 1 + rng() % 40;
+        for (int v = 0; v < n; v++) graph.add(entityName(v));
+        int m = rng() % (4 * n);
+        for (int i = 0; i < m; i++) graph.connect(entityName(rng() % n), entityName(rng() % n), 1);
+        for (VertexOrdering ordering : {VertexOrdering::INSERTION, VertexOrdering::DEGREE,
+                                        VertexOrdering::CUTHILL_MCKEE}) {
+            TraversalLayout<string> layout = graph.buildTraversalLayout(ordering);
+            CHECK(layout.size() == n);
+            for (int v = 0; v < n; v++) {
+                vector<string> bfs, dfs;
+                for (int id : layout.bfs(v)) bfs.push_back(layout.vertex(id));
+                for (int id : layout.dfs(v)) dfs.push_back(layout.vertex(id));
+                CHECK(bfs == splitPrinted(graph.BFS(entityName(v))));
+                CHECK(dfs == splitPrinted(graph.DFS(entityName(v))));
+                CHECK((int)layout.neighbors(v).size() == graph.outDegree(entityName(v)));
+            }
+        }
+    }
+}
+
+static void checkCondensation() {
+    mt19937 rng(28);
+    for (int trial = 0; trial < 30; trial++) {
+        KnowledgeGraph graph;
+        Mirror mirror;
+        int n = 1 + rng() % 25;
+        randomGraph(graph, mirror, n, rng() % (2 * n), rng);
+        for (int round = 0; round < 4; round++) {
+            vector<vector<bool>> reach(n, vector<bool>(n));
+            for (int a = 0; a < n; a++) {
+                for (int b = 0; b < n; b++) reach[a][b] = mirror.reaches(a, b);
+            }
+            bool cyclic = false;
+            for (int a = 0; a < n; a++) {
+                for (Mirror::Arc& arc : mirror.out[a]) cyclic = cyclic || arc.to == a;
+                for (int b = 0; b < n; b++) {
+                    // alternate the cached walk and the BFS fallback
+                    if ((a + b) % 2 == 0) graph.getComponentId(entityName(a));
+                    CHECK(graph.isReachable(entityName(a), entityName(b)) == reach[a][b]);
+                    bool together = reach[a][b] && reach[b][a];
+                    CHECK((graph.getComponentId(entityName(a)) == graph.getComponentId(entityName(b))) == together);
+                    cyclic = cyclic || (a != b && together);
+                }
+            }
+            CHECK(graph.hasCycle() == cyclic);
+
+            vector<string> order = graph.getTopologicalOrder();
+            CHECK((int)order.size() == n);
+            map<string, int> position;
+            for (int i = 0; i < n; i++) position[order[i]] = i;
+            for (int a = 0; a < n; a++) {
+                for (Mirror::Arc& arc : mirror.out[a]) {
+                    int from = graph.getComponentId(entityName(a)), to = graph.getComponentId(entityName(arc.to));
+                    CHECK(from <= to);
+                    if (from != to) CHECK(position[entityName(a)] < position[entityName(arc.to)]);
+                }
+            }
+
+            for (int i = 0; i < 3; i++) {
+                int from = rng() % n, to = rng() % n;
+                graph.addRelation(entityName(from), entityName(to));
+                mirror.add(from, to);
+            }
+            int from = rng() % n;
+            if (!mirror.out[from].empty()) {
+                int to = mirror.out[from][0].to;
+                graph.removeRelation(entityName(from), entityName(to));
+                mirror.remove(from, to);
+            }
+        }
+    }
+}
+
+static void checkQueryExecutor() {
+    mt19937 rng(29);
+    KnowledgeGraph graph;
+    Mirror mirror;
+    int n = 300;
+    randomGraph(graph, mirror, n, 3 * n, rng);
+    vector<ReadQuery> queries;
+    for (int i = 0; i < 200; i++) {
+        string a = entityName(rng() % n), b = entityName(rng() % n);
+        switch (i % 4) {
+            case 0: queries.push_back(ReadQuery::neighbors(a)); break;
+            case 1: queries.push_back(ReadQuery::relatedEntities(a, 1 + i % 3)); break;
+            case 2: queries.push_back(ReadQuery::reachable(a, b)); break;
+            default: queries.push_back(ReadQuery::commonAncestors(a, b)); break;
+        }
+    }
+    queries.push_back(ReadQuery::neighbors("missing"));
+
+    for (int threads : {1, 2, 4}) {
+        QueryExecutor executor(graph, threads);
+        vector<ReadQueryResult> results = executor.runBatch(queries);
+        CHECK(results.size() == queries.size());
+        for (size_t i = 0; i + 1 < queries.size(); i++) {
+            ReadQuery& query = queries[i];
+            ReadQueryResult& result = results[i];
+            CHECK(result.ok());
+            int entity = stoi(query.entity.substr(1));
+            switch (query.type) {
+                case ReadQueryType::NEIGHBORS:
+                    CHECK(result.entities == graph.getNeighbors(query.entity));
+                    break;
+                case ReadQueryType::RELATED_ENTITIES:
+                    CHECK(asSet(result.entities) == mirror.related(entity, query.depth));
+                    CHECK(result.entities == graph.getRelatedEntities(query.entity, query.depth));
+                    break;
+                case ReadQueryType::IS_REACHABLE:
+                    CHECK(result.reachable == mirror.reaches(entity, stoi(query.other.substr(1))));
+                    break;
+                case ReadQueryType::COMMON_ANCESTORS:
+                    CHECK(result.ancestor == graph.findCommonAncestors(query.entity, query.other));
+                    break;
+            }
+        }
+        CHECK(!results.back().ok());
+
+        vector<future<ReadQueryResult>> pending;
+        for (int i = 0; i < 20; i++) pending.push_back(executor.submit(queries[i]));
+        for (int i = 0; i < 20; i++) {
+            ReadQueryResult result = pending[i].get();
+            CHECK(result.entities == results[i].entities && result.reachable == results[i].reachable
+                  && result.ancestor == results[i].ancestor);
+        }
+        future<ReadQueryResult> missing = executor.submit(ReadQuery::neighbors("missing"));
+        CHECK_THROWS(missing.get(), EntityNotFoundException);
+    }
+}
+
+// Several threads read while the lazily built caches (condensation, transition
+// matrix, alias table, triple index) are stale; meant for the TSan build
+static void checkConcurrentReaders() {
+    mt19937 rng(290);
+    KnowledgeGraph graph;
+    Mirror mirror;
+    int n = 120;
+    randomGraph(graph, mirror, n, 2 * n, rng, {"", "a", "b"});
+    for (int round = 0; round < 6; round++) {
+        int from = rng() % n, to = rng() % n;
+        graph.addRelation(entityName(from), entityName(to), "a");
+        mirror.add(from, to, "a");
+
+        vector<pair<int, int>> pairs;
+        for (int i = 0; i < 20; i++) pairs.push_back(make_pair(rng() % n, rng() % n));
+        vector<bool> reach;
+        for (pair<int, int>& query : pairs) reach.push_back(mirror.reaches(query.first, query.second));
+        vector<RankedEntity> rankedAlone = graph.personalizedPageRank({entityName(0)}, 5);
+        // built before the readers so they start from a stale or fresh cache alike
+        if (round % 2) graph.getComponentId(entityName(0));
+
+        atomic<int> failures(0);
+        vector<thread> readers;
+        for (int t = 0; t < 4; t++) {
+            readers.push_back(thread([&, t]() {
+                try {
+                    for (size_t i = 0; i < pairs.size(); i++) {
+                        bool got = graph.isReachable(entityName(pairs[i].first), entityName(pairs[i].second));
+                        if (got != reach[i]) failures++;
+                    }
+                    if (t % 2 == 0) graph.hasCycle();
+                    vector<RankedEntity> ranked = graph.personalizedPageRank({entityName(0)}, 5);
+                    if (ranked.size() != rankedAlone.size()) failures++;
+                    for (size_t i = 0; i < ranked.size() && i < rankedAlone.size(); i++) {
+                        if (ranked[i].entity != rankedAlone[i].entity) failures++;
+                    }
+                    RandomWalkOptions walks;
+                    walks.walkLength = 5;
+                    walks.walksPerVertex = 1;
+                    walks.threads = 1;
+                    long long count = graph.randomWalks(walks, [](const vector<int>&) {});
+                    if (count != n) failures++;
+                    TripleCursor cursor = graph.query({TriplePattern("?x", "a", "?y")});
+                    int rows = 0;
+                    while (cursor.next()) rows++;
+                    if (rows == 0) failures++;
+                }
+                catch (...) {
+                    failures++;
+                }
+            }));
+        }
+        for (thread& reader : readers) reader.join();
+        CHECK(failures == 0);
+    }
+}
+
+static void checkCompressedGraph() {
+    mt19937 rng(30);
+    for (int trial = 0; trial < 20; trial++) {
+        KnowledgeGraph graph;
+        Mirror mirror;
+        int n = 1 + rng() % 40;
+        randomGraph(graph, mirror, n, rng() % (4 * n), rng);
+        // self-loops are encoded once
+        graph.addRelation(entityName(0), entityName(0));
+        mirror.add(0, 0);
+        CompressedGraph compressed = graph.compress();
+        CHECK(compressed.size() == n);
+        CHECK(compressed.edgeCount() == mirror.edgeCount());
+        CHECK(compressed.getAllEntities() == graph.getAllEntities());
+        vector<int> inDegree(n, 0);
+        for (int v = 0; v < n; v++) {
+            for (Mirror::Arc& arc : mirror.out[v]) inDegree[arc.to]++;
+        }
+        for (int v = 0; v < n; v++) {
+            string name = entityName(v);
+            CHECK(compressed.outDegree(name) == (int)mirror.out[v].size());
+            CHECK(asMultiset(compressed.getNeighbors(name)) == mirror.neighbors(v));
+            CHECK((int)compressed.getInNeighbors(name).size() == inDegree[v]);
+            CHECK(asSet(compressed.getRelatedEntities(name, 2)) == mirror.related(v, 2));
+            int other = rng() % n;
+            CHECK(compressed.isReachable(name, entityName(other)) == mirror.reaches(v, other));
+            vector<int> distance = mirror.distances(v);
+            CHECK((int)compressed.bfs(name).size() == (int)count_if(distance.begin(), distance.end(),
+                                                                    [](int d) { return d != -1; }));
+        }
+    }
+
+    CompressedGraphBuilder builder;
+    for (int v = 0; v < 3; v++) builder.addEntity(entityName(v));
+    builder.addRelation(entityName(0), entityName(1), 2.5f);
+    builder.addRelation(entityName(2), entityName(0), 7.0f);
+    CompressedGraph compressed = builder.build();
+    CHECK(compressed.weight(entityName(0), entityName(1)) == 2.5f);
+    CHECK(compressed.weight(entityName(2), entityName(0)) == 7.0f);
+}
+
+static void checkPagedGraph() {
+    mt19937 rng(31);
+    const string path = "tests-paged.kgp";
+    KnowledgeGraph graph;
+    Mirror mirror;
+    int n = 400;
+    randomGraph(graph, mirror, n, 4 * n, rng);
+    // a hub whose record spans several pages
+    for (int i = 0; i < 300; i++) graph.addRelation(entityName(0), entityName(rng() % n));
+    CompressedGraph compressed = graph.compress();
+    PagedGraphWriter::write(compressed, path, 256);
+    {
+        PagedKnowledgeGraph paged(path, 8 * 256);
+        CHECK(paged.size() == n && paged.edgeCount() == compressed.edgeCount());
+        for (int v = 0; v < n; v += 3) {
+            string name = entityName(v), other = entityName(rng() % n);
+            CHECK(paged.getNeighbors(name) == compressed.getNeighbors(name));
+            CHECK(paged.bfs(name) == compressed.bfs(name));
+            CHECK(paged.getRelatedEntities(name, 2) == compressed.getRelatedEntities(name, 2));
+            CHECK(paged.isReachable(name, other) == compressed.isReachable(name, other));
+        }
+        PageCacheStats stats = paged.cacheStats();
+        CHECK(stats.hits + stats.misses > 0);
+    }
+
+    // every truncated copy is rejected rather than read past its end
+    ifstream in(path, ios::binary);
+    vector<char> full((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    in.close();
+    for (size_t cut = 1; cut < full.size(); cut += 1 + cut / 8) {
+        ofstream out(path, ios::binary | ios::trunc);
+        out.write(full.data(), full.size() - cut);
+        out.close();
+        CHECK_THROWS(PagedKnowledgeGraph truncated(path), StorageException);
+    }
+    remove(path.c_str());
+    CHECK_THROWS(PagedKnowledgeGraph missing(path), StorageException);
+}
+
+static void checkPersonalizedPageRank() {
+    mt19937 rng(32);
+    for (int trial = 0; trial < 15; trial++) {
+        KnowledgeGraph graph;
+        int n = 2 + rng() % 20;
+        for (int v = 0; v < n; v++) graph.addEntity(entityName(v));
+        vector<vector<pair<int, double>>> out(n);
+        int m = rng() % (3 * n);
+        for (int i = 0; i < m; i++) {
+            int from = rng() % n, to = rng() % n;
+            float weight = (rng() % 4) * 0.5f;
+            graph.addRelation(entityName(from), entityName(to), weight);
+            out[from].push_back(make_pair(to, (double)weight));
+        }
+
+        int seed = rng() % n;
+        PageRankOptions options;
+        options.tolerance = 1e-7f;
+        options.maxIterations = 1000;
+        options.includeSeeds = true;
+
+        // dense power iteration in double: dangling mass and restarts go to the seed
+        const double damping = options.damping;
+        vector<double> rank(n, 0), next(n);
+        rank[seed] = 1;
+        for (int iteration = 0; iteration < 2000; iteration++) {
+            fill(next.begin(), next.end(), 0.0);
+            double dangling = 0;
+            for (int u = 0; u < n; u++) {
+                if (out[u].empty()) {
+                    dangling += rank[u];
+                    continue;
+                }
+                double total = 0;
+                for (auto& arc : out[u]) total += arc.second;
+                for (auto& arc : out[u]) {
+                    double share = (total > 0) ? arc.second / total : 1.0 / out[u].size();
+                    next[arc.first] += damping * share * rank[u];
+                }
+            }
+            next[seed] += (1 - damping) + damping * dangling;
+            rank.swap(next);
+        }
+
+        vector<RankedEntity> ranked = graph.personalizedPageRank({entityName(seed)}, n, options);
+        for (size_t i = 0; i < ranked.size(); i++) {
+            int v = stoi(ranked[i].entity.substr(1));
+            CHECK(fabs(ranked[i].score - rank[v]) < 1e-4);
+            if (i > 0) CHECK(ranked[i - 1].score >= ranked[i].score);
+        }
+        int positive = count_if(rank.begin(), rank.end(), [](double r) { return r > 1e-6; });
+        CHECK((int)ranked.size() >= positive);
+
+        vector<string> seeds;
+        for (int i = 0; i < 4; i++) seeds.push_back(entityName(rng() % n));
+        vector<vector<RankedEntity>> batch = graph.personalizedPageRankBatch(seeds, 3);
+        for (size_t i = 0; i < seeds.size(); i++) {
+            vector<RankedEntity> single = graph.personalizedPageRank({seeds[i]}, 3);
+            CHECK(batch[i].size() == single.size());
+            for (size_t j = 0; j < single.size(); j++) CHECK(batch[i][j].entity == single[j].entity);
+        }
+    }
+}
+
+static void checkPrefixIndex() {
+    mt19937 rng(33);
+    auto randomName = [&rng]() {
+        string name;
+        int length = 1 + rng() % 8;
+        for (int i = 0; i < length; i++) name += char('a' + rng() % 4);
+        return name;
+    };
+    KnowledgeGraph graph;
+    set<string> names;
+    vector<string> bulk;
+    while (bulk.size() < 1000) {
+        string name = randomName();
+        if (names.insert(name).second) bulk.push_back(name);
+    }
+    graph.addEntities(bulk);
+    for (int i = 0; i < 3000; i++) {
+        string name = randomName();
+        if (names.insert(name).second) graph.addEntity(name);
+        if (i % 61 != 0) continue;
+
+        string prefix = randomName().substr(0, 1 + rng() % 3);
+        int limit = 1 + rng() % 40;
+        vector<string> expected;
+        for (auto it = names.lower_bound(prefix);
+             it != names.end() && it->compare(0, prefix.size(), prefix) == 0 && (int)expected.size() < limit; ++it) {
+            expected.push_back(*it);
+        }
+        CHECK(graph.findByPrefix(prefix, limit) == expected);
+
+        string low = randomName(), high = randomName();
+        if (low > high) swap(low, high);
+        expected.clear();
+        for (auto it = names.lower_bound(low); it != names.end() && *it < high && (int)expected.size() < limit; ++it) {
+            expected.push_back(*it);
+        }
+        CHECK(graph.findInRange(low, high, limit) == expected);
+    }
+}
+
+static void checkLabelledRelations() {
+    mt19937 rng(34);
+    vector<string> labels = {"", "isA", "partOf"};
+    for (int trial = 0; trial < 30; trial++) {
+        KnowledgeGraph graph;
+        Mirror mirror;
+        int n = 2 + rng() % 30;
+        randomGraph(graph, mirror, n, rng() % (4 * n), rng, labels);
+        for (int op = 0; op < 40; op++) {
+            int from = rng() % n;
+            if (mirror.out[from].empty() || rng() % 2) {
+                int to = rng() % n;
+                string label = labels[rng() % labels.size()];
+                graph.addRelation(entityName(from), entityName(to), label);
+                mirror.add(from, to, label);
+                continue;
+            }
+            Mirror::Arc arc = mirror.out[from][rng() % mirror.out[from].size()];
+            if (rng() % 2) {
+                graph.removeRelation(entityName(from), entityName(arc.to), arc.label);
+                mirror.remove(from, arc.to, &arc.label);
+            }
+            else {
+                graph.removeRelation(entityName(from), entityName(arc.to));
+                mirror.remove(from, arc.to);
+            }
+        }
+
+        set<string> filter;
+        for (string& label : labels) {
+            if (rng() % 2) filter.insert(label);
+        }
+        vector<string> filterList(filter.begin(), filter.end());
+        for (int v = 0; v < n; v++) {
+            string name = entityName(v);
+            multiset<string> expected;
+            for (Mirror::Arc& arc : mirror.out[v]) {
+                if (filter.count(arc.label)) expected.insert(entityName(arc.to));
+            }
+            CHECK(asSet(graph.getNeighbors(name, filterList)) == asSet(expected));
+            CHECK(asSet(graph.getNeighbors(name)) == asSet(mirror.neighbors(v)));
+            vector<int> distance = mirror.distances(v, 2, false, &filter);
+            set<string> related;
+            for (int w = 0; w < n; w++) {
+                if (w != v && distance[w] != -1) related.insert(entityName(w));
+            }
+            CHECK(asSet(graph.getRelatedEntities(name, 2, filterList)) == related);
+            int other = rng() % n;
+            CHECK(graph.isReachable(name, entityName(other), filterList)
+                  == (mirror.distances(v, INT_MAX, false, &filter)[other] != -1));
+        }
+        CHECK_THROWS(graph.removeRelation(entityName(0), entityName(0), "never used"), EdgeNotFoundException);
+    }
+}
+
+static void checkTripleQueries() {
+    mt19937 rng(35);
+    vector<string> labels = {"", "a", "b"};
+    for (int trial = 0; trial < 60; trial++) {
+        KnowledgeGraph graph;
+        int n = 4 + rng() % 10;
+        for (int v = 0; v < n; v++) graph.addEntity(entityName(v));
+        set<tuple<int, int, int>> triples;
+        int m = rng() % 40;
+        for (int i = 0; i < m; i++) {
+            int subject = rng() % n, predicate = rng() % labels.size(), object = rng() % n;
+            graph.addRelation(entityName(subject), entityName(object), labels[predicate]);
+            triples.insert(make_tuple(subject, predicate, object));
+        }
+
+        vector<string> variables = {"?x", "?y", "?z"};
+        auto term = [&](bool predicate) -> string {
+            if (rng() % 2) return predicate ? "?p" : variables[rng() % variables.size()];
+            return predicate ? labels[rng() % labels.size()] : entityName(rng() % n);
+        };
+        vector<TriplePattern> patterns;
+        int patternCount = 1 + rng() % 3;
+        for (int i = 0; i < patternCount; i++) patterns.push_back(TriplePattern(term(false), term(true), term(false)));
+
+        TripleCursor cursor = graph.query(patterns);
+        vector<string> names = cursor.variables();
+        multiset<vector<string>> solutions;
+        while (cursor.next()) solutions.insert(cursor.row());
+
+        // every assignment of the variables, kept when each pattern is a stored triple
+        multiset<vector<string>> expected;
+        int count = names.size();
+        vector<int> values(count, 0);
+        function<void(int)> assign = [&](int k) {
+            if (k < count) {
+                int domain = (names[k] == "?p") ? labels.size() : n;
+                for (int value = 0; value < domain; value++) {
+                    values[k] = value;
+                    assign(k + 1);
+                }
+                return;
+            }
+            for (TriplePattern& pattern : patterns) {
+                string fields[3] = {pattern.subject, pattern.predicate, pattern.object};
+                int ids[3];
+                for (int position = 0; position < 3; position++) {
+                    string& field = fields[position];
+                    if (!field.empty() && field[0] == '?') {
+                        ids[position] = values[find(names.begin(), names.end(), field) - names.begin()];
+                    }
+                    else if (position == 1) ids[position] = find(labels.begin(), labels.end(), field) - labels.begin();
+                    else ids[position] = stoi(field.substr(1));
+                }
+                if (!triples.count(make_tuple(ids[0], ids[1], ids[2]))) return;
+            }
+            vector<string> row;
+            for (int i = 0; i < count; i++) row.push_back(names[i] == "?p" ? labels[values[i]] : entityName(values[i]));
+            expected.insert(row);
+        };
+        assign(0);
+        CHECK(solutions == expected);
+    }
+    KnowledgeGraph graph;
+    CHECK_THROWS(graph.query({}), InvalidQueryException);
+}
+
+static void checkBoundedQueries() {
+    mt19937 rng(36);
+    for (int trial = 0; trial < 30; trial++) {
+        KnowledgeGraph graph;
+        Mirror mirror;
+        int n = 2 + rng() % 30;
+        randomGraph(graph, mirror, n, rng() % (3 * n), rng);
+        string a = entityName(rng() % n), b = entityName(rng() % n);
+        QueryOptions unlimited;
+        BoundedResult<string> bfs = graph.bfsBounded(a, unlimited);
+        BoundedResult<string> dfs = graph.dfsBounded(a, unlimited);
+        BoundedResult<bool> reach = graph.isReachableBounded(a, b, unlimited);
+        BoundedResult<vector<string>> related = graph.getRelatedEntitiesBounded(a, 3, unlimited);
+        BoundedResult<string> ancestor = graph.findCommonAncestorsBounded(a, b, unlimited);
+        CHECK(bfs.value == graph.bfs(a) && !bfs.truncated);
+        CHECK(dfs.value == graph.dfs(a) && !dfs.truncated);
+        CHECK(reach.value == graph.isReachable(a, b) && !reach.truncated);
+        CHECK(related.value == graph.getRelatedEntities(a, 3) && !related.truncated);
+        CHECK(ancestor.value == graph.findCommonAncestors(a, b) && !ancestor.truncated);
+
+        QueryOptions limited;
+        limited.maxResults = 2;
+        related = graph.getRelatedEntitiesBounded(a, 3, limited);
+        CHECK(related.value.size() <= 2);
+        CHECK(related.truncated == (graph.getRelatedEntities(a, 3).size() > 2));
+    }
+
+    // a close common ancestor is found even when one side has a long ancestry
+    KnowledgeGraph graph;
+    graph.addEntity("x");
+    graph.addEntity("y");
+    graph.addEntity("parent");
+    for (int i = 0; i < 300; i++) graph.addEntity(entityName(i));
+    graph.addRelation(entityName(0), "x");
+    for (int i = 1; i < 300; i++) graph.addRelation(entityName(i), entityName(i - 1));
+    graph.addRelation("parent", "x");
+    graph.addRelation("parent", "y");
+    QueryOptions small;
+    small.maxVertices = 10;
+    BoundedResult<string> ancestor = graph.findCommonAncestorsBounded("x", "y", small);
+    CHECK(ancestor.value == "parent" && ancestor.truncated);
+
+    QueryOptions cancelled;
+    cancelled.token.cancel();
+    BoundedResult<string> bfs = graph.bfsBounded(entityName(299), cancelled);
+    CHECK(bfs.truncated && bfs.reason == TruncationReason::CANCELLED);
+    QueryOptions few;
+    few.maxVertices = 5;
+    BoundedResult<bool> reach = graph.isReachableBounded(entityName(299), "x", few);
+    CHECK(!reach.value && reach.truncated && reach.reason == TruncationReason::VERTEX_LIMIT);
+}
+
+static void checkPaging() {
+    mt19937 rng(37);
+    for (int trial = 0; trial < 30; trial++) {
+        KnowledgeGraph graph;
+        Mirror mirror;
+        int n = 3 + rng() % 40;
+        randomGraph(graph, mirror, n, rng() % (3 * n), rng);
+        string start = entityName(rng() % n);
+        int pageSize = 1 + rng() % 5, depth = rng() % 4;
+
+        auto collect = [&](ResultPage page) {
+            vector<string> all = page.entities;
+            while (page.cursor != "") {
+                CHECK((int)page.entities.size() <= pageSize);
+                // a cursor may be replayed
+                if (rng() % 4 == 0) CHECK(graph.nextPage(page.cursor, pageSize).entities
+                                          == graph.nextPage(page.cursor, pageSize).entities);
+                page = graph.nextPage(page.cursor, pageSize);
+                all.insert(all.end(), page.entities.begin(), page.entities.end());
+            }
+            return all;
+        };
+        vector<string> related = graph.getRelatedEntities(start, depth);
+        CHECK(asSet(related) == mirror.related(stoi(start.substr(1)), depth));
+        CHECK(collect(graph.pageRelatedEntities(start, depth, pageSize)) == related);
+        CHECK(collect(graph.pageNeighbors(start, pageSize)) == graph.getNeighbors(start));
+        CHECK(collect(graph.pageAllEntities(pageSize)) == graph.getAllEntities());
+        CHECK(collect(graph.pageBfs(start, pageSize)) == mirror.bfsOrder(stoi(start.substr(1))));
+
+        int offset = rng() % 4, limit = rng() % 4;
+        auto window = [offset, limit](const vector<string>& all) {
+            size_t first = min<size_t>(offset, all.size()), last = min<size_t>(offset + limit, all.size());
+            return vector<string>(all.begin() + first, all.begin() + last);
+        };
+        CHECK(graph.getRelatedEntities(start, depth, offset, limit) == window(related));
+        CHECK(graph.getNeighbors(start, offset, limit) == window(graph.getNeighbors(start)));
+        CHECK(graph.getAllEntities(offset, limit) == window(graph.getAllEntities()));
+        CHECK(graph.bfs(start, offset, limit) == window(mirror.bfsOrder(stoi(start.substr(1)))));
+        CHECK_THROWS(graph.getNeighbors(start, -1, limit), InvalidQueryException);
+        CHECK_THROWS(graph.bfs(start, offset, -1), InvalidQueryException);
+
+        ResultPage page = graph.pageAllEntities(1);
+        graph.addEntity("late");
+        if (page.cursor != "") CHECK_THROWS(graph.nextPage(page.cursor, 1), InvalidQueryException);
+    }
+    KnowledgeGraph graph;
+    CHECK_THROWS(graph.nextPage("garbage", 3), InvalidQueryException);
+}
+
+static void checkShardedGraph() {
+    mt19937 rng(38);
+    for (int trial = 0; trial < 20; trial++) {
+        int shards = 1 + rng() % 5;
+        ShardedKnowledgeGraph sharded(shards);
+        KnowledgeGraph graph;
+        int n = 2 + rng() % 40;
+        Mirror mirror(n);
+        for (int v = 0; v < n; v++) {
+            sharded.addEntity(entityName(v));
+            graph.addEntity(entityName(v));
+        }
+        int m = rng() % (3 * n);
+        for (int i = 0; i < m; i++) {
+            int from = rng() % n, to = rng() % n;
+            sharded.addRelation(entityName(from), entityName(to));
+            graph.addRelation(entityName(from), entityName(to));
+            mirror.add(from, to);
+        }
+        for (int v = 0; v < n; v++) CHECK(sharded.shardOf(entityName(v)) == sharded.shardOf(entityName(v)));
+        for (int q = 0; q < 8; q++) {
+            int a = rng() % n, b = rng() % n, depth = rng() % 4;
+            CHECK(sharded.isReachable(entityName(a), entityName(b)) == mirror.reaches(a, b));
+            CHECK(asSet(sharded.getRelatedEntities(entityName(a), depth)) == mirror.related(a, depth));
+            vector<string> bfs = sharded.bfs(entityName(a));
+            CHECK(!bfs.empty() && bfs[0] == entityName(a));
+            CHECK(bfs.size() == mirror.related(a, INT_MAX).size() + 1);
+            CHECK(sharded.getNeighbors(entityName(a)) == graph.getNeighbors(entityName(a)));
+        }
+        CHECK_THROWS(sharded.addEntity(entityName(0)), EntityExistsException);
+        CHECK_THROWS(sharded.addRelation(entityName(0), "missing"), EntityNotFoundException);
+    }
+}
+
+static void checkSpatialIndex() {
+    mt19937 rng(40);
+    uniform_real_distribution<double> coordinate(-10, 10);
+    for (int trial = 0; trial < 20; trial++) {
+        DGraphModel<Point> graph;
+        vector<Point> points;
+        int n = 1 + rng() % 200;
+        for (int i = 0; i < n; i++) {
+            Point point(coordinate(rng), coordinate(rng), trial % 2 ? coordinate(rng) : 0);
+            // points straddling a spatial hash cell boundary
+            if (rng() % 5 == 0 && !points.empty()) {
+                point = Point(points.back().getX() + 5e-7, points.back().getY(), points.back().getZ());
+            }
+            if (graph.contains(point)) continue;
+            graph.add(point);
+            points.push_back(point);
+        }
+        for (Point& point : points) CHECK(graph.contains(point));
+
+        KdTree tree(graph);
+        CHECK(tree.size() == (int)points.size());
+        for (int q = 0; q < 30; q++) {
+            Point query(coordinate(rng), coordinate(rng), coordinate(rng));
+            int k = rng() % 10;
+            vector<double> distances;
+            for (Point& point : points) distances.push_back(query.distanceTo(point));
+            sort(distances.begin(), distances.end());
+            vector<Point> nearest = tree.nearest(query, k);
+            CHECK((int)nearest.size() == min<int>(k, points.size()));
+            for (size_t i = 0; i < nearest.size(); i++) CHECK(fabs(query.distanceTo(nearest[i]) - distances[i]) < 1e-12);
+            double radius = coordinate(rng) + 10;
+            size_t inside = count_if(distances.begin(), distances.end(), [radius](double d) { return d <= radius; });
+            CHECK(tree.withinRadius(query, radius).size() == inside);
+        }
+        KdTree::connectKNearest(graph, 3);
+        for (Point& point : points) CHECK(graph.outDegree(point) == min<int>(3, points.size() - 1));
+    }
+}
+
+static void checkRouting() {
+    mt19937 rng(41);
+    uniform_real_distribution<double> coordinate(0, 100);
+    for (int trial = 0; trial < 20; trial++) {
+        DGraphModel<Point> graph;
+        vector<Point> points;
+        int n = 1 + rng() % 80;
+        for (int i = 0; i < n; i++) {
+            Point point(coordinate(rng), coordinate(rng));
+            if (graph.contains(point)) continue;
+            graph.add(point);
+            points.push_back(point);
+        }
+        n = points.size();
+        vector<vector<pair<int, double>>> out(n);
+        auto connect = [&](int from, int to) {
+            // geometric weights keep A* informed; arbitrary ones exercise the scale fallback
+            float weight = (trial % 2) ? (float)(rng() % 50) : (float)(points[from].distanceTo(points[to]) * (1 + rng() % 3));
+            graph.connect(points[from], points[to], weight);
+            out[from].push_back(make_pair(to, (double)weight));
+        };
+        for (int v = 0; v < n; v++) {
+            for (int k = 0; k < 3; k++) connect(v, rng() % n);
+        }
+
+        GeometricRouter router(graph);
+        if (trial % 4 == 1) router.buildLandmarks(1 + rng() % 4);
+        for (int round = 0; round < 2; round++) {
+            for (int q = 0; q < 20; q++) {
+                int source = rng() % n, target = rng() % n;
+                // O(n^2) Dijkstra
+                vector<double> distance(n, INFINITY);
+                vector<bool> done(n, false);
+                distance[source] = 0;
+                for (int step = 0; step < n; step++) {
+                    int u = -1;
+                    for (int v = 0; v < n; v++) {
+                        if (!done[v] && (u == -1 || distance[v] < distance[u])) u = v;
+                    }
+                    if (distance[u] == INFINITY) break;
+                    done[u] = true;
+                    for (auto& arc : out[u]) distance[arc.first] = min(distance[arc.first], distance[u] + arc.second);
+                }
+                for (int bidirectional = 0; bidirectional < 2; bidirectional++) {
+                    Route route = bidirectional ? router.routeBidirectional(points[source], points[target])
+                                                : router.route(points[source], points[target]);
+                    if (distance[target] == INFINITY) {
+                        CHECK(route.distance == -1 && route.path.empty());
+                        continue;
+                    }
+                    CHECK(fabs(route.distance - distance[target]) <= 1e-6 * max(1.0, distance[target]));
+                    CHECK(route.path.front() == points[source] && route.path.back() == points[target]);
+                }
+            }
+            // the router notices the change and refreshes
+            for (int k = 0; k < 5; k++) connect(rng() % n, rng() % n);
+        }
+    }
+
+    DGraphModel<Point> graph;
+    vector<Point> points;
+    for (int i = 0; i < 500; i++) {
+        Point point(coordinate(rng), coordinate(rng));
+        if (graph.contains(point)) continue;
+        graph.add(point);
+        points.push_back(point);
+    }
+    KdTree::connectKNearest(graph, 5);
+    GeometricRouter router(graph);
+    atomic<int> failures(0);
+    vector<thread> routers;
+    for (int t = 0; t < 4; t++) {
+        routers.push_back(thread([&, t]() {
+            mt19937 local(t);
+            for (int q = 0; q < 20; q++) {
+                Point& from = points[local() % points.size()];
+                Point& to = points[local() % points.size()];
+                Route one = router.route(from, to), two = router.routeBidirectional(from, to);
+                if (fabs(one.distance - two.distance) > 1e-6 * max(1.0, one.distance)) failures++;
+            }
+        }));
+    }
+    for (thread& worker : routers) worker.join();
+    CHECK(failures == 0);
+
+    DGraphModel<Point> negative;
+    negative.add(Point(0, 0));
+    negative.add(Point(1, 0));
+    negative.connect(Point(0, 0), Point(1, 0), -1);
+    CHECK_THROWS(GeometricRouter rejecting(negative), InvalidQueryException);
+}
+
+static void checkChangeFeed() {
+    KnowledgeGraph graph;
+    graph.addEntity("before");
+    ChangeSubscription subscription = graph.subscribe();
+    vector<ChangeEvent> expected;
+    map<tuple<string, string, string>, deque<float>> live;
+    mt19937 rng(42);
+    int entities = 1;
+    for (int op = 0; op < 200; op++) {
+        if (rng() % 3 == 0) {
+            string name = entityName(entities++);
+            graph.addEntity(name);
+            expected.push_back(ChangeEvent{0, ChangeType::ENTITY_ADDED, name, "", "", 0});
+            continue;
+        }
+        int picked = rng() % entities;
+        string from = picked ? entityName(picked) : "before";
+        string to = "before";
+        string label = (rng() % 2) ? "knows" : "";
+        float weight = 1 + rng() % 4;
+        graph.addRelation(from, to, label, weight);
+        expected.push_back(ChangeEvent{0, ChangeType::RELATION_ADDED, from, to, label, weight});
+        deque<float>& parallel = live[make_tuple(from, to, label)];
+        parallel.push_back(weight);
+        if (rng() % 4 == 0) {
+            // the oldest matching relation goes
+            graph.removeRelation(from, to, label);
+            expected.push_back(ChangeEvent{0, ChangeType::RELATION_REMOVED, from, to, label, parallel.front()});
+            parallel.pop_front();
+        }
+    }
+    vector<ChangeEvent> events;
+    for (vector<ChangeEvent> batch = subscription.poll(7); !batch.empty(); batch = subscription.poll(7)) {
+        events.insert(events.end(), batch.begin(), batch.end());
+    }
+    CHECK(!subscription.overrun());
+    CHECK(events.size() == expected.size());
+    for (size_t i = 0; i < events.size(); i++) {
+        CHECK(events[i].sequence == i + 1);
+        CHECK(events[i].type == expected[i].type && events[i].from == expected[i].from);
+        if (events[i].type == ChangeType::ENTITY_ADDED) continue;
+        CHECK(events[i].to == expected[i].to && events[i].label == expected[i].label);
+        CHECK(events[i].weight == expected[i].weight);
+    }
+
+    // events published before a clear still name the old entities
+    graph.clear();
+    graph.addEntity("after");
+    events = subscription.poll();
+    CHECK(events.size() == 2 && events[0].type == ChangeType::CLEARED && events[1].from == "after");
+
+    // a reader polling concurrently sees contiguous sequences or an overrun
+    KnowledgeGraph busy;
+    busy.enableChangeFeed(64);
+    ChangeSubscription reader = busy.subscribe();
+    atomic<bool> done(false);
+    atomic<int> failures(0);
+    thread consumer([&]() {
+        ChangeSubscription local = reader;
+        unsigned long long next = local.position();
+        while (true) {
+            bool finished = done.load();
+            vector<ChangeEvent> batch = local.poll(32);
+            for (ChangeEvent& event : batch) {
+                if (event.sequence != next++) failures++;
+                if (event.type == ChangeType::ENTITY_ADDED && event.from[0] != 'n') failures++;
+            }
+            if (local.overrun()) {
+                local = busy.subscribe();
+                next = local.position();
+            }
+            if (finished && batch.empty()) break;
+        }
+    });
+    for (int i = 0; i < 5000; i++) {
+        busy.addEntity("n" + to_string(i));
+        if (i > 0) busy.addRelation("n" + to_string(i), "n" + to_string(i - 1));
+    }
+    done = true;
+    consumer.join();
+    CHECK(failures == 0);
+}
+
+static void checkRandomWalks() {
+    mt19937 rng(43);
+    KnowledgeGraph graph;
+    Mirror mirror;
+    int n = 60;
+    randomGraph(graph, mirror, n, 2 * n, rng);
+    vector<set<int>> successors(n);
+    for (int v = 0; v < n; v++) {
+        for (Mirror::Arc& arc : mirror.out[v]) successors[v].insert(arc.to);
+    }
+
+    RandomWalkOptions options;
+    options.walkLength = 12;
+    options.walksPerVertex = 3;
+    options.p = 0.5f;
+    options.q = 2.0f;
+    vector<vector<int>> byThreads[2];
+    for (int run = 0; run < 2; run++) {
+        options.threads = run ? 4 : 1;
+        mutex collected;
+        long long count = graph.randomWalks(options, [&](const vector<int>& walk) {
+            lock_guard<mutex> guard(collected);
+            byThreads[run].push_back(walk);
+        });
+        CHECK(count == (long long)n * options.walksPerVertex);
+        for (vector<int>& walk : byThreads[run]) {
+            CHECK(!walk.empty() && (int)walk.size() <= options.walkLength);
+            for (size_t i = 1; i < walk.size(); i++) CHECK(successors[walk[i - 1]].count(walk[i]));
+            // walks only stop early at a vertex without out-edges
+            if ((int)walk.size() < options.walkLength) CHECK(successors[walk.back()].empty());
+        }
+        sort(byThreads[run].begin(), byThreads[run].end());
+    }
+    CHECK(byThreads[0] == byThreads[1]);
+
+    // first-order steps follow the edge weights
+    KnowledgeGraph star;
+    for (int v = 0; v < 4; v++) star.addEntity(entityName(v));
+    star.addRelation(entityName(0), entityName(1), 1);
+    star.addRelation(entityName(0), entityName(2), 3);
+    star.addRelation(entityName(0), entityName(3), 0);
+    RandomWalkOptions first;
+    first.walkLength = 2;
+    first.walksPerVertex = 20000;
+    vector<long long> hits(4, 0);
+    mutex counted;
+    star.randomWalks(first, [&](const vector<int>& walk) {
+        lock_guard<mutex> guard(counted);
+        if (walk[0] == 0) hits[walk[1]]++;
+    });
+    CHECK(hits[3] == 0);
+    CHECK(fabs(hits[2] / (double)(hits[1] + hits[2]) - 0.75) < 0.02);
+
+    for (float bad : {0.0f, -1.0f, INFINITY, NAN}) {
+        options.p = bad;
+        CHECK_THROWS(graph.randomWalks(options, [](const vector<int>&) {}), InvalidQueryException);
+    }
+    options.p = 1;
+    atomic<int> calls(0);
+    CHECK_THROWS(graph.randomWalks(options, [&](const vector<int>&) {
+        if (++calls == 20) throw std::runtime_error("sink");
+    }), std::runtime_error);
+}
+
+static void checkTriangles() {
+    mt19937 rng(44);
+    for (int trial = 0; trial < 40; trial++) {
+        int n = 1 + rng() % 80;
+        DGraphModel<int> graph;
+        for (int v = 0; v < n; v++) graph.add(v);
+        vector<vector<char>> adjacent(n, vector<char>(n, 0));
+        int m = rng() % (6 * n + 1);
+        for (int i = 0; i < m; i++) {
+            // a dense corner makes some lists long enough for the SIMD path
+            int a = rng() % n, b = (trial % 3 == 0) ? rng() % min(n, 8) : rng() % n;
+            graph.connect(a, b, 1);
+            if (a != b) adjacent[a][b] = adjacent[b][a] = 1;
+        }
+        // a hub makes the lists lopsided enough to gallop
+        if (trial % 2) {
+            for (int v = 1; v < n; v++) {
+                graph.connect(0, v, 1);
+                adjacent[0][v] = adjacent[v][0] = 1;
+            }
+        }
+
+        TriangleCounts counts = graph.countTriangles(1 + trial % 4);
+        long long total = 0;
+        vector<long long> perVertex(n, 0);
+        for (int a = 0; a < n; a++) {
+            for (int b = a + 1; b < n; b++) {
+                if (!adjacent[a][b]) continue;
+                for (int c = b + 1; c < n; c++) {
+                    if (!adjacent[a][c] || !adjacent[b][c]) continue;
+                    total++;
+                    perVertex[a]++;
+                    perVertex[b]++;
+                    perVertex[c]++;
+                }
+            }
+        }
+        CHECK(counts.total == total);
+        for (int v = 0; v < n; v++) {
+            CHECK(counts.perVertex[v] == perVertex[v]);
+            int degree = count(adjacent[v].begin(), adjacent[v].end(), 1);
+            double clustering = (degree >= 2) ? perVertex[v] / (degree * (degree - 1) / 2.0) : 0;
+            CHECK(fabs(counts.clustering[v] - clustering) < 1e-12);
+        }
+    }
+}
+
+static void checkWatches() {
+    mt19937 rng(45);
+    for (int trial = 0; trial < 20; trial++) {
+        KnowledgeGraph graph;
+        Mirror mirror;
+        int n = 2 + rng() % 30;
+        randomGraph(graph, mirror, n, n, rng);
+        vector<int> ids, starts, depths;
+        vector<map<string, int>> replayed;
+        for (int w = 0; w < 4; w++) {
+            starts.push_back(rng() % n);
+            depths.push_back(rng() % 5);
+            ids.push_back(graph.watch(entityName(starts.back()), depths.back()));
+            map<string, int> members;
+            for (string& name : graph.watchedEntities(ids.back())) members[name] = graph.watchDistance(ids.back(), name);
+            replayed.push_back(members);
+        }
+        for (int op = 0; op < 100; op++) {
+            int from = rng() % n;
+            if (mirror.out[from].empty() || rng() % 2) {
+                int to = rng() % n;
+                graph.addRelation(entityName(from), entityName(to));
+                mirror.add(from, to);
+            }
+            else {
+                int to = mirror.out[from][rng() % mirror.out[from].size()].to;
+                graph.removeRelation(entityName(from), entityName(to));
+                mirror.remove(from, to);
+            }
+
+            for (size_t w = 0; w < ids.size(); w++) {
+                // replaying the deltas reproduces the watched set
+                for (WatchDelta& delta : graph.pollWatch(ids[w])) {
+                    bool known = replayed[w].count(delta.entity);
+                    if (delta.change == WatchChange::LEFT) {
+                        CHECK(known);
+                        replayed[w].erase(delta.entity);
+                        continue;
+                    }
+                    CHECK(known == (delta.change == WatchChange::DISTANCE_CHANGED));
+                    replayed[w][delta.entity] = delta.distance;
+                }
+                vector<int> distance = mirror.distances(starts[w], depths[w]);
+                map<string, int> expected;
+                for (int v = 0; v < n; v++) {
+                    if (v != starts[w] && distance[v] != -1) expected[entityName(v)] = distance[v];
+                }
+                CHECK(replayed[w] == expected);
+                vector<string> watched = graph.watchedEntities(ids[w]);
+                CHECK(watched.size() == expected.size());
+                for (size_t i = 0; i < watched.size(); i++) {
+                    CHECK(graph.watchDistance(ids[w], watched[i]) == expected[watched[i]]);
+                    if (i > 0) CHECK(expected[watched[i - 1]] <= expected[watched[i]]);
+                }
+            }
+        }
+        graph.unwatch(ids[0]);
+        CHECK_THROWS(graph.pollWatch(ids[0]), InvalidQueryException);
+        graph.clear();
+        for (size_t w = 1; w < ids.size(); w++) {
+            CHECK(graph.pollWatch(ids[w]).size() == replayed[w].size());
+            CHECK(graph.watchedEntities(ids[w]).empty());
+        }
+    }
+}
+
+// =============================================================================
+// Runner
+// =============================================================================
+
+struct NamedCheck {
+    const char* name;
+    void (*run)();
+};
+
+static const NamedCheck CHECKS[] = {
+    {"edge-index", checkEdgeIndex},
+    {"traversal-layout", checkTraversalLayout},
+    {"condensation", checkCondensation},
+    {"query-executor", checkQueryExecutor},
+    {"concurrent-readers", checkConcurrentReaders},
+    {"compressed", checkCompressedGraph},
+    {"paged", checkPagedGraph},
+    {"pagerank", checkPersonalizedPageRank},
+    {"prefix-index", checkPrefixIndex},
+    {"labels", checkLabelledRelations},
+    {"triples", checkTripleQueries},
+    {"bounded", checkBoundedQueries},
+    {"paging", checkPaging},
+    {"sharded", checkShardedGraph},
+    {"spatial", checkSpatialIndex},
+    {"routing", checkRouting},
+    {"change-feed", checkChangeFeed},
+    {"random-walks", checkRandomWalks},
+    {"triangles", checkTriangles},
+    {"watches", checkWatches},
+};
+
+int main(int argc, char** argv) {
+    int ran = 0, failed = 0;
+    for (const NamedCheck& check : CHECKS) {
+        if (argc > 1 && find(argv + 1, argv + argc, string(check.name)) == argv + argc) continue;
+        ran++;
+        try {
+            check.run();
+            cout << "ok      " << check.name << "\n";
+        }
+        catch (exception& e) {
+            failed++;
+            cout << "FAILED  " << check.name << ": " << e.what() << "\n";
+        }
+    }
+    cout << (ran - failed) << "/" << ran << " checks passed\n";
+    return (failed == 0) ? 0 : 1;
+}